@@ -0,0 +1,470 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Flat, pointer free images of a struct newd_conf. An image is a header
+ * holding the global settings, followed by one record per source file the
+ * config was parsed from and one record per group. Everything after the
+ * checksum field is covered by the checksum.
+ *
+ * The same images are used as shared memory snapshots (without sources)
+ * and as the compiled config cache written by newd -n -C.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <siphash.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "newd.h"
+
+#define CONF_IMAGE_MAGIC	0x6e657764	/* "newd" */
+#define CONF_IMAGE_VERSION	7
+
+struct conf_image_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;
+	uint64_t	checksum;
+	uint64_t	generation;
+	uint32_t	nsources;
+	uint32_t	ngroups;
+	int32_t		yesno;
+	int32_t		integer;
+	int32_t		latency_threshold;
+	int32_t		engines;
+	int32_t		frontends;
+	int32_t		control_backlog;
+	int32_t		control_queue;
+	int32_t		control_timeout;
+	char		global_text[NEWD_MAXTEXT];
+};
+
+struct conf_image_source {
+	char		path[PATH_MAX];
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	int64_t		size;
+};
+
+struct conf_image_group {
+	char		name[NEWD_MAXGROUPNAME];
+	int32_t		yesno;
+	int32_t		integer;
+	int32_t		group_v4_bits;
+	int32_t		group_v6_bits;
+	struct in_addr	group_v4address;
+	struct in6_addr	group_v6address;
+};
+
+/* Checksums are only meant to catch corruption, so any fixed key does. */
+static const SIPHASH_KEY	conf_image_key;
+
+static uint32_t	config_image_nsources(struct conf_sources *);
+static uint64_t	config_image_checksum(const void *, size_t);
+static int	config_image_fresh(const void *, const char *);
+
+static uint32_t
+config_image_nsources(struct conf_sources *sources)
+{
+	struct conf_source	*src;
+	uint32_t		 n = 0;
+
+	if (sources != NULL)
+		TAILQ_FOREACH(src, sources, entry)
+			n++;
+	return (n);
+}
+
+static uint64_t
+config_image_checksum(const void *buf, size_t len)
+{
+	size_t	off = offsetof(struct conf_image_hdr, checksum) +
+		    sizeof(uint64_t);
+
+	return (SipHash24(&conf_image_key, (const char *)buf + off,
+	    len - off));
+}
+
+size_t
+config_image_size(struct newd_conf *conf, struct conf_sources *sources)
+{
+	return (sizeof(struct conf_image_hdr) +
+	    config_image_nsources(sources) * sizeof(struct conf_image_source) +
+	    conf->group_count * sizeof(struct conf_image_group));
+}
+
+/*
+ * Write the image of conf, parsed from sources (which may be NULL), into
+ * buf. buf must provide at least config_image_size() bytes.
+ */
+void
+config_image_write(struct newd_conf *conf, struct conf_sources *sources,
+    void *buf)
+{
+	struct conf_image_hdr		*hdr = buf;
+	struct conf_image_source	*is;
+	struct conf_image_group		*ig;
+	struct conf_source		*src;
+	struct group			*g;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->magic = CONF_IMAGE_MAGIC;
+	hdr->version = CONF_IMAGE_VERSION;
+	hdr->size = config_image_size(conf, sources);
+	hdr->nsources = config_image_nsources(sources);
+	hdr->ngroups = conf->group_count;
+	hdr->generation = conf->generation;
+	hdr->yesno = conf->yesno;
+	hdr->integer = conf->integer;
+	hdr->latency_threshold = conf->latency_threshold;
+	hdr->engines = conf->engines;
+	hdr->frontends = conf->frontends;
+	hdr->control_backlog = conf->control_backlog;
+	hdr->control_queue = conf->control_queue;
+	hdr->control_timeout = conf->control_timeout;
+	memcpy(hdr->global_text, conf->global_text, sizeof(hdr->global_text));
+
+	is = (struct conf_image_source *)(hdr + 1);
+	if (sources != NULL) {
+		TAILQ_FOREACH(src, sources, entry) {
+			memset(is, 0, sizeof(*is));
+			strlcpy(is->path, src->path, sizeof(is->path));
+			is->mtime_sec = src->mtime.tv_sec;
+			is->mtime_nsec = src->mtime.tv_nsec;
+			is->size = src->size;
+			is++;
+		}
+	}
+
+	ig = (struct conf_image_group *)is;
+	LIST_FOREACH(g, &conf->group_list, entry) {
+		memset(ig, 0, sizeof(*ig));
+		memcpy(ig->name, g->name, sizeof(ig->name));
+		ig->yesno = g->yesno;
+		ig->integer = g->integer;
+		ig->group_v4_bits = g->group_v4_bits;
+		ig->group_v6_bits = g->group_v6_bits;
+		ig->group_v4address = g->group_v4address;
+		ig->group_v6address = g->group_v6address;
+		ig++;
+	}
+
+	hdr->checksum = config_image_checksum(buf, hdr->size);
+}
+
+/*
+ * Build a new config from the image in buf. Returns NULL if buf does not
+ * hold a valid image.
+ */
+struct newd_conf *
+config_image_read(const void *buf, size_t len)
+{
+	const struct conf_image_hdr	*hdr = buf;
+	const struct conf_image_group	*ig;
+	struct newd_conf		*xconf;
+	struct group			*g;
+	size_t				 off;
+	uint32_t			 i;
+
+	if (len < sizeof(*hdr) || hdr->magic != CONF_IMAGE_MAGIC ||
+	    hdr->version != CONF_IMAGE_VERSION || hdr->size != len ||
+	    hdr->engines < 0 || hdr->engines > NEWD_MAXENGINES ||
+	    hdr->frontends < 0 || hdr->frontends > NEWD_MAXFRONTENDS ||
+	    hdr->control_backlog < 0 || hdr->control_queue < 0 ||
+	    hdr->control_timeout < 0 ||
+	    hdr->nsources > (len - sizeof(*hdr)) /
+	    sizeof(struct conf_image_source)) {
+		log_warnx("%s: invalid config image", __func__);
+		return (NULL);
+	}
+	off = sizeof(*hdr) + hdr->nsources * sizeof(struct conf_image_source);
+	if ((len - off) / sizeof(*ig) != hdr->ngroups ||
+	    (len - off) % sizeof(*ig) != 0) {
+		log_warnx("%s: invalid config image", __func__);
+		return (NULL);
+	}
+	if (config_image_checksum(buf, len) != hdr->checksum) {
+		log_warnx("%s: config image checksum mismatch", __func__);
+		return (NULL);
+	}
+
+	xconf = config_new_empty();
+	xconf->generation = hdr->generation;
+	xconf->yesno = hdr->yesno;
+	xconf->integer = hdr->integer;
+	xconf->latency_threshold = hdr->latency_threshold;
+	xconf->engines = hdr->engines;
+	xconf->frontends = hdr->frontends;
+	xconf->control_backlog = hdr->control_backlog;
+	xconf->control_queue = hdr->control_queue;
+	xconf->control_timeout = hdr->control_timeout;
+	memcpy(xconf->global_text, hdr->global_text,
+	    sizeof(xconf->global_text));
+	xconf->global_text[sizeof(xconf->global_text) - 1] = '\0';
+
+	/* group_insert() prepends, so go backwards to keep the order. */
+	config_reserve_groups(xconf, hdr->ngroups);
+	ig = (const struct conf_image_group *)((const char *)buf + off) +
+	    hdr->ngroups;
+	for (i = 0; i < hdr->ngroups; i++) {
+		ig--;
+		if (memchr(ig->name, '\0', sizeof(ig->name)) == NULL ||
+		    group_find(xconf, ig->name) != NULL) {
+			log_warnx("%s: invalid group in config image",
+			    __func__);
+			config_clear(xconf);
+			return (NULL);
+		}
+		g = group_alloc(xconf);
+		memcpy(g->name, ig->name, sizeof(g->name));
+		g->yesno = ig->yesno;
+		g->integer = ig->integer;
+		g->group_v4_bits = ig->group_v4_bits;
+		g->group_v6_bits = ig->group_v6_bits;
+		g->group_v4address = ig->group_v4address;
+		g->group_v6address = ig->group_v6address;
+		group_insert(xconf, g);
+	}
+
+	return (xconf);
+}
+
+/*
+ * Read the config image in the shared memory object fd. fd is closed.
+ */
+struct newd_conf *
+config_image_map(int fd)
+{
+	struct newd_conf	*xconf = NULL;
+	struct stat		 st;
+	void			*p;
+
+	if (fstat(fd, &st) == -1) {
+		log_warn("%s: fstat", __func__);
+		goto done;
+	}
+	if (st.st_size <= 0) {
+		log_warnx("%s: empty config image", __func__);
+		goto done;
+	}
+	if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		log_warn("%s: mmap", __func__);
+		goto done;
+	}
+
+	xconf = config_image_read(p, st.st_size);
+	munmap(p, st.st_size);
+done:
+	close(fd);
+	return (xconf);
+}
+
+/*
+ * Return a shared memory object holding the image of conf or -1.
+ */
+int
+config_image_shm(struct newd_conf *conf)
+{
+	char	 path[] = "/tmp/newd.conf.XXXXXXXXXX";
+	size_t	 len;
+	void	*p;
+	int	 fd;
+
+	if ((fd = shm_mkstemp(path)) == -1) {
+		log_warn("%s: shm_mkstemp", __func__);
+		return (-1);
+	}
+	shm_unlink(path);
+
+	len = config_image_size(conf, NULL);
+	if (ftruncate(fd, len) == -1) {
+		log_warn("%s: ftruncate", __func__);
+		close(fd);
+		return (-1);
+	}
+	if ((p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		log_warn("%s: mmap", __func__);
+		close(fd);
+		return (-1);
+	}
+	config_image_write(conf, NULL, p);
+	munmap(p, len);
+
+	return (fd);
+}
+
+/*
+ * Return 1 if the image in buf, which has passed config_image_read(), was
+ * compiled from conffile and none of its sources have changed since.
+ */
+static int
+config_image_fresh(const void *buf, const char *conffile)
+{
+	const struct conf_image_hdr	*hdr = buf;
+	const struct conf_image_source	*is;
+	struct stat			 st;
+	uint32_t			 i;
+
+	is = (const struct conf_image_source *)(hdr + 1);
+	if (hdr->nsources == 0 || strncmp(is->path, conffile,
+	    sizeof(is->path)) != 0)
+		return (0);
+
+	for (i = 0; i < hdr->nsources; i++, is++) {
+		if (memchr(is->path, '\0', sizeof(is->path)) == NULL ||
+		    stat(is->path, &st) == -1)
+			return (0);
+		if (st.st_mtim.tv_sec != is->mtime_sec ||
+		    st.st_mtim.tv_nsec != is->mtime_nsec ||
+		    st.st_size != is->size) {
+			log_debug("%s: %s changed", __func__, is->path);
+			return (0);
+		}
+	}
+	return (1);
+}
+
+/*
+ * Load the compiled config in cache if it is up to date with conffile and
+ * everything it includes. Returns NULL if the config has to be parsed.
+ */
+struct newd_conf *
+config_cache_load(const char *cache, const char *conffile)
+{
+	struct newd_conf	*xconf;
+	int			 fresh;
+
+	if ((xconf = config_cache_read(cache, conffile, &fresh)) != NULL &&
+	    !fresh) {
+		log_debug("%s: %s is out of date", __func__, cache);
+		config_clear(xconf);
+		xconf = NULL;
+	}
+
+	return (xconf);
+}
+
+/*
+ * Read the compiled config in cache, up to date with conffile or not, and
+ * set fresh to which. Returns NULL if cache holds no valid image.
+ */
+struct newd_conf *
+config_cache_read(const char *cache, const char *conffile, int *fresh)
+{
+	struct newd_conf	*xconf = NULL;
+	struct stat		 st;
+	void			*p;
+	int			 fd;
+
+	if ((fd = open(cache, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			log_warn("%s: %s", __func__, cache);
+		return (NULL);
+	}
+	if (check_file_secrecy(fd, cache) == -1 || fstat(fd, &st) == -1 ||
+	    st.st_size <= 0) {
+		close(fd);
+		return (NULL);
+	}
+	if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+	    MAP_FAILED) {
+		log_warn("%s: mmap", __func__);
+		close(fd);
+		return (NULL);
+	}
+	close(fd);
+
+	if ((xconf = config_image_read(p, st.st_size)) != NULL)
+		*fresh = config_image_fresh(p, conffile);
+	munmap(p, st.st_size);
+
+	return (xconf);
+}
+
+/*
+ * Compile conf, parsed from sources, into cache. The image is written to
+ * a temporary file first and renamed, so readers never see a partial one.
+ */
+int
+config_cache_write(struct newd_conf *conf, struct conf_sources *sources,
+    const char *cache)
+{
+	char	 path[PATH_MAX];
+	size_t	 len;
+	void	*p;
+	int	 fd;
+
+	if ((size_t)snprintf(path, sizeof(path), "%s.XXXXXXXXXX", cache) >=
+	    sizeof(path)) {
+		log_warnx("%s: %s: name too long", __func__, cache);
+		return (-1);
+	}
+	if ((fd = mkstemp(path)) == -1) {
+		log_warn("%s: mkstemp", __func__);
+		return (-1);
+	}
+
+	len = config_image_size(conf, sources);
+	if ((p = malloc(len)) == NULL) {
+		log_warn("%s", __func__);
+		goto fail;
+	}
+	config_image_write(conf, sources, p);
+	if (write(fd, p, len) != (ssize_t)len) {
+		log_warn("%s: write %s", __func__, path);
+		free(p);
+		goto fail;
+	}
+	free(p);
+
+	if (fsync(fd) == -1 || close(fd) == -1) {
+		log_warn("%s: %s", __func__, path);
+		unlink(path);
+		return (-1);
+	}
+	if (rename(path, cache) == -1) {
+		log_warn("%s: rename %s", __func__, cache);
+		unlink(path);
+		return (-1);
+	}
+	return (0);
+
+fail:
+	close(fd);
+	unlink(path);
+	return (-1);
+}
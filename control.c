@@ -19,6 +19,7 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/uio.h>
 #include <sys/un.h>
 
@@ -28,6 +29,7 @@
 #include <event.h>
 #include <imsg.h>
 #include <md5.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -37,11 +39,100 @@
 #include "control.h"
 #include "frontend.h"
 
-#define	CONTROL_BACKLOG	5
+#define	CONTROL_BACKLOG	128	/* defaults of the control-* options */
+#define	CONTROL_QUEUE	4096	/* kilobytes */
+#define	CONTROL_TIMEOUT	60	/* seconds */
 
-struct ctl_conn	*control_connbyfd(int);
-struct ctl_conn	*control_connbypid(pid_t);
-void		 control_close(int);
+#define	CONTROL_REQHASH_SIZE	1024	/* must be a power of 2 */
+#define	CONTROL_REQHASH(id)	\
+	(&control_reqhash[(id) & (CONTROL_REQHASH_SIZE - 1)])
+
+#define	CONTROL_CACHE_MAX	64	/* replies kept */
+#define	CONTROL_CACHE_MAXBYTES	(32 * 1024 * 1024)
+
+#define	CONTROL_NOTIFY_MAXGROUPS	4096	/* beyond that, only say so */
+
+#define	MINIMUM(a, b)	(((a) < (b)) ? (a) : (b))
+#define	MAXIMUM(a, b)	(((a) > (b)) ? (a) : (b))
+
+/* The event argument of a connection is the imsgev embedded in it. */
+#define	CONTROL_CONN(p)	\
+	((struct ctl_conn *)((char *)(p) - offsetof(struct ctl_conn, iev)))
+
+/* Requests in flight by id. */
+LIST_HEAD(, ctl_req)	control_reqhash[CONTROL_REQHASH_SIZE];
+uint32_t		control_reqid;
+
+struct {
+	uint64_t	accepted;
+	uint64_t	closed;
+	uint64_t	active;
+	uint64_t	requests;
+	uint64_t	cache_hits;
+	uint64_t	cache_misses;
+	uint64_t	cache_flushes;
+	uint64_t	not_modified;
+	uint64_t	subscribers;
+	uint64_t	notifications;
+	uint64_t	pauses;
+	uint64_t	stalled;
+} control_counters;
+
+/*
+ * Replies to IMSG_CTL_SHOW_ENGINE_INFO by filter, most recently used
+ * first. An engine tells us with IMSG_RECONF_END when it has a new
+ * config, and then they all go. control_cache_gen counts those flushes,
+ * so that replies still coming in from before one are not cached. A reply
+ * still being sent out of the cache outlives its removal.
+ */
+struct ctl_cache {
+	TAILQ_ENTRY(ctl_cache)	 entry;
+	char			 filter[NEWD_MAXGROUPNAME];
+	struct ctl_engine_info	*cei;
+	size_t			 count;
+	size_t			 size;	/* records allocated */
+	int			 refs;	/* the cache and requests sending it */
+};
+
+TAILQ_HEAD(ctl_cache_head, ctl_cache)	control_cache =
+    TAILQ_HEAD_INITIALIZER(control_cache);
+size_t			control_cache_count;
+size_t			control_cache_bytes;
+uint64_t		control_cache_gen;
+
+/*
+ * Groups changed since subscribers were last notified. Without any
+ * subscribers nothing is recorded, the changes are just not known then.
+ */
+struct ctl_notify_group	*control_changes;
+size_t			 control_nchanges;
+size_t			 control_changes_size;
+int			 control_changes_full;
+uint64_t		 control_notified;	/* generation */
+
+struct ctl_req	*control_req_new(struct ctl_conn *, struct imsg *);
+struct ctl_req	*control_reqbyid(uint32_t);
+void		 control_req_free(struct ctl_req *);
+void		 control_close(struct ctl_conn *);
+int		 control_lookups_cmp(const void *, const void *);
+size_t		 control_queued(struct ctl_conn *);
+void		 control_queue_add(struct ctl_conn *, size_t);
+void		 control_pause(struct ctl_conn *);
+void		 control_resume(struct ctl_conn *);
+void		 control_written(struct imsgev *);
+void		 control_stall(int, short, void *);
+int		 control_not_modified(struct ctl_conn *, struct imsg *, size_t);
+void		 control_generation(struct ctl_conn *, uint32_t, pid_t);
+struct ctl_cache *control_cache_new(const char *);
+struct ctl_cache *control_cache_find(const char *);
+void		 control_cache_send(struct ctl_conn *, struct ctl_cache *,
+		     struct imsg *);
+void		 control_cache_replay(struct ctl_req *);
+void		 control_cache_unref(struct ctl_cache *);
+void		 control_cache_fill(struct ctl_req *, struct imsg *);
+void		 control_cache_insert(struct ctl_req *);
+void		 control_cache_free(struct ctl_cache *);
+void		 control_notify_send(struct ctl_conn *, struct ctl_notify *);
 
 int
 control_init(char *path)
@@ -96,6 +187,9 @@ control_listen(void)
 		log_warn("%s: listen", __func__);
 		return (-1);
 	}
+	control_state.backlog = CONTROL_BACKLOG;
+	control_state.queue_max = CONTROL_QUEUE * 1024;
+	control_state.timeout = CONTROL_TIMEOUT;
 
 	event_set(&control_state.ev, control_state.fd, EV_READ,
 	    control_accept, NULL);
@@ -105,6 +199,29 @@ control_listen(void)
 	return (0);
 }
 
+/*
+ * Apply the control-* options of conf. listen() again on the socket we
+ * already listen on just changes its backlog.
+ */
+void
+control_set_limits(struct newd_conf *conf)
+{
+	int	backlog;
+
+	backlog = conf->control_backlog != 0 ? conf->control_backlog :
+	    CONTROL_BACKLOG;
+	if (backlog != control_state.backlog) {
+		if (listen(control_state.fd, backlog) == -1)
+			log_warn("%s: listen", __func__);
+		else
+			control_state.backlog = backlog;
+	}
+	control_state.queue_max = (size_t)(conf->control_queue != 0 ?
+	    conf->control_queue : CONTROL_QUEUE) * 1024;
+	control_state.timeout = conf->control_timeout != 0 ?
+	    conf->control_timeout : CONTROL_TIMEOUT;
+}
+
 void
 control_cleanup(char *path)
 {
@@ -122,85 +239,132 @@ control_accept(int listenfd, short event, void *bula)
 	socklen_t		 len;
 	struct sockaddr_un	 sun;
 	struct ctl_conn		*c;
+	int			 i;
 
 	event_add(&control_state.ev, NULL);
 	if ((event & EV_TIMEOUT))
 		return;
 
-	len = sizeof(sun);
-	if ((connfd = accept4(listenfd, (struct sockaddr *)&sun, &len,
-	    SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
-		/*
-		 * Pause accept if we are out of file descriptors, or
-		 * libevent will haunt us here too.
-		 */
-		if (errno == ENFILE || errno == EMFILE) {
-			struct timeval evtpause = { 1, 0 };
-
-			event_del(&control_state.ev);
-			evtimer_add(&control_state.evt, &evtpause);
-		} else if (errno != EWOULDBLOCK && errno != EINTR &&
-		    errno != ECONNABORTED)
-			log_warn("%s: accept4", __func__);
-		return;
-	}
+	/* Take what queued up since the last time, up to a backlog full. */
+	for (i = 0; i < control_state.backlog; i++) {
+		len = sizeof(sun);
+		if ((connfd = accept4(listenfd, (struct sockaddr *)&sun,
+		    &len, SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
+			/*
+			 * Pause accept if we are out of file descriptors,
+			 * or libevent will haunt us here too.
+			 */
+			if (errno == ENFILE || errno == EMFILE) {
+				struct timeval evtpause = { 1, 0 };
 
-	if ((c = calloc(1, sizeof(struct ctl_conn))) == NULL) {
-		log_warn("%s: calloc", __func__);
-		close(connfd);
-		return;
-	}
+				event_del(&control_state.ev);
+				evtimer_add(&control_state.evt, &evtpause);
+			} else if (errno != EWOULDBLOCK && errno != EINTR &&
+			    errno != ECONNABORTED)
+				log_warn("%s: accept4", __func__);
+			return;
+		}
+
+		if ((c = calloc(1, sizeof(struct ctl_conn))) == NULL) {
+			log_warn("%s: calloc", __func__);
+			close(connfd);
+			return;
+		}
 
-	imsg_init(&c->iev.ibuf, connfd);
-	c->iev.handler = control_dispatch_imsg;
-	c->iev.events = EV_READ;
-	event_set(&c->iev.ev, c->iev.ibuf.fd, c->iev.events,
-	    c->iev.handler, &c->iev);
-	event_add(&c->iev.ev, NULL);
+		LIST_INIT(&c->reqs);
+		imsg_init(&c->iev.ibuf, connfd);
+		c->iev.handler = control_dispatch_imsg;
+		c->iev.written = control_written;
+		c->iev.peer = PROC_CONTROL;
+		c->iev.events = EV_READ;
+		event_set(&c->iev.ev, c->iev.ibuf.fd, c->iev.events,
+		    c->iev.handler, &c->iev);
+		event_add(&c->iev.ev, NULL);
+		evtimer_set(&c->stall_ev, control_stall, c);
 
-	TAILQ_INSERT_TAIL(&ctl_conns, c, entry);
+		TAILQ_INSERT_TAIL(&ctl_conns, c, entry);
+		control_counters.accepted++;
+		control_counters.active++;
+	}
 }
 
-struct ctl_conn *
-control_connbyfd(int fd)
+/*
+ * Track the request in imsg under a new id, unique among the requests in
+ * flight. Replies come back with that id and go out to c with the peerid
+ * and pid of imsg.
+ */
+struct ctl_req *
+control_req_new(struct ctl_conn *c, struct imsg *imsg)
 {
-	struct ctl_conn	*c;
+	struct ctl_req	*r;
 
-	TAILQ_FOREACH(c, &ctl_conns, entry) {
-		if (c->iev.ibuf.fd == fd)
-			break;
-	}
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		fatal(NULL);
+
+	do {
+		r->id = ++control_reqid;
+	} while (r->id == 0 || control_reqbyid(r->id) != NULL);
+	r->conn = c;
+	r->peerid = imsg->hdr.peerid;
+	r->pid = imsg->hdr.pid;
+	r->pending = 1;
 
-	return (c);
+	LIST_INSERT_HEAD(CONTROL_REQHASH(r->id), r, hash);
+	LIST_INSERT_HEAD(&c->reqs, r, entry);
+	control_counters.requests++;
+
+	return (r);
 }
 
-struct ctl_conn *
-control_connbypid(pid_t pid)
+struct ctl_req *
+control_reqbyid(uint32_t id)
 {
-	struct ctl_conn	*c;
+	struct ctl_req	*r;
 
-	TAILQ_FOREACH(c, &ctl_conns, entry) {
-		if (c->iev.ibuf.pid == pid)
+	LIST_FOREACH(r, CONTROL_REQHASH(id), hash) {
+		if (r->id == id)
 			break;
 	}
 
-	return (c);
+	return (r);
 }
 
 void
-control_close(int fd)
+control_req_free(struct ctl_req *r)
 {
-	struct ctl_conn	*c;
+	LIST_REMOVE(r, hash);
+	LIST_REMOVE(r, entry);
+	free(r->best);
+	free(r->batch);
+	if (r->fill != NULL)
+		control_cache_free(r->fill);
+	if (r->replay != NULL)
+		control_cache_unref(r->replay);
+	free(r);
+}
 
-	if ((c = control_connbyfd(fd)) == NULL) {
-		log_warnx("%s: fd %d: not found", __func__, fd);
-		return;
-	}
+void
+control_close(struct ctl_conn *c)
+{
+	struct ctl_req	*r;
 
 	msgbuf_clear(&c->iev.ibuf.w);
 	TAILQ_REMOVE(&ctl_conns, c, entry);
+	control_counters.closed++;
+	control_counters.active--;
+	if (c->subs != 0)
+		control_counters.subscribers--;
+
+	/* Replies still to come are dropped, dumps are not even made. */
+	while ((r = LIST_FIRST(&c->reqs)) != NULL) {
+		if (r->stream && r->replay == NULL)
+			frontend_imsg_compose_engines(IMSG_CTL_DUMP_CANCEL,
+			    r->id, 0, NULL, 0);
+		control_req_free(r);
+	}
 
-	event_del(&c->iev.ev);
+	evtimer_del(&c->stall_ev);
+	imsg_event_del(&c->iev);
 	close(c->iev.ibuf.fd);
 
 	/* Some file descriptors are available again. */
@@ -216,32 +380,35 @@ void
 control_dispatch_imsg(int fd, short event, void *bula)
 {
 	struct ctl_conn	*c;
+	struct ctl_req	*r;
 	struct imsg	 imsg;
+	struct ctl_addr	 ca;
+	struct ctl_cache *cc;
+	char		*name;
 	ssize_t		 n;
-	int		 verbose;
+	uint32_t	 opts;
+	int		 verbose, cacheable;
 
-	if ((c = control_connbyfd(fd)) == NULL) {
-		log_warnx("%s: fd %d: not found", __func__, fd);
-		return;
-	}
+	c = CONTROL_CONN(bula);
 
 	if (event & EV_READ) {
 		if (((n = imsg_read(&c->iev.ibuf)) == -1 && errno != EAGAIN) ||
 		    n == 0) {
-			control_close(fd);
+			control_close(c);
 			return;
 		}
 	}
 	if (event & EV_WRITE) {
 		if (msgbuf_write(&c->iev.ibuf.w) <= 0 && errno != EAGAIN) {
-			control_close(fd);
+			control_close(c);
 			return;
 		}
+		control_written(&c->iev);
 	}
 
 	for (;;) {
-		if ((n = imsg_get(&c->iev.ibuf, &imsg)) == -1) {
-			control_close(fd);
+		if ((n = imsg_get_event(&c->iev, &imsg)) == -1) {
+			control_close(c);
 			return;
 		}
 		if (n == 0)
@@ -249,7 +416,8 @@ control_dispatch_imsg(int fd, short event, void *bula)
 
 		switch (imsg.hdr.type) {
 		case IMSG_CTL_RELOAD:
-			frontend_imsg_compose_main(imsg.hdr.type, 0, NULL, 0);
+			frontend_imsg_compose_main(imsg.hdr.type, 0, 0, NULL,
+			    0);
 			break;
 		case IMSG_CTL_LOG_VERBOSE:
 			if (imsg.hdr.len != IMSG_HEADER_SIZE +
@@ -257,9 +425,10 @@ control_dispatch_imsg(int fd, short event, void *bula)
 				break;
 
 			/* Forward to all other processes. */
-			frontend_imsg_compose_main(imsg.hdr.type, imsg.hdr.pid,
-			    imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
-			frontend_imsg_compose_engine(imsg.hdr.type, 0,
+			frontend_imsg_compose_main(imsg.hdr.type, 0,
+			    imsg.hdr.pid, imsg.data,
+			    imsg.hdr.len - IMSG_HEADER_SIZE);
+			frontend_imsg_compose_engines(imsg.hdr.type, 0,
 			    imsg.hdr.pid, imsg.data,
 			    imsg.hdr.len - IMSG_HEADER_SIZE);
 
@@ -267,20 +436,123 @@ control_dispatch_imsg(int fd, short event, void *bula)
 			log_setverbose(verbose);
 			break;
 		case IMSG_CTL_SHOW_MAIN_INFO:
-			c->iev.ibuf.pid = imsg.hdr.pid;
-			frontend_imsg_compose_main(imsg.hdr.type, imsg.hdr.pid,
-			    imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
+			if (control_not_modified(c, &imsg, 0))
+				break;
+			r = control_req_new(c, &imsg);
+			frontend_imsg_compose_main(imsg.hdr.type, r->id,
+			    imsg.hdr.pid, NULL, 0);
 			break;
 		case IMSG_CTL_SHOW_FRONTEND_INFO:
-			frontend_showinfo_ctl(c);
-			imsg_compose_event(&c->iev, IMSG_CTL_END, 0, 0, -1,
-			    NULL, 0);
+			if (control_not_modified(c, &imsg, 0))
+				break;
+			frontend_showinfo_ctl(c, imsg.hdr.peerid,
+			    imsg.hdr.pid);
+			control_generation(c, imsg.hdr.peerid, imsg.hdr.pid);
+			imsg_compose_event(&c->iev, IMSG_CTL_END,
+			    imsg.hdr.peerid, imsg.hdr.pid, -1, NULL, 0);
+			break;
+		case IMSG_CTL_SHOW_STATS:
+		case IMSG_CTL_SHOW_LATENCY:
+		case IMSG_CTL_SHOW_TRACE:
+			/* Our own, then those of main and the engines. */
+			r = control_req_new(c, &imsg);
+			if (imsg.hdr.type == IMSG_CTL_SHOW_STATS)
+				frontend_showstats_ctl(c, imsg.hdr.peerid,
+				    imsg.hdr.pid);
+			else if (imsg.hdr.type == IMSG_CTL_SHOW_LATENCY)
+				frontend_showlatency_ctl(c, imsg.hdr.peerid,
+				    imsg.hdr.pid);
+			else
+				trace_compose(&c->iev, imsg.hdr.peerid,
+				    imsg.hdr.pid);
+			frontend_imsg_compose_main(imsg.hdr.type, r->id,
+			    imsg.hdr.pid, NULL, 0);
+			r->pending = 1 + frontend_imsg_compose_engines(
+			    imsg.hdr.type, r->id, imsg.hdr.pid, NULL, 0);
+			break;
+		case IMSG_CTL_SET_OPTS:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(opts))
+				break;
+
+			/* Tell the client which options it got. */
+			memcpy(&opts, imsg.data, sizeof(opts));
+			c->opts = opts & CTL_OPTS_ALL;
+			imsg_compose_event(&c->iev, IMSG_CTL_SET_OPTS,
+			    imsg.hdr.peerid, imsg.hdr.pid, -1, &c->opts,
+			    sizeof(c->opts));
+			break;
+		case IMSG_CTL_SUBSCRIBE:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(opts))
+				break;
+
+			/* Notifications are tagged like this request. */
+			memcpy(&opts, imsg.data, sizeof(opts));
+			if (c->subs != 0)
+				control_counters.subscribers--;
+			c->subs = opts & CTL_SUBS_ALL;
+			if (!(c->subs & CTL_SUB_RECONF))
+				c->subs = 0;
+			if (c->subs != 0)
+				control_counters.subscribers++;
+			c->sub_peerid = imsg.hdr.peerid;
+			c->sub_pid = imsg.hdr.pid;
+			imsg_compose_event(&c->iev, IMSG_CTL_SUBSCRIBE,
+			    imsg.hdr.peerid, imsg.hdr.pid, -1, &c->subs,
+			    sizeof(c->subs));
 			break;
 		case IMSG_CTL_SHOW_ENGINE_INFO:
-			c->iev.ibuf.pid = imsg.hdr.pid;
-			frontend_imsg_compose_engine(imsg.hdr.type, 0,
-			    imsg.hdr.pid,
+			if (control_not_modified(c, &imsg, NEWD_MAXGROUPNAME))
+				break;
+			name = imsg.data;
+			cacheable = imsg.hdr.len == IMSG_HEADER_SIZE +
+			    NEWD_MAXGROUPNAME &&
+			    memchr(name, '\0', NEWD_MAXGROUPNAME) != NULL;
+			if (cacheable &&
+			    (cc = control_cache_find(name)) != NULL) {
+				control_counters.cache_hits++;
+				control_cache_send(c, cc, &imsg);
+				break;
+			}
+
+			r = control_req_new(c, &imsg);
+			if (cacheable) {
+				control_counters.cache_misses++;
+				r->fill = control_cache_new(name);
+				r->cache_gen = control_cache_gen;
+			}
+
+			/* A named group lives on one engine, a dump on all. */
+			if (cacheable && name[0] != '\0') {
+				frontend_imsg_compose_group(name,
+				    imsg.hdr.type, r->id, imsg.hdr.pid,
+				    imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
+				break;
+			}
+			r->pending = frontend_imsg_compose_engines(
+			    imsg.hdr.type, r->id, imsg.hdr.pid,
 			    imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
+			r->stream = 1;
+			if (c->paused)
+				frontend_imsg_compose_engines(
+				    IMSG_CTL_DUMP_PAUSE, r->id, 0, NULL, 0);
+			break;
+		case IMSG_CTL_LOOKUP_ADDRS:
+			r = control_req_new(c, &imsg);
+			r->pending = frontend_imsg_compose_engines(
+			    imsg.hdr.type, r->id, imsg.hdr.pid, imsg.data,
+			    imsg.hdr.len - IMSG_HEADER_SIZE);
+			break;
+		case IMSG_CTL_LOOKUP_ADDR:
+			r = control_req_new(c, &imsg);
+			r->pending = frontend_imsg_compose_engines(
+			    imsg.hdr.type, r->id, imsg.hdr.pid, imsg.data,
+			    imsg.hdr.len - IMSG_HEADER_SIZE);
+			/* Each engine answers with its own longest match. */
+			if (r->pending > 1 &&
+			    imsg.hdr.len == IMSG_HEADER_SIZE + sizeof(ca)) {
+				memcpy(&ca, imsg.data, sizeof(ca));
+				r->lookup_af = ca.af;
+			}
 			break;
 		default:
 			log_debug("%s: error handling imsg %d", __func__,
@@ -293,14 +565,671 @@ control_dispatch_imsg(int fd, short event, void *bula)
 	imsg_event_add(&c->iev);
 }
 
+/*
+ * Bytes queued to c but not yet written.
+ */
+size_t
+control_queued(struct ctl_conn *c)
+{
+	struct ibuf	*buf;
+	size_t		 n = 0;
+
+	TAILQ_FOREACH(buf, &c->iev.ibuf.w.bufs, entry)
+		n += buf->wpos - buf->rpos;
+	return (n);
+}
+
+/*
+ * A dump put another len bytes out for c. They are only counted again
+ * once that might take c over control_state.queue_max.
+ */
+void
+control_queue_add(struct ctl_conn *c, size_t len)
+{
+	if (c->paused)
+		return;
+	c->queued_est += len;
+	if (c->queued_est <= control_state.queue_max)
+		return;
+	if ((c->queued_est = control_queued(c)) > control_state.queue_max)
+		control_pause(c);
+}
+
+/*
+ * Have the engines hold back the dumps of c until half of what is queued
+ * now has been written, and close c if it does not read on.
+ */
+void
+control_pause(struct ctl_conn *c)
+{
+	struct ctl_req	*r;
+	struct timeval	 tv;
+
+	c->paused = 1;
+	c->resume_queued = c->iev.ibuf.w.queued / 2;
+	c->stall_queued = c->iev.ibuf.w.queued;
+	control_counters.pauses++;
+
+	LIST_FOREACH(r, &c->reqs, entry) {
+		if (r->stream && r->replay == NULL)
+			frontend_imsg_compose_engines(IMSG_CTL_DUMP_PAUSE,
+			    r->id, 0, NULL, 0);
+	}
+
+	timerclear(&tv);
+	tv.tv_sec = control_state.timeout;
+	evtimer_add(&c->stall_ev, &tv);
+}
+
+/*
+ * The flush wrote to the client, resume c if it has read enough.
+ */
+void
+control_written(struct imsgev *iev)
+{
+	struct ctl_conn	*c = CONTROL_CONN(iev);
+
+	if (c->paused && c->iev.ibuf.w.queued <= c->resume_queued)
+		control_resume(c);
+}
+
+void
+control_resume(struct ctl_conn *c)
+{
+	struct ctl_req	*r, *nr;
+
+	c->paused = 0;
+	c->queued_est = control_queued(c);
+	evtimer_del(&c->stall_ev);
+
+	LIST_FOREACH_SAFE(r, &c->reqs, entry, nr) {
+		/*
+		 * A replay may fill the queue again, and control_pause()
+		 * has then held back all streams, including those to come.
+		 */
+		if (c->paused)
+			break;
+		if (r->replay != NULL)
+			control_cache_replay(r);
+		else if (r->stream)
+			frontend_imsg_compose_engines(IMSG_CTL_DUMP_RESUME,
+			    r->id, 0, NULL, 0);
+	}
+}
+
+void
+control_stall(int fd, short event, void *arg)
+{
+	struct ctl_conn	*c = arg;
+	struct timeval	 tv;
+	uint32_t	 queued = c->iev.ibuf.w.queued;
+
+	if (queued <= c->resume_queued) {
+		control_resume(c);
+		return;
+	}
+
+	/* Slow, but still reading. */
+	if (queued < c->stall_queued) {
+		c->stall_queued = queued;
+		timerclear(&tv);
+		tv.tv_sec = control_state.timeout;
+		evtimer_add(&c->stall_ev, &tv);
+		return;
+	}
+
+	log_warnx("control client stalled for %d seconds, closing",
+	    control_state.timeout);
+	control_counters.stalled++;
+	control_close(c);
+}
+
+/*
+ * Pass a reply from main or an engine on to the client that sent the
+ * request, tagged the way the client tagged its request.
+ */
 int
 control_imsg_relay(struct imsg *imsg)
 {
+	struct ctl_req	*r;
 	struct ctl_conn	*c;
+	size_t		 len;
+	int		 rv;
+
+	if ((r = control_reqbyid(imsg->hdr.peerid)) == NULL)
+		return (0);
+	c = r->conn;
+
+	if (imsg->hdr.type == IMSG_CTL_LOOKUP_ADDR &&
+	    r->lookup_af != AF_UNSPEC) {
+		control_lookup_merge(r, imsg);
+		return (0);
+	}
+	if (imsg->hdr.type == IMSG_CTL_LOOKUP_ADDRS) {
+		control_lookups_merge(r, imsg);
+		return (0);
+	}
+
+	if (imsg->hdr.type == IMSG_CTL_SHOW_ENGINE_INFOS && r->fill != NULL)
+		control_cache_fill(r, imsg);
+	if (imsg->hdr.type == IMSG_CTL_DUMP_ABORTED && r->fill != NULL) {
+		/* Never cache a truncated dump. */
+		control_cache_free(r->fill);
+		r->fill = NULL;
+	}
+
+	/* Fanned out requests end with the last IMSG_CTL_END. */
+	if (imsg->hdr.type == IMSG_CTL_END && --r->pending > 0)
+		return (0);
+
+	if (imsg->hdr.type == IMSG_CTL_END && r->best != NULL)
+		imsg_compose_event(&c->iev, IMSG_CTL_LOOKUP_ADDR, r->peerid,
+		    r->pid, -1, r->best, sizeof(*r->best));
+	if (imsg->hdr.type == IMSG_CTL_END && r->batch != NULL)
+		control_lookups_send(r);
+
+	if (imsg->hdr.type == IMSG_CTL_END)
+		control_generation(c, r->peerid, r->pid);
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (imsg->hdr.type == IMSG_CTL_SHOW_ENGINE_INFOS &&
+	    !(c->opts & CTL_OPT_PACKED)) {
+		rv = control_imsg_unpack(r, imsg);
+		len = len / sizeof(struct ctl_engine_info) *
+		    (IMSG_HEADER_SIZE + sizeof(struct ctl_engine_info));
+	} else {
+		rv = imsg_compose_event(&c->iev, imsg->hdr.type, r->peerid,
+		    r->pid, -1, imsg->data, len);
+		len += IMSG_HEADER_SIZE;
+	}
+	if (r->stream && imsg->hdr.type == IMSG_CTL_SHOW_ENGINE_INFOS)
+		control_queue_add(c, len);
+
+	if (imsg->hdr.type == IMSG_CTL_END) {
+		if (r->fill != NULL)
+			control_cache_insert(r);
+		control_req_free(r);
+	}
+
+	return (rv);
+}
+
+/*
+ * Relay the records of an IMSG_CTL_SHOW_ENGINE_INFOS one by one, for
+ * clients that did not ask for packed replies.
+ */
+int
+control_imsg_unpack(struct ctl_req *r, struct imsg *imsg)
+{
+	struct ctl_conn		*c = r->conn;
+	struct ctl_engine_info	*cei = imsg->data;
+	size_t			 i, n, len;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (len % sizeof(*cei) != 0) {
+		log_warnx("%s: wrong imsg len", __func__);
+		return (-1);
+	}
+
+	n = len / sizeof(*cei);
+	for (i = 0; i < n; i++) {
+		if (imsg_compose(&c->iev.ibuf, IMSG_CTL_SHOW_ENGINE_INFO,
+		    r->peerid, r->pid, -1, &cei[i], sizeof(cei[i])) == -1)
+			return (-1);
+	}
+	imsg_event_add(&c->iev);
+
+	return (0);
+}
+
+/*
+ * Keep the more specific of r->best and the match in imsg. Equally long
+ * matches are duplicates; the first reply wins.
+ */
+void
+control_lookup_merge(struct ctl_req *r, struct imsg *imsg)
+{
+	struct ctl_engine_info	*cei = imsg->data;
 
-	if ((c = control_connbypid(imsg->hdr.pid)) == NULL)
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(*cei)) {
+		log_warnx("%s: wrong imsg len", __func__);
+		return;
+	}
+
+	if (r->best == NULL) {
+		if ((r->best = malloc(sizeof(*r->best))) == NULL)
+			fatal(NULL);
+	} else if (r->lookup_af == AF_INET ?
+	    cei->group_v4_bits <= r->best->group_v4_bits :
+	    cei->group_v6_bits <= r->best->group_v6_bits)
+		return;
+	memcpy(r->best, cei, sizeof(*r->best));
+}
+
+/*
+ * Keep the longer of the matches so far and those an engine found for
+ * each address of a batch.
+ */
+void
+control_lookups_merge(struct ctl_req *r, struct imsg *imsg)
+{
+	struct ctl_lookup_match	*clm = imsg->data;
+	size_t			 i, n, len;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	n = len / sizeof(*clm);
+	if (len % sizeof(*clm) != 0 || n == 0 || n > CTL_LOOKUP_ADDRS_MAX ||
+	    (r->batch != NULL && n != r->batch_count)) {
+		log_warnx("%s: wrong imsg len", __func__);
+		return;
+	}
+
+	if (r->batch == NULL) {
+		if ((r->batch = calloc(n, sizeof(*clm))) == NULL)
+			fatal(NULL);
+		memcpy(r->batch, clm, len);
+		r->batch_count = n;
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (clm[i].bits > r->batch[i].bits)
+			r->batch[i] = clm[i];
+	}
+}
+
+int
+control_lookups_cmp(const void *a, const void *b)
+{
+	const struct ctl_lookup_match	*ma, *mb;
+
+	ma = *(struct ctl_lookup_match * const *)a;
+	mb = *(struct ctl_lookup_match * const *)b;
+
+	return (strncmp(ma->name, mb->name, sizeof(ma->name)));
+}
+
+/*
+ * Tell the client of r which groups matched its batch of addresses, and
+ * which of them each address matched.
+ */
+void
+control_lookups_send(struct ctl_req *r)
+{
+	static struct ctl_lookup_match	*sorted[CTL_LOOKUP_ADDRS_MAX];
+	static char			 names[CTL_LOOKUP_ADDRS_MAX]
+					    [NEWD_MAXGROUPNAME];
+	static uint32_t			 idx[CTL_LOOKUP_ADDRS_MAX];
+	struct ctl_conn			*c = r->conn;
+	size_t				 i, k = 0, m = 0;
+
+	for (i = 0; i < r->batch_count; i++) {
+		idx[i] = CTL_LOOKUP_NONE;
+		if (r->batch[i].bits >= 0)
+			sorted[m++] = &r->batch[i];
+	}
+
+	/* Equal names end up next to each other and share an index. */
+	qsort(sorted, m, sizeof(sorted[0]), control_lookups_cmp);
+	for (i = 0; i < m; i++) {
+		if (k == 0 || strncmp(names[k - 1], sorted[i]->name,
+		    sizeof(names[0])) != 0)
+			memcpy(names[k++], sorted[i]->name, sizeof(names[0]));
+		idx[sorted[i] - r->batch] = k - 1;
+	}
+
+	imsg_compose_event(&c->iev, IMSG_CTL_LOOKUP_GROUPS, r->peerid, r->pid,
+	    -1, names, k * sizeof(names[0]));
+	imsg_compose_event(&c->iev, IMSG_CTL_LOOKUP_ADDRS, r->peerid, r->pid,
+	    -1, idx, r->batch_count * sizeof(idx[0]));
+}
+
+struct ctl_cache *
+control_cache_new(const char *filter)
+{
+	struct ctl_cache	*cc;
+
+	if ((cc = calloc(1, sizeof(*cc))) == NULL)
+		fatal(NULL);
+	strlcpy(cc->filter, filter, sizeof(cc->filter));
+
+	return (cc);
+}
+
+void
+control_cache_free(struct ctl_cache *cc)
+{
+	free(cc->cei);
+	free(cc);
+}
+
+void
+control_cache_unref(struct ctl_cache *cc)
+{
+	if (--cc->refs == 0)
+		control_cache_free(cc);
+}
+
+struct ctl_cache *
+control_cache_find(const char *filter)
+{
+	struct ctl_cache	*cc;
+
+	TAILQ_FOREACH(cc, &control_cache, entry) {
+		if (strncmp(cc->filter, filter, sizeof(cc->filter)) == 0)
+			break;
+	}
+	if (cc != NULL && cc != TAILQ_FIRST(&control_cache)) {
+		TAILQ_REMOVE(&control_cache, cc, entry);
+		TAILQ_INSERT_HEAD(&control_cache, cc, entry);
+	}
+
+	return (cc);
+}
+
+/*
+ * If the show request in imsg carries a generation after its len bytes of
+ * arguments, strip it off. Tell the client and return 1 if the config is
+ * no newer than that.
+ */
+int
+control_not_modified(struct ctl_conn *c, struct imsg *imsg, size_t len)
+{
+	uint64_t	gen, cur;
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + len + sizeof(gen))
+		return (0);
+	memcpy(&gen, (char *)imsg->data + len, sizeof(gen));
+	imsg->hdr.len -= sizeof(gen);
+
+	/*
+	 * The engines may be a reload ahead of or behind us. Either way a
+	 * client polling with the generation of its last reply catches up.
+	 */
+	if ((cur = frontend_generation()) > gen)
 		return (0);
 
-	return (imsg_compose_event(&c->iev, imsg->hdr.type, 0, imsg->hdr.pid,
-	    -1, imsg->data, imsg->hdr.len - IMSG_HEADER_SIZE));
+	control_counters.not_modified++;
+	imsg_compose_event(&c->iev, IMSG_CTL_NOT_MODIFIED, imsg->hdr.peerid,
+	    imsg->hdr.pid, -1, &cur, sizeof(cur));
+	imsg_compose_event(&c->iev, IMSG_CTL_END, imsg->hdr.peerid,
+	    imsg->hdr.pid, -1, NULL, 0);
+	return (1);
+}
+
+/*
+ * Tell c, if it asked for it, which generation the reply about to end
+ * comes from.
+ */
+void
+control_generation(struct ctl_conn *c, uint32_t peerid, pid_t pid)
+{
+	uint64_t	gen;
+
+	if (!(c->opts & CTL_OPT_GENERATION))
+		return;
+	gen = frontend_generation_all();
+	imsg_compose_event(&c->iev, IMSG_CTL_GENERATION, peerid, pid, -1,
+	    &gen, sizeof(gen));
+}
+
+/*
+ * Answer the request in imsg from the cache the way the engines would
+ * have, packed or not as c asked for.
+ */
+void
+control_cache_send(struct ctl_conn *c, struct ctl_cache *cc,
+    struct imsg *imsg)
+{
+	struct ctl_req	*r;
+
+	r = control_req_new(c, imsg);
+	r->stream = 1;
+	r->replay = cc;
+	cc->refs++;
+	control_cache_replay(r);
+}
+
+/*
+ * Send what is left of the reply of r from the cache, until its client
+ * has too much to read. r ends once all of it is sent.
+ */
+void
+control_cache_replay(struct ctl_req *r)
+{
+	struct ctl_conn		*c = r->conn;
+	struct ctl_cache	*cc = r->replay;
+	size_t			 i, n, len;
+
+	while (!c->paused && r->replay_next < cc->count) {
+		n = MINIMUM(cc->count - r->replay_next, CTL_ENGINE_INFO_MAX);
+		if (c->opts & CTL_OPT_PACKED) {
+			len = n * sizeof(cc->cei[0]);
+			imsg_compose_event(&c->iev, IMSG_CTL_SHOW_ENGINE_INFOS,
+			    r->peerid, r->pid, -1, &cc->cei[r->replay_next],
+			    len);
+			len += IMSG_HEADER_SIZE;
+		} else {
+			for (i = r->replay_next; i < r->replay_next + n; i++)
+				imsg_compose_event(&c->iev,
+				    IMSG_CTL_SHOW_ENGINE_INFO, r->peerid,
+				    r->pid, -1, &cc->cei[i],
+				    sizeof(cc->cei[0]));
+			len = n * (IMSG_HEADER_SIZE + sizeof(cc->cei[0]));
+		}
+		r->replay_next += n;
+		control_queue_add(c, len);
+	}
+	if (r->replay_next < cc->count)
+		return;
+
+	control_generation(c, r->peerid, r->pid);
+	imsg_compose_event(&c->iev, IMSG_CTL_END, r->peerid, r->pid, -1,
+	    NULL, 0);
+	control_req_free(r);
+}
+
+/*
+ * Add the records of an IMSG_CTL_SHOW_ENGINE_INFOS to the reply being
+ * collected for r. Replies that grow too large are not cached.
+ */
+void
+control_cache_fill(struct ctl_req *r, struct imsg *imsg)
+{
+	struct ctl_cache	*cc = r->fill;
+	struct ctl_engine_info	*cei;
+	size_t			 len, n, size;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	n = len / sizeof(*cei);
+	if (len % sizeof(*cei) != 0 || (cc->count + n) * sizeof(*cei) >
+	    CONTROL_CACHE_MAXBYTES) {
+		control_cache_free(cc);
+		r->fill = NULL;
+		return;
+	}
+
+	if (cc->count + n > cc->size) {
+		size = MAXIMUM(cc->size * 2, cc->count + n);
+		if ((cei = reallocarray(cc->cei, size, sizeof(*cei))) == NULL)
+			fatal(NULL);
+		cc->cei = cei;
+		cc->size = size;
+	}
+	memcpy(&cc->cei[cc->count], imsg->data, len);
+	cc->count += n;
+}
+
+/*
+ * r got its last IMSG_CTL_END, keep its reply unless the config changed
+ * since it was asked for. The least recently used go first to make room.
+ */
+void
+control_cache_insert(struct ctl_req *r)
+{
+	struct ctl_cache	*cc = r->fill, *old;
+
+	r->fill = NULL;
+	if (r->cache_gen != control_cache_gen) {
+		control_cache_free(cc);
+		return;
+	}
+
+	if ((old = control_cache_find(cc->filter)) != NULL) {
+		/* Another request for the same filter got in first. */
+		control_cache_free(cc);
+		return;
+	}
+	TAILQ_INSERT_HEAD(&control_cache, cc, entry);
+	cc->refs = 1;
+	control_cache_count++;
+	control_cache_bytes += cc->count * sizeof(cc->cei[0]);
+
+	while (control_cache_count > CONTROL_CACHE_MAX ||
+	    control_cache_bytes > CONTROL_CACHE_MAXBYTES) {
+		old = TAILQ_LAST(&control_cache, ctl_cache_head);
+		TAILQ_REMOVE(&control_cache, old, entry);
+		control_cache_count--;
+		control_cache_bytes -= old->count * sizeof(old->cei[0]);
+		control_cache_unref(old);
+	}
+}
+
+/*
+ * An engine has a new config, none of the cached replies can be trusted.
+ */
+void
+control_cache_flush(void)
+{
+	struct ctl_cache	*cc;
+
+	while ((cc = TAILQ_FIRST(&control_cache)) != NULL) {
+		TAILQ_REMOVE(&control_cache, cc, entry);
+		control_cache_unref(cc);
+	}
+	control_cache_count = control_cache_bytes = 0;
+	control_cache_gen++;
+	control_counters.cache_flushes++;
+}
+
+/*
+ * Remember that group name changed, CTL_NOTIFY_ADD, _MOD or _DEL, for the
+ * next notification.
+ */
+void
+control_notify_group(const char *name, int change)
+{
+	struct ctl_notify_group	*cg;
+	size_t			 size;
+
+	if (control_changes_full)
+		return;
+	if (control_counters.subscribers == 0 ||
+	    control_nchanges >= CONTROL_NOTIFY_MAXGROUPS) {
+		control_notify_full();
+		return;
+	}
+
+	if (control_nchanges == control_changes_size) {
+		size = MAXIMUM(control_changes_size * 2, 64);
+		if ((cg = reallocarray(control_changes, size,
+		    sizeof(*cg))) == NULL) {
+			log_warn("%s", __func__);
+			control_notify_full();
+			return;
+		}
+		control_changes = cg;
+		control_changes_size = size;
+	}
+
+	cg = &control_changes[control_nchanges++];
+	memset(cg, 0, sizeof(*cg));
+	strlcpy(cg->name, name, sizeof(cg->name));
+	cg->change = change;
+}
+
+/*
+ * The next notification cannot tell which groups changed.
+ */
+void
+control_notify_full(void)
+{
+	free(control_changes);
+	control_changes = NULL;
+	control_nchanges = control_changes_size = 0;
+	control_changes_full = 1;
+}
+
+/*
+ * Tell subscribers that the config of generation is in place, if they
+ * have not heard of it yet.
+ */
+void
+control_notify(uint64_t generation)
+{
+	struct ctl_conn		*c;
+	struct ctl_notify	 cn;
+
+	if (generation <= control_notified)
+		return;
+	control_notified = generation;
+
+	memset(&cn, 0, sizeof(cn));
+	cn.generation = generation;
+	if (control_changes_full)
+		cn.flags |= CTL_NOTIFY_FULL;
+	else
+		cn.ngroups = control_nchanges;
+
+	TAILQ_FOREACH(c, &ctl_conns, entry) {
+		if (c->subs != 0)
+			control_notify_send(c, &cn);
+	}
+
+	free(control_changes);
+	control_changes = NULL;
+	control_nchanges = control_changes_size = 0;
+	control_changes_full = 0;
+}
+
+void
+control_notify_send(struct ctl_conn *c, struct ctl_notify *cn)
+{
+	size_t	i, n;
+
+	control_counters.notifications++;
+	imsg_compose_event(&c->iev, IMSG_CTL_NOTIFY, c->sub_peerid,
+	    c->sub_pid, -1, cn, sizeof(*cn));
+	if ((c->subs & CTL_SUB_GROUPS) && !(cn->flags & CTL_NOTIFY_FULL)) {
+		for (i = 0; i < control_nchanges; i += n) {
+			n = MINIMUM(control_nchanges - i,
+			    CTL_NOTIFY_GROUPS_MAX);
+			imsg_compose_event(&c->iev, IMSG_CTL_NOTIFY_GROUPS,
+			    c->sub_peerid, c->sub_pid, -1,
+			    &control_changes[i], n * sizeof(*control_changes));
+		}
+	}
+	imsg_compose_event(&c->iev, IMSG_CTL_END, c->sub_peerid, c->sub_pid,
+	    -1, NULL, 0);
+}
+
+void
+control_stats(struct ctl_stats *st, const char *name)
+{
+	ctl_stats_add(st, name, "accepted", control_counters.accepted);
+	ctl_stats_add(st, name, "closed", control_counters.closed);
+	ctl_stats_add(st, name, "active", control_counters.active);
+	ctl_stats_add(st, name, "requests", control_counters.requests);
+	ctl_stats_add(st, name, "cache_hits", control_counters.cache_hits);
+	ctl_stats_add(st, name, "cache_misses",
+	    control_counters.cache_misses);
+	ctl_stats_add(st, name, "cache_flushes",
+	    control_counters.cache_flushes);
+	ctl_stats_add(st, name, "cache_entries", control_cache_count);
+	ctl_stats_add(st, name, "cache_bytes", control_cache_bytes);
+	ctl_stats_add(st, name, "not_modified", control_counters.not_modified);
+	ctl_stats_add(st, name, "subscribers", control_counters.subscribers);
+	ctl_stats_add(st, name, "notifications",
+	    control_counters.notifications);
+	ctl_stats_add(st, name, "pauses", control_counters.pauses);
+	ctl_stats_add(st, name, "stalled", control_counters.stalled);
 }
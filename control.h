@@ -16,20 +16,75 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* Where a frontend finds the listening socket main made for it. */
+#define	CONTROL_FD	4
+
 struct {
 	struct event	ev;
 	struct event	evt;
 	int		fd;
+	int		backlog;
+	size_t		queue_max;	/* bytes queued to hold dumps back */
+	int		timeout;	/* seconds held back before closing */
 } control_state;
 
 struct ctl_conn {
 	TAILQ_ENTRY(ctl_conn)	entry;
+	LIST_HEAD(, ctl_req)	reqs;
 	struct imsgev		iev;
+	uint32_t		opts;
+	uint32_t		subs;	/* CTL_SUB_* */
+	uint32_t		sub_peerid;
+	pid_t			sub_pid;
+	struct event		stall_ev;
+	size_t			queued_est;	/* as counted, plus dumps */
+	uint32_t		resume_queued;	/* imsgs, once paused */
+	uint32_t		stall_queued;
+	int			paused;
+};
+
+/*
+ * A request passed on to main or the engines. It is sent with id as the
+ * peerid and lives until its last IMSG_CTL_END comes back. An address
+ * lookup sent to several engines keeps the longest match in best, a batch
+ * of lookups those for each address in batch. Engine info is collected in
+ * fill, to be cached if the config did not change while it came in. The
+ * engines hold back dumps while the client has
+ * more than control_state.queue_max of replies still to read, and so do
+ * we with replies from the cache.
+ */
+struct ctl_req {
+	LIST_ENTRY(ctl_req)	hash;
+	LIST_ENTRY(ctl_req)	entry;
+	struct ctl_conn		*conn;
+	uint32_t		id;
+	uint32_t		peerid;	/* as sent by the client */
+	pid_t			pid;
+	int			pending; /* IMSG_CTL_ENDs still to come */
+	int			lookup_af; /* merging lookups, or AF_UNSPEC */
+	struct ctl_engine_info	*best;
+	struct ctl_lookup_match	*batch;	/* merged IMSG_CTL_LOOKUP_ADDRS */
+	size_t			 batch_count;
+	struct ctl_cache	*fill;
+	uint64_t		 cache_gen;
+	int			 stream; /* a dump, paused with its conn */
+	struct ctl_cache	*replay; /* the cached reply being sent */
+	size_t			 replay_next;
 };
 
 int	control_init(char *);
 int	control_listen(void);
+void	control_set_limits(struct newd_conf *);
 void	control_accept(int, short, void *);
 void	control_dispatch_imsg(int, short, void *);
 int	control_imsg_relay(struct imsg *);
+int	control_imsg_unpack(struct ctl_req *, struct imsg *);
+void	control_lookup_merge(struct ctl_req *, struct imsg *);
+void	control_lookups_merge(struct ctl_req *, struct imsg *);
+void	control_lookups_send(struct ctl_req *);
+void	control_stats(struct ctl_stats *, const char *);
+void	control_cache_flush(void);
+void	control_notify_group(const char *, int);
+void	control_notify_full(void);
+void	control_notify(uint64_t);
 void	control_cleanup(char *);
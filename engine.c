@@ -30,6 +30,7 @@
 #include <event.h>
 #include <imsg.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pwd.h>
@@ -38,16 +39,91 @@
 #include "log.h"
 #include "newd.h"
 #include "engine.h"
+#include "lpm.h"
+
+#define LPM_BUILD_CHUNK	4096	/* groups indexed per event loop pass */
+#define DUMP_MAXQUEUED	64	/* stop dumping with this many queued imsgs */
+
+/*
+ * An unfiltered IMSG_CTL_SHOW_ENGINE_INFO in progress. next is the next
+ * group to send.
+ */
+struct engine_dump {
+	TAILQ_ENTRY(engine_dump)	 entry;
+	struct group			*next;
+	struct imsgev			*iev;	/* to the asking frontend */
+	uint32_t			 peerid;
+	pid_t				 pid;
+	int				 paused;	/* by the frontend */
+};
+
+/* A lookup held back until the index is complete. */
+struct engine_lookup {
+	TAILQ_ENTRY(engine_lookup)	 entry;
+	struct imsgev			*iev;
+	struct imsg			 imsg;	/* with a copy of the data */
+};
 
 __dead void	 engine_shutdown(void);
 void		 engine_sig_handler(int sig, short, void *);
 void		 engine_dispatch_frontend(int, short, void *);
 void		 engine_dispatch_main(int, short, void *);
-void		 engine_showinfo_ctl(struct imsg *);
+void		 engine_showinfo_ctl(struct imsgev *, struct imsg *);
+void		 engine_lookup_ctl(struct imsgev *, struct imsg *);
+void		 engine_lookups_ctl(struct imsgev *, struct imsg *);
+void		 engine_showstats_ctl(struct imsgev *, struct imsg *);
+void		 engine_showlatency_ctl(struct imsgev *, struct imsg *);
+void		 engine_group_info(struct group *, struct ctl_engine_info *);
+void		 engine_dump_run(void);
+void		 engine_dump_written(struct imsgev *);
+void		 engine_dump_ctl(struct imsgev *, struct imsg *);
+void		 engine_dump_forget(struct group *);
+void		 engine_dump_abort(void);
+void		 engine_lpm_start(void);
+void		 engine_lpm_build(int, short, void *);
+void		 engine_lpm_done(void);
+int		 engine_lpm_defer(struct imsgev *, struct imsg *);
+void		 engine_lpm_insert(struct group *);
+void		 engine_lpm_remove(struct group *);
+void		 engine_reconf_group(struct imsg *);
+void		 engine_reconf_notify(void);
 
 struct newd_conf	*engine_conf;
-struct imsgev		*iev_frontend;
+struct imsgev		*iev_frontends[NEWD_MAXFRONTENDS];
 struct imsgev		*iev_main;
+int			 engine_nfrontends;
+int			 engine_shard;		/* the groups we own */
+char			 engine_name[16] = "engine";
+
+/*
+ * Address indexes over the group prefixes. They are rebuilt in chunks of
+ * LPM_BUILD_CHUNK groups after each reload, lpm_next points at the next
+ * group still to be indexed. A delta arriving meanwhile stops the build
+ * and leaves the index stale, to be built again once the delta is
+ * complete. Lookups wait in engine_lookups until the index is ready.
+ */
+struct lpm_tree		 engine_lpm4;
+struct lpm_tree		 engine_lpm6;
+struct group		*lpm_next;
+int			 lpm_stale;
+struct event		 ev_lpm;
+
+TAILQ_HEAD(, engine_lookup)	 engine_lookups =
+    TAILQ_HEAD_INITIALIZER(engine_lookups);
+
+TAILQ_HEAD(, engine_dump)	 engine_dumps =
+    TAILQ_HEAD_INITIALIZER(engine_dumps);
+
+struct {
+	uint64_t	lookups;
+	uint64_t	lookup_hits;
+	uint64_t	lookup_batches;
+	uint64_t	lookups_deferred;
+	uint64_t	group_finds;
+	uint64_t	group_find_hits;
+	uint64_t	dumps;
+	uint64_t	dumps_aborted;
+} engine_stats;
 
 void
 engine_sig_handler(int sig, short event, void *arg)
@@ -73,6 +149,8 @@ engine(int debug, int verbose)
 	struct passwd		*pw;
 
 	engine_conf = config_new_empty();
+	lpm_init(&engine_lpm4, AF_INET);
+	lpm_init(&engine_lpm6, AF_INET6);
 
 	log_init(debug, LOG_DAEMON);
 	log_setverbose(verbose);
@@ -98,6 +176,8 @@ engine(int debug, int verbose)
 		fatal("pledge");
 
 	event_init();
+	latency_init();
+	log_async();
 
 	/* Setup signal handler(s). */
 	signal_set(&ev_sigint, SIGINT, engine_sig_handler, NULL);
@@ -107,12 +187,15 @@ engine(int debug, int verbose)
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGHUP, SIG_IGN);
 
+	evtimer_set(&ev_lpm, engine_lpm_build, NULL);
+
 	/* Setup pipe and event handler to the main process. */
-	if ((iev_main = malloc(sizeof(struct imsgev))) == NULL)
+	if ((iev_main = calloc(1, sizeof(struct imsgev))) == NULL)
 		fatal(NULL);
 
 	imsg_init(&iev_main->ibuf, 3);
 	iev_main->handler = engine_dispatch_main;
+	iev_main->peer = PROC_MAIN;
 
 	/* Setup event handlers. */
 	iev_main->events = EV_READ;
@@ -120,6 +203,9 @@ engine(int debug, int verbose)
 	    iev_main->handler, iev_main);
 	event_add(&iev_main->ev, NULL);
 
+	/* Tell main we are ready for the config. */
+	imsg_compose_event(iev_main, IMSG_STARTUP, 0, 0, -1, NULL, 0);
+
 	event_dispatch();
 
 	engine_shutdown();
@@ -128,15 +214,24 @@ engine(int debug, int verbose)
 __dead void
 engine_shutdown(void)
 {
+	int	i;
+
+	engine_dump_abort();
+
 	/* Close pipes. */
-	msgbuf_clear(&iev_frontend->ibuf.w);
-	close(iev_frontend->ibuf.fd);
+	for (i = 0; i < engine_nfrontends; i++) {
+		msgbuf_clear(&iev_frontends[i]->ibuf.w);
+		close(iev_frontends[i]->ibuf.fd);
+	}
 	msgbuf_clear(&iev_main->ibuf.w);
 	close(iev_main->ibuf.fd);
 
 	config_clear(engine_conf);
+	lpm_clear(&engine_lpm4);
+	lpm_clear(&engine_lpm6);
 
-	free(iev_frontend);
+	for (i = 0; i < engine_nfrontends; i++)
+		free(iev_frontends[i]);
 	free(iev_main);
 
 	log_info("engine exiting");
@@ -144,11 +239,11 @@ engine_shutdown(void)
 }
 
 int
-engine_imsg_compose_frontend(int type, pid_t pid, void *data,
-    uint16_t datalen)
+engine_imsg_compose_frontend(struct imsgev *iev, int type, uint32_t peerid,
+    pid_t pid, void *data, uint16_t datalen)
 {
-	return (imsg_compose_event(iev_frontend, type, 0, pid, -1,
-	    data, datalen));
+	return (imsg_compose_event(iev, type, peerid, pid, -1, data,
+	    datalen));
 }
 
 void
@@ -176,7 +271,7 @@ engine_dispatch_frontend(int fd, short event, void *bula)
 	}
 
 	for (;;) {
-		if ((n = imsg_get(ibuf, &imsg)) == -1)
+		if ((n = imsg_get_event(iev, &imsg)) == -1)
 			fatal("%s: imsg_get error", __func__);
 		if (n == 0)	/* No more messages. */
 			break;
@@ -188,7 +283,29 @@ engine_dispatch_frontend(int fd, short event, void *bula)
 			log_setverbose(verbose);
 			break;
 		case IMSG_CTL_SHOW_ENGINE_INFO:
-			engine_showinfo_ctl(&imsg);
+			engine_showinfo_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_LOOKUP_ADDR:
+			engine_lookup_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_LOOKUP_ADDRS:
+			engine_lookups_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_SHOW_STATS:
+			engine_showstats_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_SHOW_LATENCY:
+			engine_showlatency_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_SHOW_TRACE:
+			trace_compose(iev, imsg.hdr.peerid, imsg.hdr.pid);
+			engine_imsg_compose_frontend(iev, IMSG_CTL_END,
+			    imsg.hdr.peerid, imsg.hdr.pid, NULL, 0);
+			break;
+		case IMSG_CTL_DUMP_PAUSE:
+		case IMSG_CTL_DUMP_RESUME:
+		case IMSG_CTL_DUMP_CANCEL:
+			engine_dump_ctl(iev, &imsg);
 			break;
 		default:
 			log_debug("%s: unexpected imsg %d", __func__,
@@ -197,11 +314,13 @@ engine_dispatch_frontend(int fd, short event, void *bula)
 		}
 		imsg_free(&imsg);
 	}
-	if (!shut)
+	if (!shut) {
+		/* Continue dumps once the pipe has drained. */
+		engine_dump_run();
 		imsg_event_add(iev);
-	else {
+	} else {
 		/* This pipe is dead. Remove its event handler. */
-		event_del(&iev->ev);
+		imsg_event_del(iev);
 		event_loopexit(NULL);
 	}
 }
@@ -212,8 +331,9 @@ engine_dispatch_main(int fd, short event, void *bula)
 	static struct newd_conf	*nconf;
 	struct imsg		 imsg;
 	struct group		*g;
-	struct imsgev		*iev = bula;
+	struct imsgev		*iev = bula, *fiev;
 	struct imsgbuf		*ibuf;
+	struct ipc_link		 link;
 	ssize_t			 n;
 	int			 shut = 0;
 
@@ -233,7 +353,7 @@ engine_dispatch_main(int fd, short event, void *bula)
 	}
 
 	for (;;) {
-		if ((n = imsg_get(ibuf, &imsg)) == -1)
+		if ((n = imsg_get_event(iev, &imsg)) == -1)
 			fatal("%s: imsg_get error", __func__);
 		if (n == 0)	/* No more messages. */
 			break;
@@ -241,10 +361,16 @@ engine_dispatch_main(int fd, short event, void *bula)
 		switch (imsg.hdr.type) {
 		case IMSG_SOCKET_IPC:
 			/*
-			 * Setup pipe and event handler to the frontend
-			 * process.
+			 * Setup pipe and event handler to a frontend
+			 * process. Main sends them in frontend order.
 			 */
-			if (iev_frontend) {
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(link))
+				fatalx("%s: invalid IMSG_SOCKET_IPC", __func__);
+			memcpy(&link, imsg.data, sizeof(link));
+			if (link.frontend != engine_nfrontends ||
+			    link.frontend >= NEWD_MAXFRONTENDS ||
+			    (engine_nfrontends > 0 &&
+			    link.engine != engine_shard)) {
 				log_warnx("%s: received unexpected imsg fd "
 				    "to engine", __func__);
 				break;
@@ -254,35 +380,95 @@ engine_dispatch_main(int fd, short event, void *bula)
 				   "engine but didn't receive any", __func__);
 				break;
 			}
+			if (engine_nfrontends == 0) {
+				engine_shard = link.engine;
+				newd_instance = engine_shard;
+				instance_name("engine", engine_shard,
+				    engine_name, sizeof(engine_name));
+				setproctitle("%s", engine_name);
+				log_procinit(engine_name);
+			}
 
-			iev_frontend = malloc(sizeof(struct imsgev));
-			if (iev_frontend == NULL)
+			if ((fiev = calloc(1, sizeof(struct imsgev))) == NULL)
 				fatal(NULL);
 
-			imsg_init(&iev_frontend->ibuf, fd);
-			iev_frontend->handler = engine_dispatch_frontend;
-			iev_frontend->events = EV_READ;
-
-			event_set(&iev_frontend->ev, iev_frontend->ibuf.fd,
-			iev_frontend->events, iev_frontend->handler,
-			    iev_frontend);
-			event_add(&iev_frontend->ev, NULL);
+			imsg_init(&fiev->ibuf, fd);
+			fiev->handler = engine_dispatch_frontend;
+			fiev->written = engine_dump_written;
+			fiev->peer = PROC_FRONTEND;
+			fiev->peer_instance = link.frontend;
+			fiev->events = EV_READ;
+
+			event_set(&fiev->ev, fiev->ibuf.fd, fiev->events,
+			    fiev->handler, fiev);
+			event_add(&fiev->ev, NULL);
+			iev_frontends[engine_nfrontends++] = fiev;
 			break;
 		case IMSG_RECONF_CONF:
 			if ((nconf = malloc(sizeof(struct newd_conf))) == NULL)
 				fatal(NULL);
 			memcpy(nconf, imsg.data, sizeof(struct newd_conf));
-			LIST_INIT(&nconf->group_list);
+			config_init_groups(nconf);
 			break;
 		case IMSG_RECONF_GROUP:
-			if ((g = malloc(sizeof(struct group))) == NULL)
-				fatal(NULL);
+			g = group_alloc(nconf);
 			memcpy(g, imsg.data, sizeof(struct group));
-			LIST_INSERT_HEAD(&nconf->group_list, g, entry);
+			group_insert(nconf, g);
+			break;
+		case IMSG_RECONF_GROUPS:
+			if (config_add_groups(nconf, imsg.data,
+			    imsg.hdr.len - IMSG_HEADER_SIZE) == -1)
+				fatalx("%s: invalid IMSG_RECONF_GROUPS",
+				    __func__);
+			break;
+		case IMSG_RECONF_DELTA:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE +
+			    sizeof(struct newd_conf))
+				fatalx("%s: invalid IMSG_RECONF_DELTA",
+				    __func__);
+			/* A build in progress starts over after the delta. */
+			if (lpm_next != NULL) {
+				evtimer_del(&ev_lpm);
+				lpm_next = NULL;
+				lpm_stale = 1;
+			}
+			config_copy_global(engine_conf, imsg.data);
+			latency_set_threshold(engine_conf->latency_threshold);
+			break;
+		case IMSG_RECONF_GROUP_ADD:
+		case IMSG_RECONF_GROUP_MOD:
+		case IMSG_RECONF_GROUP_DEL:
+			engine_reconf_group(&imsg);
 			break;
+		case IMSG_RECONF_SNAPSHOT:
+			if ((fd = imsg.fd) == -1)
+				log_warnx("%s: expected to receive config "
+				    "snapshot fd but didn't receive any",
+				    __func__);
+			else
+				nconf = config_image_map(fd);
+			if (nconf == NULL) {
+				/* Have main send the config as imsgs. */
+				imsg_compose_event(iev, IMSG_RECONF_SNAPSHOT,
+				    0, 0, -1, NULL, 0);
+				break;
+			}
+			/* FALLTHROUGH */
 		case IMSG_RECONF_END:
-			merge_config(engine_conf, nconf);
-			nconf = NULL;
+			/* A delta has already been applied. */
+			if (nconf != NULL) {
+				/* Index and dumps point at groups to go. */
+				evtimer_del(&ev_lpm);
+				lpm_next = NULL;
+				engine_dump_abort();
+				merge_config(engine_conf, nconf);
+				nconf = NULL;
+				latency_set_threshold(
+				    engine_conf->latency_threshold);
+				engine_lpm_start();
+			} else if (lpm_stale)
+				engine_lpm_start();
+			engine_reconf_notify();
 			break;
 		default:
 			log_debug("%s: unexpected imsg %d", __func__,
@@ -295,46 +481,520 @@ engine_dispatch_main(int fd, short event, void *bula)
 		imsg_event_add(iev);
 	else {
 		/* This pipe is dead. Remove its event handler. */
-		event_del(&iev->ev);
+		imsg_event_del(iev);
 		event_loopexit(NULL);
 	}
 }
 
 void
-engine_showinfo_ctl(struct imsg *imsg)
+engine_showinfo_ctl(struct imsgev *iev, struct imsg *imsg)
 {
 	char filter[NEWD_MAXGROUPNAME];
 	struct ctl_engine_info cei;
+	struct engine_dump *d;
 	struct group *g;
 
 	switch (imsg->hdr.type) {
 	case IMSG_CTL_SHOW_ENGINE_INFO:
+		if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(filter)) {
+			log_warnx("%s: wrong imsg len", __func__);
+			engine_imsg_compose_frontend(iev, IMSG_CTL_END,
+			    imsg->hdr.peerid, imsg->hdr.pid, NULL, 0);
+			break;
+		}
 		memcpy(filter, imsg->data, sizeof(filter));
-		LIST_FOREACH(g, &engine_conf->group_list, entry) {
-			if (filter[0] == '\0' || memcmp(filter, g->name,
-			    sizeof(filter)) == 0) {
-				memcpy(cei.name, g->name, sizeof(cei.name));
-				cei.yesno = g->yesno;
-				cei.integer = g->integer;
-				cei.group_v4_bits = g->group_v4_bits;
-				cei.group_v6_bits = g->group_v6_bits;
-				memcpy(&cei.group_v4address,
-				    &g->group_v4address,
-				    sizeof(cei.group_v4address));
-				memcpy(&cei.group_v6address,
-				    &g->group_v6address,
-				    sizeof(cei.group_v6address));
-
-				engine_imsg_compose_frontend(
-				    IMSG_CTL_SHOW_ENGINE_INFO, imsg->hdr.pid,
-				    &cei, sizeof(cei));
+		if (filter[0] == '\0' &&
+		    !LIST_EMPTY(&engine_conf->group_list)) {
+			/* Sent in chunks by engine_dump_run(). */
+			if ((d = malloc(sizeof(*d))) == NULL)
+				fatal(NULL);
+			d->next = LIST_FIRST(&engine_conf->group_list);
+			d->iev = iev;
+			d->peerid = imsg->hdr.peerid;
+			d->pid = imsg->hdr.pid;
+			d->paused = 0;
+			TAILQ_INSERT_TAIL(&engine_dumps, d, entry);
+			engine_stats.dumps++;
+			break;
+		} else if (filter[0] != '\0' &&
+		    memchr(filter, '\0', sizeof(filter)) != NULL) {
+			engine_stats.group_finds++;
+			if ((g = group_find(engine_conf, filter)) != NULL) {
+				engine_stats.group_find_hits++;
+				engine_group_info(g, &cei);
+				engine_imsg_compose_frontend(iev,
+				    IMSG_CTL_SHOW_ENGINE_INFOS,
+				    imsg->hdr.peerid, imsg->hdr.pid, &cei,
+				    sizeof(cei));
 			}
 		}
-		engine_imsg_compose_frontend(IMSG_CTL_END, imsg->hdr.pid, NULL,
-		    0);
+		engine_imsg_compose_frontend(iev, IMSG_CTL_END,
+		    imsg->hdr.peerid, imsg->hdr.pid, NULL, 0);
 		break;
 	default:
 		log_debug("%s: error handling imsg", __func__);
 		break;
 	}
 }
+
+/*
+ * Send the next IMSG_CTL_SHOW_ENGINE_INFOS of each dump in turn, as long
+ * as the pipe to its frontend keeps up. Whatever is queued here arms
+ * EV_WRITE, and the frontend draining the pipe brings us back for more,
+ * so a dump of any size only ever holds DUMP_MAXQUEUED imsgs in memory.
+ * A frontend that is slow to drain holds up only its own dumps.
+ */
+void
+engine_dump_run(void)
+{
+	static struct ctl_engine_info	 cei[CTL_ENGINE_INFO_MAX];
+	struct engine_dump		*d, *nd;
+	size_t				 n;
+	int				 sent;
+
+	do {
+		sent = 0;
+		TAILQ_FOREACH_SAFE(d, &engine_dumps, entry, nd) {
+			if (d->paused ||
+			    d->iev->ibuf.w.queued >= DUMP_MAXQUEUED)
+				continue;
+			for (n = 0; d->next != NULL &&
+			    n < CTL_ENGINE_INFO_MAX; n++) {
+				engine_group_info(d->next, &cei[n]);
+				d->next = LIST_NEXT(d->next, entry);
+			}
+			engine_imsg_compose_frontend(d->iev,
+			    IMSG_CTL_SHOW_ENGINE_INFOS, d->peerid, d->pid,
+			    cei, n * sizeof(cei[0]));
+			sent = 1;
+			if (d->next != NULL)
+				continue;
+			engine_imsg_compose_frontend(d->iev, IMSG_CTL_END,
+			    d->peerid, d->pid, NULL, 0);
+			TAILQ_REMOVE(&engine_dumps, d, entry);
+			free(d);
+		}
+	} while (sent);
+}
+
+/*
+ * The flush wrote to a frontend, which may have made room for its dumps.
+ */
+void
+engine_dump_written(struct imsgev *iev)
+{
+	engine_dump_run();
+}
+
+/*
+ * The frontend behind iev wants the dump with the peerid of imsg held
+ * back, continued or dropped, because of how its client keeps up. It
+ * ended the request of a dropped dump already.
+ */
+void
+engine_dump_ctl(struct imsgev *iev, struct imsg *imsg)
+{
+	struct engine_dump	*d;
+
+	TAILQ_FOREACH(d, &engine_dumps, entry) {
+		if (d->iev == iev && d->peerid == imsg->hdr.peerid)
+			break;
+	}
+	if (d == NULL)
+		return;
+
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_DUMP_PAUSE:
+		d->paused = 1;
+		break;
+	case IMSG_CTL_DUMP_RESUME:
+		/* engine_dump_run() follows the dispatch. */
+		d->paused = 0;
+		break;
+	case IMSG_CTL_DUMP_CANCEL:
+		TAILQ_REMOVE(&engine_dumps, d, entry);
+		engine_stats.dumps_aborted++;
+		free(d);
+		break;
+	}
+}
+
+/*
+ * g is about to be removed, move dumps that would send it next past it.
+ */
+void
+engine_dump_forget(struct group *g)
+{
+	struct engine_dump	*d;
+
+	TAILQ_FOREACH(d, &engine_dumps, entry) {
+		if (d->next == g)
+			d->next = LIST_NEXT(g, entry);
+	}
+}
+
+/*
+ * End all dumps early. A full reload replaces the groups they walk. The
+ * IMSG_CTL_DUMP_ABORTED before the IMSG_CTL_END tells that the reply is
+ * incomplete.
+ */
+void
+engine_dump_abort(void)
+{
+	struct engine_dump	*d;
+
+	while ((d = TAILQ_FIRST(&engine_dumps)) != NULL) {
+		TAILQ_REMOVE(&engine_dumps, d, entry);
+		engine_stats.dumps_aborted++;
+		engine_imsg_compose_frontend(d->iev, IMSG_CTL_DUMP_ABORTED,
+		    d->peerid, d->pid, NULL, 0);
+		engine_imsg_compose_frontend(d->iev, IMSG_CTL_END, d->peerid,
+		    d->pid, NULL, 0);
+		free(d);
+	}
+}
+
+void
+engine_group_info(struct group *g, struct ctl_engine_info *cei)
+{
+	memcpy(cei->name, g->name, sizeof(cei->name));
+	cei->yesno = g->yesno;
+	cei->integer = g->integer;
+	cei->group_v4_bits = g->group_v4_bits;
+	cei->group_v6_bits = g->group_v6_bits;
+	memcpy(&cei->group_v4address, &g->group_v4address,
+	    sizeof(cei->group_v4address));
+	memcpy(&cei->group_v6address, &g->group_v6address,
+	    sizeof(cei->group_v6address));
+}
+
+void
+engine_lookup_ctl(struct imsgev *iev, struct imsg *imsg)
+{
+	struct ctl_addr		 ca;
+	struct ctl_engine_info	 cei;
+	struct group		*g = NULL;
+
+	if (engine_lpm_defer(iev, imsg))
+		return;
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(ca)) {
+		log_warnx("%s: wrong imsg len", __func__);
+		goto done;
+	}
+	memcpy(&ca, imsg->data, sizeof(ca));
+
+	switch (ca.af) {
+	case AF_INET:
+		g = lpm_match(&engine_lpm4, &ca.addr.v4);
+		break;
+	case AF_INET6:
+		g = lpm_match(&engine_lpm6, &ca.addr.v6);
+		break;
+	default:
+		log_warnx("%s: unknown address family %d", __func__, ca.af);
+		break;
+	}
+
+	engine_stats.lookups++;
+	if (g != NULL) {
+		engine_stats.lookup_hits++;
+		engine_group_info(g, &cei);
+		engine_imsg_compose_frontend(iev, IMSG_CTL_LOOKUP_ADDR,
+		    imsg->hdr.peerid, imsg->hdr.pid, &cei, sizeof(cei));
+	}
+done:
+	engine_imsg_compose_frontend(iev, IMSG_CTL_END, imsg->hdr.peerid,
+	    imsg->hdr.pid, NULL, 0);
+}
+
+/*
+ * Match every address of an IMSG_CTL_LOOKUP_ADDRS. The frontend merges
+ * our answer with those of the other engines.
+ */
+void
+engine_lookups_ctl(struct imsgev *iev, struct imsg *imsg)
+{
+	static struct ctl_lookup_match	 clm[CTL_LOOKUP_ADDRS_MAX];
+	struct ctl_addr			*ca = imsg->data;
+	struct group			*g;
+	size_t				 i, n, len;
+
+	if (engine_lpm_defer(iev, imsg))
+		return;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	n = len / sizeof(*ca);
+	if (len == 0 || len % sizeof(*ca) != 0 || n > CTL_LOOKUP_ADDRS_MAX) {
+		log_warnx("%s: wrong imsg len", __func__);
+		goto done;
+	}
+
+	for (i = 0; i < n; i++) {
+		memset(&clm[i], 0, sizeof(clm[i]));
+		clm[i].bits = -1;
+		switch (ca[i].af) {
+		case AF_INET:
+			if ((g = lpm_match(&engine_lpm4,
+			    &ca[i].addr.v4)) != NULL)
+				clm[i].bits = g->group_v4_bits;
+			break;
+		case AF_INET6:
+			if ((g = lpm_match(&engine_lpm6,
+			    &ca[i].addr.v6)) != NULL)
+				clm[i].bits = g->group_v6_bits;
+			break;
+		default:
+			g = NULL;
+			break;
+		}
+		if (g != NULL) {
+			memcpy(clm[i].name, g->name, sizeof(clm[i].name));
+			engine_stats.lookup_hits++;
+		}
+	}
+	engine_stats.lookups += n;
+	engine_stats.lookup_batches++;
+
+	engine_imsg_compose_frontend(iev, IMSG_CTL_LOOKUP_ADDRS,
+	    imsg->hdr.peerid, imsg->hdr.pid, clm, n * sizeof(clm[0]));
+done:
+	engine_imsg_compose_frontend(iev, IMSG_CTL_END, imsg->hdr.peerid,
+	    imsg->hdr.pid, NULL, 0);
+}
+
+void
+engine_showstats_ctl(struct imsgev *iev, struct imsg *imsg)
+{
+	static struct ctl_stats	 st;
+	const char		*name = engine_name;
+	char			 fname[16], prefix[32];
+	int			 i;
+
+	st.count = 0;
+	ctl_stats_add(&st, name, "lookups", engine_stats.lookups);
+	ctl_stats_add(&st, name, "lookup_hits", engine_stats.lookup_hits);
+	ctl_stats_add(&st, name, "lookup_batches",
+	    engine_stats.lookup_batches);
+	ctl_stats_add(&st, name, "lookups_deferred",
+	    engine_stats.lookups_deferred);
+	ctl_stats_add(&st, name, "group_finds", engine_stats.group_finds);
+	ctl_stats_add(&st, name, "group_find_hits",
+	    engine_stats.group_find_hits);
+	ctl_stats_add(&st, name, "dumps", engine_stats.dumps);
+	ctl_stats_add(&st, name, "dumps_aborted", engine_stats.dumps_aborted);
+	ctl_stats_add(&st, name, "groups", engine_conf->group_count);
+	ctl_stats_add(&st, name, "generation", engine_conf->generation);
+	ctl_stats_add(&st, name, "prefixes_v4", engine_lpm4.count);
+	ctl_stats_add(&st, name, "prefixes_v6", engine_lpm6.count);
+	ctl_stats_log(&st, name);
+	snprintf(prefix, sizeof(prefix), "%s.main", name);
+	ctl_stats_imsgev(&st, prefix, iev_main);
+	for (i = 0; i < engine_nfrontends; i++) {
+		instance_name("frontend", i, fname, sizeof(fname));
+		snprintf(prefix, sizeof(prefix), "%s.%s", name, fname);
+		ctl_stats_imsgev(&st, prefix, iev_frontends[i]);
+	}
+
+	engine_imsg_compose_frontend(iev, IMSG_CTL_SHOW_STATS,
+	    imsg->hdr.peerid, imsg->hdr.pid, st.stat,
+	    st.count * sizeof(st.stat[0]));
+	engine_imsg_compose_frontend(iev, IMSG_CTL_END, imsg->hdr.peerid,
+	    imsg->hdr.pid, NULL, 0);
+}
+
+void
+engine_showlatency_ctl(struct imsgev *iev, struct imsg *imsg)
+{
+	static struct ctl_latency	 cl[CTL_LATENCY_MAX];
+	size_t				 n;
+
+	n = latency_fill(engine_name, cl, CTL_LATENCY_MAX);
+	engine_imsg_compose_frontend(iev, IMSG_CTL_SHOW_LATENCY,
+	    imsg->hdr.peerid, imsg->hdr.pid, cl, n * sizeof(cl[0]));
+	engine_imsg_compose_frontend(iev, IMSG_CTL_END, imsg->hdr.peerid,
+	    imsg->hdr.pid, NULL, 0);
+}
+
+/*
+ * Tell the frontends that replies from here on come from the new config,
+ * so that they drop the ones they cached.
+ */
+void
+engine_reconf_notify(void)
+{
+	int	i;
+
+	for (i = 0; i < engine_nfrontends; i++)
+		imsg_compose_event(iev_frontends[i], IMSG_RECONF_END, 0, 0,
+		    -1, &engine_conf->generation,
+		    sizeof(engine_conf->generation));
+}
+
+/*
+ * Apply one group of a delta reload to engine_conf, keeping the prefix
+ * index in step, unless it is to be built again after the delta.
+ */
+void
+engine_reconf_group(struct imsg *imsg)
+{
+	struct group	*g, *xg;
+	size_t		 len;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (imsg->hdr.type == IMSG_RECONF_GROUP_DEL) {
+		if (len != sizeof(g->name) ||
+		    memchr(imsg->data, '\0', len) == NULL)
+			fatalx("%s: invalid IMSG_RECONF_GROUP_DEL", __func__);
+		if ((g = group_find(engine_conf, imsg->data)) == NULL) {
+			log_warnx("%s: unknown group %s", __func__,
+			    (char *)imsg->data);
+			return;
+		}
+		if (!lpm_stale)
+			engine_lpm_remove(g);
+		engine_dump_forget(g);
+		group_remove(engine_conf, g);
+		group_free(engine_conf, g);
+		return;
+	}
+
+	if (len != sizeof(struct group))
+		fatalx("%s: invalid imsg %d length", __func__,
+		    imsg->hdr.type);
+	xg = imsg->data;
+	xg->name[sizeof(xg->name) - 1] = '\0';
+
+	if ((g = group_find(engine_conf, xg->name)) != NULL) {
+		if (!lpm_stale)
+			engine_lpm_remove(g);
+		group_copy(g, xg);
+	} else {
+		g = group_alloc(engine_conf);
+		memcpy(g, xg, sizeof(*g));
+		group_insert(engine_conf, g);
+	}
+	if (!lpm_stale)
+		engine_lpm_insert(g);
+}
+
+/*
+ * Start indexing the group prefixes of engine_conf. Indexing a few
+ * hundred thousand prefixes takes long enough to be noticeable, so it
+ * is done in chunks from the event loop.
+ */
+void
+engine_lpm_start(void)
+{
+	evtimer_del(&ev_lpm);
+	lpm_clear(&engine_lpm4);
+	lpm_clear(&engine_lpm6);
+	lpm_stale = 0;
+
+	lpm_next = LIST_FIRST(&engine_conf->group_list);
+	if (lpm_next != NULL) {
+		struct timeval	tv = { 0, 0 };
+
+		evtimer_add(&ev_lpm, &tv);
+	} else
+		engine_lpm_done();
+}
+
+void
+engine_lpm_build(int fd, short event, void *bula)
+{
+	struct timeval	 tv = { 0, 0 };
+	int		 n;
+
+	for (n = 0; lpm_next != NULL && n < LPM_BUILD_CHUNK; n++) {
+		engine_lpm_insert(lpm_next);
+		lpm_next = LIST_NEXT(lpm_next, entry);
+	}
+
+	if (lpm_next != NULL)
+		evtimer_add(&ev_lpm, &tv);
+	else {
+		log_debug("%s: indexed %zu IPv4 and %zu IPv6 prefixes",
+		    __func__, engine_lpm4.count, engine_lpm6.count);
+		engine_lpm_done();
+	}
+}
+
+/*
+ * The index is complete, answer the lookups that waited for it. Not if
+ * a delta came in and it is to be built again.
+ */
+void
+engine_lpm_done(void)
+{
+	struct engine_lookup	*l;
+
+	if (lpm_stale)
+		return;
+
+	while ((l = TAILQ_FIRST(&engine_lookups)) != NULL) {
+		TAILQ_REMOVE(&engine_lookups, l, entry);
+		if (l->imsg.hdr.type == IMSG_CTL_LOOKUP_ADDR)
+			engine_lookup_ctl(l->iev, &l->imsg);
+		else
+			engine_lookups_ctl(l->iev, &l->imsg);
+		free(l->imsg.data);
+		free(l);
+	}
+}
+
+/*
+ * Keep a lookup for engine_lpm_done() while the index is being built or
+ * a delta has made it stale. Returns 1 if it was kept.
+ */
+int
+engine_lpm_defer(struct imsgev *iev, struct imsg *imsg)
+{
+	struct engine_lookup	*l;
+	size_t			 len;
+
+	if (lpm_next == NULL && !lpm_stale)
+		return (0);
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if ((l = calloc(1, sizeof(*l))) == NULL)
+		fatal(NULL);
+	if (len > 0) {
+		if ((l->imsg.data = malloc(len)) == NULL)
+			fatal(NULL);
+		memcpy(l->imsg.data, imsg->data, len);
+	}
+	l->iev = iev;
+	l->imsg.hdr = imsg->hdr;
+	l->imsg.fd = -1;
+	TAILQ_INSERT_TAIL(&engine_lookups, l, entry);
+	engine_stats.lookups_deferred++;
+
+	return (1);
+}
+
+/*
+ * A zero length prefix is what an unconfigured group address looks like,
+ * so such prefixes are not indexed.
+ */
+void
+engine_lpm_insert(struct group *g)
+{
+	if (g->group_v4_bits > 0 && lpm_insert(&engine_lpm4,
+	    &g->group_v4address, g->group_v4_bits, g) != 0)
+		log_warnx("group %s: duplicate group-v4address", g->name);
+	if (g->group_v6_bits > 0 && lpm_insert(&engine_lpm6,
+	    &g->group_v6address, g->group_v6_bits, g) != 0)
+		log_warnx("group %s: duplicate group-v6address", g->name);
+}
+
+void
+engine_lpm_remove(struct group *g)
+{
+	if (g->group_v4_bits > 0)
+		lpm_remove(&engine_lpm4, &g->group_v4address,
+		    g->group_v4_bits, g);
+	if (g->group_v6_bits > 0)
+		lpm_remove(&engine_lpm6, &g->group_v6address,
+		    g->group_v6_bits, g);
+}
@@ -17,4 +17,5 @@
  */
 
 void		 engine(int, int);
-int		 engine_imsg_compose_frontend(int, pid_t, void *, uint16_t);
+int		 engine_imsg_compose_frontend(struct imsgev *, int, uint32_t,
+		     pid_t, void *, uint16_t);
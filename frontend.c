@@ -42,10 +42,16 @@
 
 __dead void	 frontend_shutdown(void);
 void		 frontend_sig_handler(int, short, void *);
+void		 frontend_reconf_group(struct imsg *);
+void		 frontend_reconf_done(struct imsgev *, struct imsg *);
 
 struct newd_conf	*frontend_conf;
 struct imsgev		*iev_main;
-struct imsgev		*iev_engine;
+struct imsgev		*iev_engines[NEWD_MAXENGINES];
+int			 frontend_nengines;
+uint64_t		 frontend_engine_gen[NEWD_MAXENGINES];
+int			 frontend_id;		/* which of the frontends */
+char			 frontend_name[16] = "frontend";
 
 void
 frontend_sig_handler(int sig, short event, void *bula)
@@ -65,7 +71,7 @@ frontend_sig_handler(int sig, short event, void *bula)
 }
 
 void
-frontend(int debug, int verbose, char *sockname)
+frontend(int debug, int verbose)
 {
 	struct event	 ev_sigint, ev_sigterm;
 	struct passwd	*pw;
@@ -75,9 +81,8 @@ frontend(int debug, int verbose, char *sockname)
 	log_init(debug, LOG_DAEMON);
 	log_setverbose(verbose);
 
-	/* Create newd control socket outside chroot. */
-	if (control_init(sockname) == -1)
-		fatalx("control socket setup failed");
+	/* main created the control socket, every frontend accepts on it. */
+	control_state.fd = CONTROL_FD;
 
 	if ((pw = getpwnam(NEWD_USER)) == NULL)
 		fatal("getpwnam");
@@ -100,6 +105,8 @@ frontend(int debug, int verbose, char *sockname)
 		fatal("pledge");
 
 	event_init();
+	latency_init();
+	log_async();
 
 	/* Setup signal handler. */
 	signal_set(&ev_sigint, SIGINT, frontend_sig_handler, NULL);
@@ -110,10 +117,11 @@ frontend(int debug, int verbose, char *sockname)
 	signal(SIGHUP, SIG_IGN);
 
 	/* Setup pipe and event handler to the parent process. */
-	if ((iev_main = malloc(sizeof(struct imsgev))) == NULL)
+	if ((iev_main = calloc(1, sizeof(struct imsgev))) == NULL)
 		fatal(NULL);
 	imsg_init(&iev_main->ibuf, 3);
 	iev_main->handler = frontend_dispatch_main;
+	iev_main->peer = PROC_MAIN;
 	iev_main->events = EV_READ;
 	event_set(&iev_main->ev, iev_main->ibuf.fd, iev_main->events,
 	    iev_main->handler, iev_main);
@@ -123,6 +131,9 @@ frontend(int debug, int verbose, char *sockname)
 	TAILQ_INIT(&ctl_conns);
 	control_listen();
 
+	/* Tell main we are ready for the config. */
+	frontend_imsg_compose_main(IMSG_STARTUP, 0, 0, NULL, 0);
+
 	event_dispatch();
 
 	frontend_shutdown();
@@ -131,17 +142,22 @@ frontend(int debug, int verbose, char *sockname)
 __dead void
 frontend_shutdown(void)
 {
+	int	i;
+
 	/* Close pipes. */
-	msgbuf_write(&iev_engine->ibuf.w);
-	msgbuf_clear(&iev_engine->ibuf.w);
-	close(iev_engine->ibuf.fd);
+	for (i = 0; i < frontend_nengines; i++) {
+		msgbuf_write(&iev_engines[i]->ibuf.w);
+		msgbuf_clear(&iev_engines[i]->ibuf.w);
+		close(iev_engines[i]->ibuf.fd);
+	}
 	msgbuf_write(&iev_main->ibuf.w);
 	msgbuf_clear(&iev_main->ibuf.w);
 	close(iev_main->ibuf.fd);
 
 	config_clear(frontend_conf);
 
-	free(iev_engine);
+	for (i = 0; i < frontend_nengines; i++)
+		free(iev_engines[i]);
 	free(iev_main);
 
 	log_info("frontend exiting");
@@ -149,19 +165,39 @@ frontend_shutdown(void)
 }
 
 int
-frontend_imsg_compose_main(int type, pid_t pid, void *data,
+frontend_imsg_compose_main(int type, uint32_t peerid, pid_t pid, void *data,
     uint16_t datalen)
 {
-	return (imsg_compose_event(iev_main, type, 0, pid, -1, data,
+	return (imsg_compose_event(iev_main, type, peerid, pid, -1, data,
 	    datalen));
 }
 
+/*
+ * Send an imsg to every engine and return how many there are, which is
+ * how many replies to expect.
+ */
 int
-frontend_imsg_compose_engine(int type, uint32_t peerid, pid_t pid,
+frontend_imsg_compose_engines(int type, uint32_t peerid, pid_t pid,
     void *data, uint16_t datalen)
 {
-	return (imsg_compose_event(iev_engine, type, peerid, pid, -1,
-	    data, datalen));
+	int	i;
+
+	for (i = 0; i < frontend_nengines; i++)
+		imsg_compose_event(iev_engines[i], type, peerid, pid, -1,
+		    data, datalen);
+
+	return (frontend_nengines);
+}
+
+/*
+ * Send an imsg to the engine owning the group called name.
+ */
+int
+frontend_imsg_compose_group(const char *name, int type, uint32_t peerid,
+    pid_t pid, void *data, uint16_t datalen)
+{
+	return (imsg_compose_event(iev_engines[group_shard(name,
+	    frontend_nengines)], type, peerid, pid, -1, data, datalen));
 }
 
 void
@@ -170,9 +206,10 @@ frontend_dispatch_main(int fd, short event, void *bula)
 	static struct newd_conf	*nconf;
 	struct imsg		 imsg;
 	struct group		*g;
-	struct imsgev		*iev = bula;
+	struct imsgev		*iev = bula, *eiev;
 	struct imsgbuf		*ibuf = &iev->ibuf;
-	int			 n, shut = 0;
+	struct ipc_link		 link;
+	int			 n, shut = 0, verbose;
 
 	if (event & EV_READ) {
 		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
@@ -188,7 +225,7 @@ frontend_dispatch_main(int fd, short event, void *bula)
 	}
 
 	for (;;) {
-		if ((n = imsg_get(ibuf, &imsg)) == -1)
+		if ((n = imsg_get_event(iev, &imsg)) == -1)
 			fatal("%s: imsg_get error", __func__);
 		if (n == 0)	/* No more messages. */
 			break;
@@ -196,10 +233,16 @@ frontend_dispatch_main(int fd, short event, void *bula)
 		switch (imsg.hdr.type) {
 		case IMSG_SOCKET_IPC:
 			/*
-			 * Setup pipe and event handler to the engine
-			 * process.
+			 * Setup pipe and event handler to an engine
+			 * process. Main sends them in shard order.
 			 */
-			if (iev_engine) {
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(link))
+				fatalx("%s: invalid IMSG_SOCKET_IPC", __func__);
+			memcpy(&link, imsg.data, sizeof(link));
+			if (link.engine != frontend_nengines ||
+			    link.engine >= NEWD_MAXENGINES ||
+			    (frontend_nengines > 0 &&
+			    link.frontend != frontend_id)) {
 				log_warnx("%s: received unexpected imsg fd "
 				    "to frontend", __func__);
 				break;
@@ -211,37 +254,101 @@ frontend_dispatch_main(int fd, short event, void *bula)
 				break;
 			}
 
-			iev_engine = malloc(sizeof(struct imsgev));
-			if (iev_engine == NULL)
+			if ((eiev = calloc(1, sizeof(struct imsgev))) == NULL)
 				fatal(NULL);
 
-			imsg_init(&iev_engine->ibuf, fd);
-			iev_engine->handler = frontend_dispatch_engine;
-			iev_engine->events = EV_READ;
-
-			event_set(&iev_engine->ev, iev_engine->ibuf.fd,
-			iev_engine->events, iev_engine->handler, iev_engine);
-			event_add(&iev_engine->ev, NULL);
+			imsg_init(&eiev->ibuf, fd);
+			eiev->handler = frontend_dispatch_engine;
+			eiev->peer = PROC_ENGINE;
+			eiev->peer_instance = link.engine;
+			eiev->events = EV_READ;
+
+			event_set(&eiev->ev, eiev->ibuf.fd, eiev->events,
+			    eiev->handler, eiev);
+			event_add(&eiev->ev, NULL);
+			iev_engines[frontend_nengines++] = eiev;
+
+			/* The first link tells us who we are. */
+			if (frontend_nengines == 1 && link.frontend != 0) {
+				frontend_id = link.frontend;
+				newd_instance = frontend_id;
+				instance_name("frontend", frontend_id,
+				    frontend_name, sizeof(frontend_name));
+				setproctitle("%s", frontend_name);
+				log_procinit(frontend_name);
+			}
+			break;
+		case IMSG_CTL_LOG_VERBOSE:
+			/* Another frontend was told, main passes it on. */
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(verbose))
+				fatalx("%s: invalid IMSG_CTL_LOG_VERBOSE",
+				    __func__);
+			memcpy(&verbose, imsg.data, sizeof(verbose));
+			log_setverbose(verbose);
 			break;
 		case IMSG_RECONF_CONF:
 			if ((nconf = malloc(sizeof(struct newd_conf))) ==
 			    NULL)
 				fatal(NULL);
 			memcpy(nconf, imsg.data, sizeof(struct newd_conf));
-			LIST_INIT(&nconf->group_list);
+			config_init_groups(nconf);
 			break;
 		case IMSG_RECONF_GROUP:
-			if ((g = malloc(sizeof(struct group))) == NULL)
-				fatal(NULL);
+			g = group_alloc(nconf);
 			memcpy(g, imsg.data, sizeof(struct group));
-			LIST_INSERT_HEAD(&nconf->group_list, g, entry);
+			group_insert(nconf, g);
+			break;
+		case IMSG_RECONF_GROUPS:
+			if (config_add_groups(nconf, imsg.data,
+			    imsg.hdr.len - IMSG_HEADER_SIZE) == -1)
+				fatalx("%s: invalid IMSG_RECONF_GROUPS",
+				    __func__);
+			break;
+		case IMSG_RECONF_DELTA:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE +
+			    sizeof(struct newd_conf))
+				fatalx("%s: invalid IMSG_RECONF_DELTA",
+				    __func__);
+			config_copy_global(frontend_conf, imsg.data);
+			latency_set_threshold(frontend_conf->latency_threshold);
+			control_set_limits(frontend_conf);
 			break;
+		case IMSG_RECONF_GROUP_ADD:
+		case IMSG_RECONF_GROUP_MOD:
+		case IMSG_RECONF_GROUP_DEL:
+			frontend_reconf_group(&imsg);
+			break;
+		case IMSG_RECONF_SNAPSHOT:
+			if ((fd = imsg.fd) == -1)
+				log_warnx("%s: expected to receive config "
+				    "snapshot fd but didn't receive any",
+				    __func__);
+			else
+				nconf = config_image_map(fd);
+			if (nconf == NULL) {
+				/* Have main send the config as imsgs. */
+				imsg_compose_event(iev, IMSG_RECONF_SNAPSHOT,
+				    0, 0, -1, NULL, 0);
+				break;
+			}
+			/* FALLTHROUGH */
 		case IMSG_RECONF_END:
-			merge_config(frontend_conf, nconf);
-			nconf = NULL;
+			/* A delta has already been applied. */
+			if (nconf != NULL) {
+				merge_config(frontend_conf, nconf);
+				nconf = NULL;
+				latency_set_threshold(
+				    frontend_conf->latency_threshold);
+				control_set_limits(frontend_conf);
+				control_notify_full();
+			}
+			frontend_reconf_done(iev, &imsg);
 			break;
 		case IMSG_CTL_END:
 		case IMSG_CTL_SHOW_MAIN_INFO:
+		case IMSG_CTL_SHOW_STATS:
+		case IMSG_CTL_SHOW_LATENCY:
+		case IMSG_CTL_SHOW_TRACE:
 			control_imsg_relay(&imsg);
 			break;
 		default:
@@ -255,7 +362,7 @@ frontend_dispatch_main(int fd, short event, void *bula)
 		imsg_event_add(iev);
 	else {
 		/* This pipe is dead. Remove its event handler. */
-		event_del(&iev->ev);
+		imsg_event_del(iev);
 		event_loopexit(NULL);
 	}
 }
@@ -282,7 +389,7 @@ frontend_dispatch_engine(int fd, short event, void *bula)
 	}
 
 	for (;;) {
-		if ((n = imsg_get(ibuf, &imsg)) == -1)
+		if ((n = imsg_get_event(iev, &imsg)) == -1)
 			fatal("%s: imsg_get error", __func__);
 		if (n == 0)	/* No more messages. */
 			break;
@@ -290,8 +397,20 @@ frontend_dispatch_engine(int fd, short event, void *bula)
 		switch (imsg.hdr.type) {
 		case IMSG_CTL_END:
 		case IMSG_CTL_SHOW_ENGINE_INFO:
+		case IMSG_CTL_SHOW_ENGINE_INFOS:
+		case IMSG_CTL_LOOKUP_ADDR:
+		case IMSG_CTL_LOOKUP_ADDRS:
+		case IMSG_CTL_SHOW_STATS:
+		case IMSG_CTL_SHOW_LATENCY:
+		case IMSG_CTL_SHOW_TRACE:
+		case IMSG_CTL_DUMP_ABORTED:
 			control_imsg_relay(&imsg);
 			break;
+		case IMSG_RECONF_END:
+			/* The engine has a new config. */
+			control_cache_flush();
+			frontend_reconf_done(iev, &imsg);
+			break;
 		default:
 			log_debug("%s: error handling imsg %d", __func__,
 			    imsg.hdr.type);
@@ -303,13 +422,101 @@ frontend_dispatch_engine(int fd, short event, void *bula)
 		imsg_event_add(iev);
 	else {
 		/* This pipe is dead. Remove its event handler. */
-		event_del(&iev->ev);
+		imsg_event_del(iev);
 		event_loopexit(NULL);
 	}
 }
 
+/*
+ * Apply one group of a delta reload to frontend_conf.
+ */
 void
-frontend_showinfo_ctl(struct ctl_conn *c)
+frontend_reconf_group(struct imsg *imsg)
+{
+	struct group	*g, *xg;
+	size_t		 len;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (imsg->hdr.type == IMSG_RECONF_GROUP_DEL) {
+		if (len != sizeof(g->name) ||
+		    memchr(imsg->data, '\0', len) == NULL)
+			fatalx("%s: invalid IMSG_RECONF_GROUP_DEL", __func__);
+		if ((g = group_find(frontend_conf, imsg->data)) == NULL) {
+			log_warnx("%s: unknown group %s", __func__,
+			    (char *)imsg->data);
+			return;
+		}
+		group_remove(frontend_conf, g);
+		group_free(frontend_conf, g);
+		control_notify_group(imsg->data, CTL_NOTIFY_DEL);
+		return;
+	}
+
+	if (len != sizeof(struct group))
+		fatalx("%s: invalid imsg %d length", __func__,
+		    imsg->hdr.type);
+	xg = imsg->data;
+	xg->name[sizeof(xg->name) - 1] = '\0';
+
+	if ((g = group_find(frontend_conf, xg->name)) != NULL)
+		group_copy(g, xg);
+	else {
+		g = group_alloc(frontend_conf);
+		memcpy(g, xg, sizeof(*g));
+		group_insert(frontend_conf, g);
+	}
+	control_notify_group(xg->name,
+	    imsg->hdr.type == IMSG_RECONF_GROUP_ADD ? CTL_NOTIFY_ADD :
+	    CTL_NOTIFY_MOD);
+}
+
+/*
+ * Main or an engine behind iev is done with a reload. Subscribers hear of
+ * a config once all of us have it.
+ */
+void
+frontend_reconf_done(struct imsgev *iev, struct imsg *imsg)
+{
+	uint64_t	gen;
+	int		i;
+
+	if (iev != iev_main) {
+		if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(gen))
+			fatalx("%s: invalid IMSG_RECONF_END", __func__);
+		for (i = 0; i < frontend_nengines; i++) {
+			if (iev_engines[i] == iev)
+				memcpy(&frontend_engine_gen[i], imsg->data,
+				    sizeof(gen));
+		}
+	}
+
+	control_notify(frontend_generation_all());
+}
+
+uint64_t
+frontend_generation(void)
+{
+	return (frontend_conf->generation);
+}
+
+/*
+ * The generation that we and all engines have the config of.
+ */
+uint64_t
+frontend_generation_all(void)
+{
+	uint64_t	gen = frontend_conf->generation;
+	int		i;
+
+	for (i = 0; i < frontend_nengines; i++) {
+		if (frontend_engine_gen[i] < gen)
+			gen = frontend_engine_gen[i];
+	}
+	return (gen);
+}
+
+void
+frontend_showinfo_ctl(struct ctl_conn *c, uint32_t peerid, pid_t pid)
 {
 	static struct ctl_frontend_info cfi;
 
@@ -319,6 +526,44 @@ frontend_showinfo_ctl(struct ctl_conn *c)
 	memcpy(cfi.global_text, frontend_conf->global_text,
 	    sizeof(cfi.global_text));
 
-	imsg_compose_event(&c->iev, IMSG_CTL_SHOW_FRONTEND_INFO, 0, 0, -1,
-	    &cfi, sizeof(struct ctl_frontend_info));
+	imsg_compose_event(&c->iev, IMSG_CTL_SHOW_FRONTEND_INFO, peerid, pid,
+	    -1, &cfi, sizeof(struct ctl_frontend_info));
+}
+
+void
+frontend_showstats_ctl(struct ctl_conn *c, uint32_t peerid, pid_t pid)
+{
+	static struct ctl_stats	 st;
+	char			 name[16], prefix[32];
+	int			 i;
+
+	st.count = 0;
+	ctl_stats_add(&st, frontend_name, "groups",
+	    frontend_conf->group_count);
+	ctl_stats_add(&st, frontend_name, "generation",
+	    frontend_conf->generation);
+	instance_name("control", frontend_id, name, sizeof(name));
+	control_stats(&st, name);
+	ctl_stats_log(&st, frontend_name);
+	snprintf(prefix, sizeof(prefix), "%s.main", frontend_name);
+	ctl_stats_imsgev(&st, prefix, iev_main);
+	for (i = 0; i < frontend_nengines; i++) {
+		instance_name("engine", i, name, sizeof(name));
+		snprintf(prefix, sizeof(prefix), "%s.%s", frontend_name, name);
+		ctl_stats_imsgev(&st, prefix, iev_engines[i]);
+	}
+
+	imsg_compose_event(&c->iev, IMSG_CTL_SHOW_STATS, peerid, pid, -1,
+	    st.stat, st.count * sizeof(st.stat[0]));
+}
+
+void
+frontend_showlatency_ctl(struct ctl_conn *c, uint32_t peerid, pid_t pid)
+{
+	static struct ctl_latency	 cl[CTL_LATENCY_MAX];
+	size_t				 n;
+
+	n = latency_fill(frontend_name, cl, CTL_LATENCY_MAX);
+	imsg_compose_event(&c->iev, IMSG_CTL_SHOW_LATENCY, peerid, pid, -1,
+	    cl, n * sizeof(cl[0]));
 }
@@ -18,10 +18,17 @@
 
 TAILQ_HEAD(ctl_conns, ctl_conn)	ctl_conns;
 
-void		 frontend(int, int, char *);
+void		 frontend(int, int);
 void		 frontend_dispatch_main(int, short, void *);
 void		 frontend_dispatch_engine(int, short, void *);
-int		 frontend_imsg_compose_main(int, pid_t, void *, uint16_t);
-int		 frontend_imsg_compose_engine(int, uint32_t, pid_t, void *,
+int		 frontend_imsg_compose_main(int, uint32_t, pid_t, void *,
 		     uint16_t);
-void		 frontend_showinfo_ctl(struct ctl_conn *);
+int		 frontend_imsg_compose_engines(int, uint32_t, pid_t, void *,
+		     uint16_t);
+int		 frontend_imsg_compose_group(const char *, int, uint32_t, pid_t,
+		     void *, uint16_t);
+uint64_t	 frontend_generation(void);
+uint64_t	 frontend_generation_all(void);
+void		 frontend_showinfo_ctl(struct ctl_conn *, uint32_t, pid_t);
+void		 frontend_showstats_ctl(struct ctl_conn *, uint32_t, pid_t);
+void		 frontend_showlatency_ctl(struct ctl_conn *, uint32_t, pid_t);
@@ -0,0 +1,52 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Generated configs for newbench and microbench, not part of newd.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "genconf.h"
+
+/*
+ * Write a config of n groups to f. Every 256th group covers the /24 that
+ * the next 255 have a /32 in, so lookups see nested prefixes.
+ */
+void
+gen_config(FILE *f, uint32_t n)
+{
+	uint32_t	i, block, host;
+
+	fprintf(f, "global-text \"%u generated groups\"\n\n", n);
+	for (i = 0; i < n; i++) {
+		block = i / 256;
+		host = i % 256;
+		fprintf(f, "group g%u {\n", i);
+		if (host == 0)
+			fprintf(f, "\tgroup-v4address 10.%u.%u.0/24\n",
+			    block >> 8, block & 0xff);
+		else
+			fprintf(f, "\tgroup-v4address 10.%u.%u.%u/32\n",
+			    block >> 8, block & 0xff, host);
+		fprintf(f, "\tgroup-v6address 2001:db8:%x:%x::/64\n", i >> 16,
+		    i & 0xffff);
+		fprintf(f, "}\n");
+	}
+}
@@ -0,0 +1,232 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Latency histograms of the imsg handlers and of the event loop of the
+ * calling process.
+ *
+ * imsg_get_event() starts the clock for every imsg it returns and stops
+ * it when it is called for the next one, so each imsg is charged with the
+ * time its dispatcher spent on it. A timer firing every LATENCY_INTERVAL
+ * measures how late the event loop gets around to it.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "newd.h"
+
+#define LATENCY_INTERVAL	1	/* seconds between loop lag samples */
+#define LATENCY_TYPES		IMSG_MAX
+
+const char *latency_name(int);
+void	latency_lag(int, short, void *);
+void	latency_record(struct latency_hist *, uint64_t);
+uint64_t latency_since(struct timespec *);
+
+/* Histogram names, the imsg type in lower case without IMSG_ or CTL_. */
+static const char * const latency_names[IMSG_MAX] = {
+	[IMSG_CTL_LOG_VERBOSE] = "log_verbose",
+	[IMSG_CTL_RELOAD] = "reload",
+	[IMSG_CTL_SHOW_ENGINE_INFO] = "show_engine_info",
+	[IMSG_CTL_SHOW_FRONTEND_INFO] = "show_frontend_info",
+	[IMSG_CTL_SHOW_MAIN_INFO] = "show_main_info",
+	[IMSG_CTL_LOOKUP_ADDR] = "lookup_addr",
+	[IMSG_CTL_LOOKUP_ADDRS] = "lookup_addrs",
+	[IMSG_CTL_LOOKUP_GROUPS] = "lookup_groups",
+	[IMSG_CTL_SET_OPTS] = "set_opts",
+	[IMSG_CTL_SHOW_ENGINE_INFOS] = "show_engine_infos",
+	[IMSG_CTL_SHOW_STATS] = "show_stats",
+	[IMSG_CTL_SHOW_LATENCY] = "show_latency",
+	[IMSG_CTL_SHOW_TRACE] = "show_trace",
+	[IMSG_CTL_SUBSCRIBE] = "subscribe",
+	[IMSG_CTL_NOTIFY] = "notify",
+	[IMSG_CTL_NOTIFY_GROUPS] = "notify_groups",
+	[IMSG_CTL_END] = "end",
+	[IMSG_CTL_NOT_MODIFIED] = "not_modified",
+	[IMSG_CTL_DUMP_PAUSE] = "dump_pause",
+	[IMSG_CTL_DUMP_RESUME] = "dump_resume",
+	[IMSG_CTL_DUMP_CANCEL] = "dump_cancel",
+	[IMSG_RECONF_CONF] = "reconf_conf",
+	[IMSG_RECONF_GROUP] = "reconf_group",
+	[IMSG_RECONF_GROUPS] = "reconf_groups",
+	[IMSG_RECONF_END] = "reconf_end",
+	[IMSG_RECONF_SNAPSHOT] = "reconf_snapshot",
+	[IMSG_RECONF_DELTA] = "reconf_delta",
+	[IMSG_RECONF_GROUP_ADD] = "reconf_group_add",
+	[IMSG_RECONF_GROUP_MOD] = "reconf_group_mod",
+	[IMSG_RECONF_GROUP_DEL] = "reconf_group_del",
+	[IMSG_RELOAD_SOURCE] = "reload_source",
+	[IMSG_RELOAD_GROUPS] = "reload_groups",
+	[IMSG_RELOAD_MACRO] = "reload_macro",
+	[IMSG_RELOAD_IMAGE] = "reload_image",
+	[IMSG_RELOAD_END] = "reload_end",
+	[IMSG_STARTUP] = "startup",
+	[IMSG_SOCKET_IPC] = "socket_ipc",
+	[IMSG_CTL_DUMP_ABORTED] = "dump_aborted",
+	[IMSG_CTL_GENERATION] = "generation",
+};
+
+struct latency_hist	 latency_dispatch[LATENCY_TYPES];
+struct latency_hist	 latency_loop;
+uint64_t		 latency_threshold;	/* microseconds, 0 is off */
+
+struct event		 latency_ev;
+struct timespec		 latency_last;
+
+/*
+ * Start sampling the loop lag. Must be called after event_init().
+ */
+void
+latency_init(void)
+{
+	struct timeval	tv = { LATENCY_INTERVAL, 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &latency_last);
+	evtimer_set(&latency_ev, latency_lag, NULL);
+	evtimer_add(&latency_ev, &tv);
+}
+
+void
+latency_set_threshold(int msec)
+{
+	latency_threshold = (uint64_t)msec * 1000;
+}
+
+void
+latency_begin(struct imsgev *iev, struct imsg *imsg)
+{
+	iev->lat_type = imsg->hdr.type;
+	clock_gettime(CLOCK_MONOTONIC, &iev->lat_start);
+}
+
+void
+latency_end(struct imsgev *iev)
+{
+	uint64_t	usec;
+
+	if (iev->lat_type == IMSG_NONE)
+		return;
+
+	usec = latency_since(&iev->lat_start);
+	if (iev->lat_type < LATENCY_TYPES)
+		latency_record(&latency_dispatch[iev->lat_type], usec);
+	if (latency_threshold != 0 && usec > latency_threshold)
+		log_warnx("handling imsg %s took %llu.%03llu ms",
+		    latency_name(iev->lat_type), (unsigned long long)usec / 1000,
+		    (unsigned long long)usec % 1000);
+	iev->lat_type = IMSG_NONE;
+}
+
+/*
+ * Name of imsg type, or its number if it has none.
+ */
+const char *
+latency_name(int type)
+{
+	static char	buf[16];
+
+	if (type >= 0 && type < LATENCY_TYPES && latency_names[type] != NULL)
+		return (latency_names[type]);
+	snprintf(buf, sizeof(buf), "imsg%d", type);
+	return (buf);
+}
+
+void
+latency_lag(int fd, short event, void *bula)
+{
+	struct timeval	 tv = { LATENCY_INTERVAL, 0 };
+	uint64_t	 usec;
+
+	usec = latency_since(&latency_last);
+	usec = usec > LATENCY_INTERVAL * 1000000ULL ?
+	    usec - LATENCY_INTERVAL * 1000000ULL : 0;
+	latency_record(&latency_loop, usec);
+	if (latency_threshold != 0 && usec > latency_threshold)
+		log_warnx("event loop lagged %llu.%03llu ms",
+		    (unsigned long long)usec / 1000,
+		    (unsigned long long)usec % 1000);
+
+	clock_gettime(CLOCK_MONOTONIC, &latency_last);
+	evtimer_add(&latency_ev, &tv);
+}
+
+void
+latency_record(struct latency_hist *h, uint64_t usec)
+{
+	uint64_t	v;
+	int		b;
+
+	for (b = 0, v = usec; v != 0 && b < LATENCY_BUCKETS - 1; b++)
+		v >>= 1;
+
+	h->bucket[b]++;
+	h->count++;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+uint64_t
+latency_since(struct timespec *start)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, start, &now);
+
+	return (now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+}
+
+/*
+ * Fill cl with the histograms of this process that have seen any use,
+ * named after proc, and return their number.
+ */
+size_t
+latency_fill(const char *proc, struct ctl_latency *cl, size_t max)
+{
+	size_t		 n = 0;
+	int		 i;
+
+	if (n < max) {
+		memset(cl[n].name, 0, sizeof(cl[n].name));
+		snprintf(cl[n].name, sizeof(cl[n].name), "%s.loop", proc);
+		cl[n++].hist = latency_loop;
+	}
+	for (i = 0; i < LATENCY_TYPES && n < max; i++) {
+		if (latency_dispatch[i].count == 0)
+			continue;
+		memset(cl[n].name, 0, sizeof(cl[n].name));
+		snprintf(cl[n].name, sizeof(cl[n].name), "%s.%s", proc,
+		    latency_name(i));
+		cl[n++].hist = latency_dispatch[i];
+	}
+
+	return (n);
+}
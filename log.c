@@ -16,6 +16,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -26,10 +31,60 @@
 
 #include "log.h"
 
+/*
+ * Once log_async() has been called, messages are formatted into a ring and
+ * written out from the event loop, so a slow syslogd or terminal does not
+ * stall the handler that logged them. When the ring is full new messages
+ * are dropped and counted. Each call site, identified by its format
+ * string, may log LOG_RATE_BURST messages per second; the rest are
+ * suppressed. Their count is reported once that second is over, or when
+ * another call site takes over the slot of the call site.
+ */
+#define LOG_RING_SIZE	128
+#define LOG_MSGLEN	1024
+#define LOG_DRAIN_MAX	16	/* messages written per event loop pass */
+#define LOG_RATE_SLOTS	64
+#define LOG_RATE_BURST	20
+
+struct log_msg {
+	int		 pri;
+	char		 msg[LOG_MSGLEN];
+};
+
+struct log_rate {
+	const char	*fmt;
+	time_t		 sec;
+	unsigned int	 count;
+	int		 pri;		/* of the last one suppressed */
+	uint64_t	 suppressed;
+};
+
 static int		 debug;
 static int		 verbose;
 static const char	*log_procname;
 
+static int		 log_async_on;
+static struct event	 log_ev;
+static struct log_msg	 log_ring[LOG_RING_SIZE];
+static unsigned int	 log_head, log_tail;	/* free running */
+static uint64_t		 log_dropped, log_dropped_reported;
+static uint64_t		 log_suppressed;
+static struct log_rate	 log_rates[LOG_RATE_SLOTS];
+static struct event	 log_rate_ev;
+
+static void	vlogkey(int, const char *, const char *, va_list)
+		    __attribute__((__format__ (printf, 3, 0)));
+static void	lognolimit(int, const char *, ...)
+		    __attribute__((__format__ (printf, 2, 3)));
+static void	log_write(int, const char *);
+static void	log_enqueue(int, const char *, va_list)
+		    __attribute__((__format__ (printf, 2, 0)));
+static void	log_drain(int, short, void *);
+static int	log_ratelimit(int, const char *);
+static void	log_rate_report(struct log_rate *);
+static void	log_rate_drain(int, short, void *);
+static void	log_flush(void);
+
 void
 log_init(int n_debug, int facility)
 {
@@ -64,6 +119,37 @@ log_getverbose(void)
 	return (verbose);
 }
 
+/*
+ * Queue messages from now on and write them from the event loop. Must be
+ * called after event_init(). Whatever is left is written out on exit.
+ */
+void
+log_async(void)
+{
+	evtimer_set(&log_ev, log_drain, NULL);
+	evtimer_set(&log_rate_ev, log_rate_drain, NULL);
+	log_async_on = 1;
+	atexit(log_flush);
+}
+
+/*
+ * Forget what is queued and log synchronously again. For a process forked
+ * off one logging asynchronously: the parent writes the queued messages.
+ */
+void
+log_fork(void)
+{
+	log_async_on = 0;
+	log_tail = log_head;
+}
+
+void
+log_getstats(uint64_t *dropped, uint64_t *suppressed)
+{
+	*dropped = log_dropped;
+	*suppressed = log_suppressed;
+}
+
 void
 logit(int pri, const char *fmt, ...)
 {
@@ -76,10 +162,42 @@ logit(int pri, const char *fmt, ...)
 
 void
 vlog(int pri, const char *fmt, va_list ap)
+{
+	vlogkey(pri, fmt, fmt, ap);
+}
+
+/*
+ * Log without any rate limit, for what the rate limit itself reports.
+ */
+static void
+lognolimit(int pri, const char *fmt, ...)
+{
+	va_list	ap;
+
+	va_start(ap, fmt);
+	vlogkey(pri, NULL, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Log fmt, rate limited as the call site passing key. That is the format
+ * string the caller wrote, which stays the same from call to call even if
+ * fmt was made from it. A NULL key is not limited.
+ */
+static void
+vlogkey(int pri, const char *key, const char *fmt, va_list ap)
 {
 	char	*nfmt;
 	int	 saved_errno = errno;
 
+	if (key != NULL && log_ratelimit(pri, key))
+		goto done;
+
+	if (log_async_on) {
+		log_enqueue(pri, fmt, ap);
+		goto done;
+	}
+
 	if (debug) {
 		/* best effort in out of mem situations */
 		if (asprintf(&nfmt, "%s\n", fmt) == -1) {
@@ -93,9 +211,166 @@ vlog(int pri, const char *fmt, va_list ap)
 	} else
 		vsyslog(pri, fmt, ap);
 
+ done:
 	errno = saved_errno;
 }
 
+static void
+log_write(int pri, const char *msg)
+{
+	if (debug) {
+		fprintf(stderr, "%s\n", msg);
+		fflush(stderr);
+	} else
+		syslog(pri, "%s", msg);
+}
+
+static void
+log_enqueue(int pri, const char *fmt, va_list ap)
+{
+	struct log_msg	*m;
+
+	if (log_head - log_tail == LOG_RING_SIZE) {
+		log_dropped++;
+		return;
+	}
+
+	m = &log_ring[log_head++ % LOG_RING_SIZE];
+	m->pri = pri;
+	(void)vsnprintf(m->msg, sizeof(m->msg), fmt, ap);
+
+	if (!evtimer_pending(&log_ev, NULL)) {
+		struct timeval	tv = { 0, 0 };
+
+		evtimer_add(&log_ev, &tv);
+	}
+}
+
+static void
+log_drain(int fd, short event, void *bula)
+{
+	struct timeval	 tv = { 0, 0 };
+	char		 msg[64];
+	int		 n;
+
+	for (n = 0; n < LOG_DRAIN_MAX && log_tail != log_head; n++) {
+		log_write(log_ring[log_tail % LOG_RING_SIZE].pri,
+		    log_ring[log_tail % LOG_RING_SIZE].msg);
+		log_tail++;
+	}
+
+	if (log_dropped != log_dropped_reported && log_tail == log_head) {
+		snprintf(msg, sizeof(msg), "%llu log messages dropped",
+		    (unsigned long long)(log_dropped - log_dropped_reported));
+		log_write(LOG_WARNING, msg);
+		log_dropped_reported = log_dropped;
+	}
+
+	if (log_tail != log_head)
+		evtimer_add(&log_ev, &tv);
+}
+
+/*
+ * Return 1 if the message from the call site using fmt is over its budget
+ * for the current second. What a slot suppressed is reported before the
+ * slot starts a new second or goes to another call site, and from
+ * log_rate_drain() after a second at the latest.
+ */
+static int
+log_ratelimit(int pri, const char *fmt)
+{
+	struct log_rate	*r;
+	time_t		 now;
+
+	if (pri <= LOG_CRIT)
+		return (0);
+
+	r = &log_rates[((uintptr_t)fmt >> 3) % LOG_RATE_SLOTS];
+	now = time(NULL);
+
+	if (r->fmt == fmt && r->sec == now) {
+		if (r->count >= LOG_RATE_BURST) {
+			r->pri = pri;
+			r->suppressed++;
+			log_suppressed++;
+			if (log_async_on && !evtimer_pending(&log_rate_ev,
+			    NULL)) {
+				struct timeval	tv = { 1, 0 };
+
+				evtimer_add(&log_rate_ev, &tv);
+			}
+			return (1);
+		}
+		r->count++;
+		return (0);
+	}
+
+	log_rate_report(r);
+	r->fmt = fmt;
+	r->sec = now;
+	r->count = 1;
+
+	return (0);
+}
+
+static void
+log_rate_report(struct log_rate *r)
+{
+	uint64_t	suppressed = r->suppressed;
+
+	if (suppressed == 0)
+		return;
+	r->suppressed = 0;
+	lognolimit(r->pri, "%llu similar messages suppressed",
+	    (unsigned long long)suppressed);
+}
+
+/*
+ * Report the slots whose second is over, and look again in a second for
+ * those still counting.
+ */
+static void
+log_rate_drain(int fd, short event, void *bula)
+{
+	struct timeval	 tv = { 1, 0 };
+	time_t		 now = time(NULL);
+	int		 i, pending = 0;
+
+	for (i = 0; i < LOG_RATE_SLOTS; i++) {
+		if (log_rates[i].suppressed == 0)
+			continue;
+		if (log_rates[i].sec != now)
+			log_rate_report(&log_rates[i]);
+		else
+			pending = 1;
+	}
+	if (pending)
+		evtimer_add(&log_rate_ev, &tv);
+}
+
+/*
+ * Write out everything still queued and log synchronously from now on.
+ */
+static void
+log_flush(void)
+{
+	int	i;
+
+	if (!log_async_on)
+		return;
+
+	for (i = 0; i < LOG_RATE_SLOTS; i++)
+		log_rate_report(&log_rates[i]);
+	log_async_on = 0;
+	evtimer_del(&log_ev);
+	evtimer_del(&log_rate_ev);
+	while (log_tail != log_head) {
+		log_write(log_ring[log_tail % LOG_RING_SIZE].pri,
+		    log_ring[log_tail % LOG_RING_SIZE].msg);
+		log_tail++;
+	}
+}
+
 void
 log_warn(const char *emsg, ...)
 {
@@ -115,7 +390,7 @@ log_warn(const char *emsg, ...)
 			vlog(LOG_ERR, emsg, ap);
 			logit(LOG_ERR, "%s", strerror(saved_errno));
 		} else {
-			vlog(LOG_ERR, nfmt, ap);
+			vlogkey(LOG_ERR, emsg, nfmt, ap);
 			free(nfmt);
 		}
 		va_end(ap);
@@ -144,6 +419,8 @@ log_info(const char *emsg, ...)
 	va_end(ap);
 }
 
+/* log.h wraps this in a macro that checks the verbosity first. */
+#undef log_debug
 void
 log_debug(const char *emsg, ...)
 {
@@ -169,6 +446,7 @@ vfatalc(int code, const char *emsg, va_list ap)
 		s[0] = '\0';
 		sep = "";
 	}
+	log_flush();
 	if (code)
 		logit(LOG_CRIT, "fatal in %s: %s%s%s",
 		    log_procname, s, sep, strerror(code));
@@ -20,12 +20,16 @@
 #define LOG_H
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <sys/cdefs.h>
 
 void	log_init(int, int);
 void	log_procinit(const char *);
 void	log_setverbose(int);
 int	log_getverbose(void);
+void	log_async(void);
+void	log_fork(void);
+void	log_getstats(uint64_t *, uint64_t *);
 void	log_warn(const char *, ...)
 	    __attribute__((__format__ (printf, 1, 2)));
 void	log_warnx(const char *, ...)
@@ -34,6 +38,10 @@ void	log_info(const char *, ...)
 	    __attribute__((__format__ (printf, 1, 2)));
 void	log_debug(const char *, ...)
 	    __attribute__((__format__ (printf, 1, 2)));
+#define log_debug(...)	do {						\
+	if (log_getverbose())						\
+		log_debug(__VA_ARGS__);					\
+} while (0)
 void	logit(int, const char *, ...)
 	    __attribute__((__format__ (printf, 2, 3)));
 void	vlog(int, const char *, va_list)
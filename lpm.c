@@ -0,0 +1,294 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Path compressed binary trie (Patricia) for longest prefix matching of
+ * addresses against the group prefixes. Every node carries the complete
+ * prefix it stands for, so a lookup never has to backtrack. Nodes are
+ * carved from chunks owned by the tree so that dropping a whole tree is
+ * cheap.
+ *
+ * Groups that claim a prefix already taken wait on the dup list of its
+ * node, in the order they came, and the first of them takes over when
+ * the group a lookup finds is removed.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "newd.h"
+#include "lpm.h"
+
+#define LPM_CHUNKSIZE	1024	/* nodes per chunk */
+
+struct lpm_chunk {
+	struct lpm_chunk	*next;
+	struct lpm_node		 nodes[LPM_CHUNKSIZE];
+};
+
+static struct lpm_node	*lpm_node_get(struct lpm_tree *, const uint8_t *,
+			    int, struct group *);
+static void		 lpm_node_put(struct lpm_tree *, struct lpm_node *);
+static int		 lpm_common(const uint8_t *, const uint8_t *, int);
+static void		 lpm_mask(uint8_t *, const void *, int, int);
+
+#define LPM_BIT(a, i)	(((a)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+
+void
+lpm_init(struct lpm_tree *t, int af)
+{
+	memset(t, 0, sizeof(*t));
+	t->maxbits = (af == AF_INET6) ? 128 : 32;
+}
+
+void
+lpm_clear(struct lpm_tree *t)
+{
+	struct lpm_chunk	*c;
+	int			 maxbits = t->maxbits;
+
+	while ((c = t->chunks) != NULL) {
+		t->chunks = c->next;
+		free(c);
+	}
+	memset(t, 0, sizeof(*t));
+	t->maxbits = maxbits;
+}
+
+/*
+ * Add the prefix addr/bits pointing at group g. Returns 1 if the very
+ * same prefix is already claimed by another group, in which case the
+ * first one stays in place and g waits behind it.
+ */
+int
+lpm_insert(struct lpm_tree *t, const void *addr, int bits, struct group *g)
+{
+	struct lpm_node	**pp, *n, *leaf, *glue, **dp;
+	uint8_t		  key[LPM_MAXADDRLEN];
+	int		  c;
+
+	if (bits < 0 || bits > t->maxbits)
+		return (-1);
+	lpm_mask(key, addr, bits, t->maxbits);
+
+	pp = &t->root;
+	while ((n = *pp) != NULL) {
+		c = lpm_common(n->addr, key, n->bits < bits ? n->bits : bits);
+		if (c < n->bits)
+			break;
+		if (n->bits == bits) {
+			if (n->group == NULL) {
+				n->group = g;
+				t->count++;
+				return (0);
+			}
+			if (n->group == g)
+				return (0);
+			for (dp = &n->dup; *dp != NULL; dp = &(*dp)->dup)
+				if ((*dp)->group == g)
+					return (1);
+			*dp = lpm_node_get(t, key, bits, g);
+			return (1);
+		}
+		pp = &n->child[LPM_BIT(key, n->bits)];
+	}
+
+	leaf = lpm_node_get(t, key, bits, g);
+	t->count++;
+	if (n == NULL) {
+		*pp = leaf;
+		return (0);
+	}
+
+	if (c == bits) {
+		/* The new prefix covers n. */
+		leaf->child[LPM_BIT(n->addr, bits)] = n;
+		*pp = leaf;
+	} else {
+		/* Both diverge at bit c, join them with a glue node. */
+		glue = lpm_node_get(t, key, c, NULL);
+		lpm_mask(glue->addr, key, c, t->maxbits);
+		glue->child[LPM_BIT(key, c)] = leaf;
+		glue->child[LPM_BIT(n->addr, c)] = n;
+		*pp = glue;
+	}
+	return (0);
+}
+
+/*
+ * Remove group g from the prefix addr/bits. The prefix stays if other
+ * groups claim it as well.
+ */
+void
+lpm_remove(struct lpm_tree *t, const void *addr, int bits, struct group *g)
+{
+	struct lpm_node	**pp, **ppp = NULL, *n, *parent = NULL, *child;
+	struct lpm_node	**dp, *d;
+	uint8_t		  key[LPM_MAXADDRLEN];
+
+	if (bits < 0 || bits > t->maxbits)
+		return;
+	lpm_mask(key, addr, bits, t->maxbits);
+
+	pp = &t->root;
+	while ((n = *pp) != NULL) {
+		if (n->bits > bits || lpm_common(n->addr, key, n->bits) <
+		    n->bits)
+			return;
+		if (n->bits == bits)
+			break;
+		ppp = pp;
+		parent = n;
+		pp = &n->child[LPM_BIT(key, n->bits)];
+	}
+	if (n == NULL || n->group == NULL)
+		return;
+
+	if (n->group != g) {
+		for (dp = &n->dup; (d = *dp) != NULL; dp = &d->dup) {
+			if (d->group == g) {
+				*dp = d->dup;
+				lpm_node_put(t, d);
+				break;
+			}
+		}
+		return;
+	}
+	if ((d = n->dup) != NULL) {
+		n->group = d->group;
+		n->dup = d->dup;
+		lpm_node_put(t, d);
+		return;
+	}
+
+	n->group = NULL;
+	t->count--;
+	if (n->child[0] != NULL && n->child[1] != NULL)
+		return;		/* Still needed as glue. */
+
+	child = n->child[0] != NULL ? n->child[0] : n->child[1];
+	*pp = child;
+	lpm_node_put(t, n);
+
+	/* A glue node left with a single child is not needed anymore. */
+	if (child == NULL && parent != NULL && parent->group == NULL) {
+		*ppp = parent->child[0] != NULL ? parent->child[0] :
+		    parent->child[1];
+		lpm_node_put(t, parent);
+	}
+}
+
+/*
+ * Return the group with the most specific prefix covering addr or NULL.
+ */
+struct group *
+lpm_match(struct lpm_tree *t, const void *addr)
+{
+	const uint8_t	*a = addr;
+	struct lpm_node	*n, *best = NULL;
+
+	n = t->root;
+	while (n != NULL) {
+		if (lpm_common(n->addr, a, n->bits) < n->bits)
+			break;
+		if (n->group != NULL)
+			best = n;
+		if (n->bits == t->maxbits)
+			break;
+		n = n->child[LPM_BIT(a, n->bits)];
+	}
+
+	return (best ? best->group : NULL);
+}
+
+static struct lpm_node *
+lpm_node_get(struct lpm_tree *t, const uint8_t *key, int bits,
+    struct group *g)
+{
+	struct lpm_chunk	*c;
+	struct lpm_node		*n;
+	int			 i;
+
+	if (t->freelist == NULL) {
+		if ((c = malloc(sizeof(*c))) == NULL)
+			fatal(NULL);
+		c->next = t->chunks;
+		t->chunks = c;
+		for (i = LPM_CHUNKSIZE - 1; i >= 0; i--) {
+			c->nodes[i].child[0] = t->freelist;
+			t->freelist = &c->nodes[i];
+		}
+	}
+	n = t->freelist;
+	t->freelist = n->child[0];
+
+	memset(n, 0, sizeof(*n));
+	memcpy(n->addr, key, sizeof(n->addr));
+	n->bits = bits;
+	n->group = g;
+
+	return (n);
+}
+
+static void
+lpm_node_put(struct lpm_tree *t, struct lpm_node *n)
+{
+	n->child[0] = t->freelist;
+	t->freelist = n;
+}
+
+/*
+ * Number of leading bits, at most len, that a and b have in common.
+ */
+static int
+lpm_common(const uint8_t *a, const uint8_t *b, int len)
+{
+	int	i, bit;
+	uint8_t	x;
+
+	for (i = 0; i < len; i += 8) {
+		if ((x = a[i >> 3] ^ b[i >> 3]) == 0)
+			continue;
+		for (bit = i; (x & 0x80) == 0; bit++)
+			x <<= 1;
+		return (bit < len ? bit : len);
+	}
+	return (len);
+}
+
+static void
+lpm_mask(uint8_t *dst, const void *src, int bits, int maxbits)
+{
+	int	bytes = bits / 8;
+
+	memset(dst, 0, LPM_MAXADDRLEN);
+	memcpy(dst, src, maxbits / 8);
+	if (bits % 8)
+		dst[bytes++] &= 0xff << (8 - bits % 8);
+	if (bytes < LPM_MAXADDRLEN)
+		memset(dst + bytes, 0, LPM_MAXADDRLEN - bytes);
+}
@@ -0,0 +1,45 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define LPM_MAXADDRLEN	16	/* bytes */
+
+struct lpm_node {
+	struct lpm_node		*child[2];
+	struct lpm_node		*dup;	/* more groups with the prefix */
+	struct group		*group;	/* NULL for glue nodes */
+	int			 bits;
+	uint8_t			 addr[LPM_MAXADDRLEN];
+};
+
+struct lpm_chunk;
+
+struct lpm_tree {
+	struct lpm_node		*root;
+	struct lpm_node		*freelist;
+	struct lpm_chunk	*chunks;
+	size_t			 count;		/* number of prefixes */
+	int			 maxbits;
+};
+
+void		 lpm_init(struct lpm_tree *, int);
+void		 lpm_clear(struct lpm_tree *);
+int		 lpm_insert(struct lpm_tree *, const void *, int,
+		     struct group *);
+void		 lpm_remove(struct lpm_tree *, const void *, int,
+		     struct group *);
+struct group	*lpm_match(struct lpm_tree *, const void *);
@@ -0,0 +1,519 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Time the steps of a reload in one process, without forking children or
+ * dropping privileges: lexing and parsing a generated config, allocating
+ * its groups, main sending it, an engine and a frontend rebuilding their
+ * configs from what was sent, and main merging it. The engine also looks
+ * up one address of each group in its prefix index, as a batch lookup
+ * does.
+ *
+ * The children are driven by calling their dispatch functions for the
+ * pipe main writes to, just as the event loop would. Each round sends a
+ * new generation of the same config, so only the first round starts from
+ * empty configs. A round ends with a reload of an unchanged config, which
+ * only sends the children a delta.
+ *
+ * Last, a delta that removes one of two groups with the same prefix, in
+ * the middle of an index build, is checked to leave the other one
+ * indexed.
+ */
+
+#include <arpa/inet.h>
+
+#include <limits.h>
+
+/*
+ * newd.c is compiled into this file so that the static functions main
+ * sends configs with can be called. It brings the headers of newd along,
+ * and its main() is renamed out of the way.
+ */
+int	newd_main(int, char *[]);
+#define main	newd_main
+#include "newd.c"
+#undef main
+
+#include "genconf.h"
+#include "lpm.h"
+
+/* What the engine and frontend are driven through. */
+extern struct newd_conf	*engine_conf, *frontend_conf;
+extern struct imsgev	*iev_main;
+extern struct lpm_tree	 engine_lpm4, engine_lpm6;
+extern struct event	 ev_lpm;
+extern struct group	*lpm_next;
+
+void	engine_dispatch_main(int, short, void *);
+void	engine_lpm_build(int, short, void *);
+
+#define MB_MAXGROUPS	(256 * 256 * 256)
+
+enum mb_phase {
+	MB_LEX,
+	MB_PARSE,
+	MB_ALLOC,
+	MB_FREE,
+	MB_SEND,
+	MB_ENGINE,
+	MB_LPM,
+	MB_LOOKUP,
+	MB_FRONTEND,
+	MB_MERGE,
+	MB_DELTA,
+	MB_DELTA_APPLY,
+	MB_PHASES
+};
+
+const char	*mb_phases[MB_PHASES] = {
+	"lex",			/* lex_config() */
+	"parse",		/* parse_config(), lexing included */
+	"alloc",		/* group_alloc() and group_insert() */
+	"free",			/* config_clear() */
+	"send",			/* main_imsg_send_config() to either child */
+	"engine",		/* engine rebuild from the full config */
+	"lpm",			/* engine prefix index */
+	"lookup",		/* lpm_match() of an address of each group */
+	"frontend",		/* frontend rebuild from the full config */
+	"merge",		/* merge_config() into the running config */
+	"delta",		/* main_imsg_send_delta() of the same config */
+	"delta apply"		/* both children applying that */
+};
+
+__dead void	 mb_usage(void);
+void		 mb_genconf(const char *, int);
+struct imsgev	*mb_imsgev(int, void (*)(int, short, void *), int, int);
+void		 mb_pipe(struct imsgev **, void (*)(int, short, void *),
+		    struct imsgev **, void (*)(int, short, void *), int);
+void		 mb_transfer(struct imsgev *, struct imsgev *);
+void		 mb_lpm_finish(void);
+void		 mb_round(char *, int, int);
+struct newd_conf *mb_shared_conf(char *, const char *);
+void		 mb_check_shared(const char *);
+void		 mb_start(struct timespec *);
+void		 mb_stop(struct timespec *, enum mb_phase, int);
+void		 mb_report(int, int);
+int		 mb_cmp(const void *, const void *);
+
+uint64_t	*mb_usec[MB_PHASES];
+long		 mb_tokens;
+
+/* Both ends of the pipes from main to each child. */
+struct imsgev	*mb_main_engine, *mb_engine;
+struct imsgev	*mb_main_frontend, *mb_frontend;
+
+__dead void
+mb_usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-g groups] [-n rounds]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char	*errstr;
+	char		 dir[] = "/tmp/microbench.XXXXXXXXXX";
+	char		 path[PATH_MAX], sock[PATH_MAX];
+	int		 ch, i, groups = 1000, rounds = 10;
+
+	while ((ch = getopt(argc, argv, "g:n:")) != -1) {
+		switch (ch) {
+		case 'g':
+			groups = strtonum(optarg, 1, MB_MAXGROUPS, &errstr);
+			if (errstr != NULL)
+				errx(1, "groups %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			rounds = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "rounds %s: %s", errstr, optarg);
+			break;
+		default:
+			mb_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 0)
+		mb_usage();
+
+	for (i = 0; i < MB_PHASES; i++)
+		if ((mb_usec[i] = calloc(rounds, sizeof(uint64_t))) == NULL)
+			err(1, NULL);
+
+	if (mkdtemp(dir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(path, sizeof(path), "%s/newd.conf", dir);
+	snprintf(sock, sizeof(sock), "%s/newd.sock", dir);
+	mb_genconf(path, groups);
+
+	log_init(1, LOG_DAEMON);
+	log_setverbose(0);
+	event_init();
+
+	/* Main with one engine and one frontend. */
+	main_conf = config_new_empty();
+	main_nengines = main_nfrontends = 1;
+	mb_pipe(&mb_main_engine, main_dispatch_engine, &mb_engine,
+	    engine_dispatch_main, PROC_ENGINE);
+	mb_pipe(&mb_main_frontend, main_dispatch_frontend, &mb_frontend,
+	    frontend_dispatch_main, PROC_FRONTEND);
+	iev_engines[0] = mb_main_engine;
+	iev_frontends[0] = mb_main_frontend;
+	iev_main = mb_frontend;		/* how a frontend knows main */
+
+	engine_conf = config_new_empty();
+	lpm_init(&engine_lpm4, AF_INET);
+	lpm_init(&engine_lpm6, AF_INET6);
+	evtimer_set(&ev_lpm, engine_lpm_build, NULL);
+
+	frontend_conf = config_new_empty();
+	TAILQ_INIT(&ctl_conns);
+	if (control_init(sock) == -1 || control_listen() == -1)
+		errx(1, "cannot listen on %s", sock);
+
+	for (i = 0; i < rounds; i++)
+		mb_round(path, groups, i);
+	mb_check_shared(dir);
+
+	control_cleanup(sock);
+	unlink(path);
+	rmdir(dir);
+
+	mb_report(groups, rounds);
+
+	return (0);
+}
+
+/*
+ * Write a config of n groups to path, the same newbench -G makes.
+ */
+void
+mb_genconf(const char *path, int n)
+{
+	FILE	*f;
+	int	 fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1 ||
+	    (f = fdopen(fd, "w")) == NULL)
+		err(1, "%s", path);
+	gen_config(f, n);
+	if (fclose(f) == EOF)
+		err(1, "%s", path);
+}
+
+struct imsgev *
+mb_imsgev(int fd, void (*handler)(int, short, void *), int peer, int events)
+{
+	struct imsgev	*iev;
+
+	if ((iev = calloc(1, sizeof(*iev))) == NULL)
+		err(1, NULL);
+	imsg_init(&iev->ibuf, fd);
+	iev->handler = handler;
+	iev->peer = peer;
+	iev->events = events;
+	event_set(&iev->ev, fd, events, handler, iev);
+
+	return (iev);
+}
+
+/*
+ * Make a pipe between main and a child of type peer, with the handlers
+ * each end has in the daemon.
+ */
+void
+mb_pipe(struct imsgev **from, void (*main_handler)(int, short, void *),
+    struct imsgev **to, void (*handler)(int, short, void *), int peer)
+{
+	int	 fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, PF_UNSPEC,
+	    fds) == -1)
+		err(1, "socketpair");
+	*from = mb_imsgev(fds[0], main_handler, peer, EV_READ);
+	*to = mb_imsgev(fds[1], handler, PROC_MAIN, EV_READ);
+}
+
+/*
+ * Write what main has queued on from and have the child handle it, until
+ * the child has seen every imsg sent.
+ */
+void
+mb_transfer(struct imsgev *from, struct imsgev *to)
+{
+	while (to->imsgs_in < from->imsgs_out) {
+		if (from->ibuf.w.queued && msgbuf_write(&from->ibuf.w) == -1 &&
+		    errno != EAGAIN)
+			err(1, "msgbuf_write");
+		to->handler(to->ibuf.fd, EV_READ, to);
+	}
+}
+
+/*
+ * Run the index build of the engine to the end, as its timer would.
+ */
+void
+mb_lpm_finish(void)
+{
+	while (lpm_next != NULL) {
+		evtimer_del(&ev_lpm);
+		engine_lpm_build(-1, EV_TIMEOUT, NULL);
+	}
+}
+
+void
+mb_round(char *path, int groups, int round)
+{
+	struct timespec		 ts;
+	struct newd_conf	*xconf, *conf;
+	struct group		*g;
+	struct in_addr		*addrs;
+	uint64_t		 gen = main_conf->generation + 1;
+	int			 i, hits;
+
+	mb_start(&ts);
+	if ((mb_tokens = lex_config(path)) == -1)
+		errx(1, "%s: lexing failed", path);
+	mb_stop(&ts, MB_LEX, round);
+
+	mb_start(&ts);
+	if ((xconf = parse_config(path)) == NULL)
+		errx(1, "%s: parsing failed", path);
+	mb_stop(&ts, MB_PARSE, round);
+	xconf->generation = gen;
+	main_shard_config(xconf);
+
+	/* The parser's own allocation of the groups. */
+	mb_start(&ts);
+	conf = config_new_empty();
+	for (i = 0; i < groups; i++) {
+		g = group_alloc(conf);
+		snprintf(g->name, sizeof(g->name), "g%d", i);
+		group_insert(conf, g);
+	}
+	mb_stop(&ts, MB_ALLOC, round);
+
+	mb_start(&ts);
+	config_clear(conf);
+	mb_stop(&ts, MB_FREE, round);
+
+	/* A full config, as a child gets at startup. */
+	mb_start(&ts);
+	if (main_imsg_send_config(xconf, mb_main_engine) == -1 ||
+	    main_imsg_send_config(xconf, mb_main_frontend) == -1)
+		errx(1, "main_imsg_send_config failed");
+	mb_stop(&ts, MB_SEND, round);
+
+	mb_start(&ts);
+	mb_transfer(mb_main_engine, mb_engine);
+	mb_stop(&ts, MB_ENGINE, round);
+
+	mb_start(&ts);
+	mb_lpm_finish();
+	mb_stop(&ts, MB_LPM, round);
+
+	/* One batch of addresses to classify, each matching its group. */
+	if ((addrs = calloc(groups, sizeof(*addrs))) == NULL)
+		err(1, NULL);
+	i = 0;
+	LIST_FOREACH(g, &engine_conf->group_list, entry)
+		addrs[i++] = g->group_v4address;
+	mb_start(&ts);
+	for (i = hits = 0; i < groups; i++)
+		if (lpm_match(&engine_lpm4, &addrs[i]) != NULL)
+			hits++;
+	mb_stop(&ts, MB_LOOKUP, round);
+	free(addrs);
+	if (hits != groups)
+		errx(1, "round %d: %d of %d lookups matched", round, hits,
+		    groups);
+
+	mb_start(&ts);
+	mb_transfer(mb_main_frontend, mb_frontend);
+	mb_stop(&ts, MB_FRONTEND, round);
+
+	mb_start(&ts);
+	merge_config(main_conf, xconf);
+	mb_stop(&ts, MB_MERGE, round);
+
+	/* A reload of the same config, which only moves the generation. */
+	if ((xconf = parse_config(path)) == NULL)
+		errx(1, "%s: parsing failed", path);
+	xconf->generation = ++gen;
+	main_shard_config(xconf);
+
+	mb_start(&ts);
+	if (main_imsg_send_delta(main_conf, xconf) == -1)
+		errx(1, "main_imsg_send_delta failed");
+	mb_stop(&ts, MB_DELTA, round);
+
+	mb_start(&ts);
+	mb_transfer(mb_main_engine, mb_engine);
+	mb_transfer(mb_main_frontend, mb_frontend);
+	mb_stop(&ts, MB_DELTA_APPLY, round);
+
+	merge_config(main_conf, xconf);
+
+	if (engine_conf->generation != gen ||
+	    frontend_conf->generation != gen ||
+	    engine_conf->group_count != (uint32_t)groups ||
+	    frontend_conf->group_count != (uint32_t)groups ||
+	    main_conf->group_count != (uint32_t)groups)
+		errx(1, "round %d: children did not get the config", round);
+}
+
+/*
+ * Write groups s0 to s7 to path, leaving out gone, where s0 and s1 both
+ * have MB_SHARED. Return them parsed as the next generation.
+ */
+#define MB_SHARED	"192.0.2.0/24"
+
+struct newd_conf *
+mb_shared_conf(char *path, const char *gone)
+{
+	struct newd_conf	*xconf;
+	FILE			*f;
+	char			 name[NEWD_MAXGROUPNAME];
+	int			 fd, i;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1 ||
+	    (f = fdopen(fd, "w")) == NULL)
+		err(1, "%s", path);
+	for (i = 0; i < 8; i++) {
+		snprintf(name, sizeof(name), "s%d", i);
+		if (strcmp(name, gone) == 0)
+			continue;
+		fprintf(f, "group %s {\n", name);
+		if (i < 2)
+			fprintf(f, "\tgroup-v4address %s\n", MB_SHARED);
+		else
+			fprintf(f, "\tgroup-v4address 198.51.100.%d/32\n", i);
+		fprintf(f, "}\n");
+	}
+	if (fclose(f) == EOF)
+		err(1, "%s", path);
+
+	if ((xconf = parse_config(path)) == NULL)
+		errx(1, "%s: parsing failed", path);
+	xconf->generation = main_conf->generation + 1;
+	main_shard_config(xconf);
+
+	return (xconf);
+}
+
+/*
+ * Load the shared groups and find which of s0 and s1 the engine matches.
+ * Load them again, and while the engine rebuilds its index reload without
+ * the one matched, which is a delta. Then the other has to be matched.
+ */
+void
+mb_check_shared(const char *dir)
+{
+	struct newd_conf	*xconf;
+	struct group		*g;
+	struct in_addr		 addr;
+	char			 path[PATH_MAX];
+	char			 gone[NEWD_MAXGROUPNAME] = "";
+	int			 pass;
+
+	snprintf(path, sizeof(path), "%s/shared.conf", dir);
+	if (inet_pton(AF_INET, "192.0.2.1", &addr) != 1)
+		errx(1, "inet_pton");
+
+	for (pass = 0; pass < 2; pass++) {
+		xconf = mb_shared_conf(path, "");
+		if (main_imsg_send_config(xconf, mb_main_engine) == -1 ||
+		    main_imsg_send_config(xconf, mb_main_frontend) == -1)
+			errx(1, "main_imsg_send_config failed");
+		mb_transfer(mb_main_engine, mb_engine);
+		mb_transfer(mb_main_frontend, mb_frontend);
+		merge_config(main_conf, xconf);
+		if (pass > 0)
+			break;
+		mb_lpm_finish();
+		if ((g = lpm_match(&engine_lpm4, &addr)) == NULL ||
+		    (strcmp(g->name, "s0") != 0 && strcmp(g->name, "s1") != 0))
+			errx(1, "config %s matched %s", MB_SHARED,
+			    g != NULL ? g->name : "nothing");
+		strlcpy(gone, g->name, sizeof(gone));
+	}
+
+	xconf = mb_shared_conf(path, gone);
+	if (main_imsg_send_delta(main_conf, xconf) == -1)
+		errx(1, "main_imsg_send_delta failed");
+	mb_transfer(mb_main_engine, mb_engine);
+	mb_transfer(mb_main_frontend, mb_frontend);
+	merge_config(main_conf, xconf);
+	mb_lpm_finish();
+
+	if ((g = lpm_match(&engine_lpm4, &addr)) == NULL ||
+	    strcmp(g->name, gone) == 0 ||
+	    (strcmp(g->name, "s0") != 0 && strcmp(g->name, "s1") != 0))
+		errx(1, "delta %s matched %s", MB_SHARED,
+		    g != NULL ? g->name : "nothing");
+	unlink(path);
+}
+
+void
+mb_start(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+void
+mb_stop(struct timespec *ts, enum mb_phase phase, int round)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, ts, &now);
+	mb_usec[phase][round] = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+int
+mb_cmp(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+void
+mb_report(int groups, int rounds)
+{
+	uint64_t	*u, first;
+	int		 i;
+
+	printf("%d groups, %ld tokens, %d rounds\n", groups, mb_tokens,
+	    rounds);
+	printf("%-12s %10s %10s %10s %10s %10s\n", "phase", "first ms",
+	    "min ms", "median ms", "max ms", "ns/group");
+	for (i = 0; i < MB_PHASES; i++) {
+		u = mb_usec[i];
+		first = u[0];
+		qsort(u, rounds, sizeof(u[0]), mb_cmp);
+		printf("%-12s %10.3f %10.3f %10.3f %10.3f %10.1f\n",
+		    mb_phases[i], first / 1e3, u[0] / 1e3,
+		    u[rounds / 2] / 1e3, u[rounds - 1] / 1e3,
+		    u[rounds / 2] * 1e3 / groups);
+	}
+}
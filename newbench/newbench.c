@@ -0,0 +1,649 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Load generator for the newd control socket.
+ *
+ * Each connection either keeps one request in flight (closed loop), or
+ * requests are sent at a fixed total rate spread over all connections
+ * (open loop). In the open loop a request is timed from when it was due,
+ * not from when it went out, so a daemon that falls behind cannot hide
+ * it. Reloads are answered by nobody, they are timed until a subscription
+ * tells of the new config.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <imsg.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "newd.h"
+#include "genconf.h"
+
+#define BENCH_TICK_MSEC		1	/* open loop send interval */
+#define BENCH_DRAIN_SEC		5	/* wait for replies at the end */
+#define BENCH_INFLIGHT		65536	/* must be a power of 2 */
+#define BENCH_MAXGROUPS		(256 * 256 * 256)
+
+enum bench_kind {
+	KIND_ENGINE,
+	KIND_DUMP,
+	KIND_FRONTEND,
+	KIND_MAIN,
+	KIND_RELOAD,
+	KIND_MAX
+};
+
+const char	*bench_kinds[KIND_MAX] = {
+	"engine", "dump", "frontend", "main", "reload"
+};
+
+struct bench_conn {
+	struct imsgbuf	 ibuf;
+	struct event	 ev;
+	short		 events;
+	int		 inflight;
+	int		 subscriber;	/* tells us when reloads are done */
+};
+
+/* A request in flight, by peerid. */
+struct bench_req {
+	struct bench_conn	*conn;
+	struct timespec		 start;
+	int			 kind;
+};
+
+struct bench_stats {
+	uint32_t	*usec;		/* latency of each completed request */
+	size_t		 count;
+	size_t		 size;
+	uint64_t	 bytes;
+};
+
+__dead void	 usage(void);
+void		 bench_mix(const char *);
+void		 bench_genconf(const char *);
+struct bench_conn *bench_connect(const char *, int);
+void		 bench_event_add(struct bench_conn *);
+void		 bench_dispatch(int, short, void *);
+void		 bench_send(struct bench_conn *, struct timespec *);
+void		 bench_done(struct bench_req *);
+void		 bench_tick(int, short, void *);
+void		 bench_stop(int, short, void *);
+void		 bench_record(struct bench_stats *, uint32_t);
+void		 bench_report(double);
+int		 bench_cmp(const void *, const void *);
+uint32_t	 bench_usec(struct timespec *);
+
+struct bench_conn	**bench_conns;
+int			 bench_nconns;
+struct bench_conn	*bench_sub;
+struct bench_req	 bench_reqs[BENCH_INFLIGHT];
+struct bench_stats	 bench_stats[KIND_MAX];
+struct bench_stats	 bench_lag;	/* how late the open loop sends */
+uint32_t		 bench_peerid;
+int			 bench_mixsum[KIND_MAX];	/* cumulative weights */
+int			 bench_groups = 1000;
+int			 bench_packed;
+uint64_t		 bench_rate;		/* 0 is closed loop */
+uint64_t		 bench_sent;
+uint64_t		 bench_errors;
+uint64_t		 bench_skipped;
+int			 bench_running = 1;
+int			 bench_next;		/* round robin over conns */
+struct timespec		 bench_t0, bench_t1;	/* sending started, ended */
+struct event		 bench_tick_ev;
+struct event		 bench_stop_ev;
+
+/* The one reload in flight, RELOAD gets no reply of its own. */
+struct bench_req	 bench_reload;
+uint64_t		 bench_generation;
+
+__dead void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-p] [-c connections] [-g groups] "
+	    "[-m mix] [-r rate]\n\t[-s socket] [-t seconds]\n", __progname);
+	fprintf(stderr, "       %s -G groups\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timeval	 tv;
+	struct timespec	 now;
+	const char	*errstr, *mix = "engine=90,frontend=5,main=5";
+	char		*sockname = NEWD_SOCKET;
+	int		 ch, i, seconds = 10;
+
+	while ((ch = getopt(argc, argv, "c:G:g:m:pr:s:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			bench_nconns = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "connections %s: %s", errstr, optarg);
+			break;
+		case 'G':
+			bench_genconf(optarg);
+			exit(0);
+		case 'g':
+			bench_groups = strtonum(optarg, 1, BENCH_MAXGROUPS,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "groups %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			mix = optarg;
+			break;
+		case 'p':
+			bench_packed = 1;
+			break;
+		case 'r':
+			bench_rate = strtonum(optarg, 1, 10000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "rate %s: %s", errstr, optarg);
+			break;
+		case 's':
+			sockname = optarg;
+			break;
+		case 't':
+			seconds = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(1, "seconds %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 0)
+		usage();
+	if (bench_nconns == 0)
+		bench_nconns = 16;
+	bench_mix(mix);
+
+	if (pledge("stdio unix", NULL) == -1)
+		err(1, "pledge");
+
+	event_init();
+
+	if ((bench_conns = calloc(bench_nconns, sizeof(*bench_conns))) ==
+	    NULL)
+		err(1, NULL);
+	for (i = 0; i < bench_nconns; i++)
+		bench_conns[i] = bench_connect(sockname, 0);
+	if (bench_mixsum[KIND_RELOAD] != bench_mixsum[KIND_MAIN])
+		bench_sub = bench_connect(sockname, 1);
+
+	if (pledge("stdio", NULL) == -1)
+		err(1, "pledge");
+
+	clock_gettime(CLOCK_MONOTONIC, &bench_t0);
+	if (bench_rate == 0) {
+		for (i = 0; i < bench_nconns; i++)
+			bench_send(bench_conns[i], NULL);
+	} else {
+		evtimer_set(&bench_tick_ev, bench_tick, NULL);
+		bench_tick(0, 0, NULL);
+	}
+
+	evtimer_set(&bench_stop_ev, bench_stop, NULL);
+	timerclear(&tv);
+	tv.tv_sec = seconds;
+	evtimer_add(&bench_stop_ev, &tv);
+
+	event_dispatch();
+
+	if (bench_running)
+		errx(1, "no events left to wait for");
+	timespecsub(&bench_t1, &bench_t0, &now);
+	bench_report(now.tv_sec + now.tv_nsec / 1e9);
+
+	return (0);
+}
+
+/*
+ * Parse a mix like "engine=90,reload=1" into cumulative weights.
+ */
+void
+bench_mix(const char *mix)
+{
+	const char	*errstr;
+	char		*s, *p, *w, *v;
+	int		 i, weight[KIND_MAX], sum = 0;
+
+	memset(weight, 0, sizeof(weight));
+	if ((s = strdup(mix)) == NULL)
+		err(1, NULL);
+	for (p = s; (w = strsep(&p, ",")) != NULL; ) {
+		if ((v = strchr(w, '=')) == NULL)
+			errx(1, "mix %s: expected kind=weight", w);
+		*v++ = '\0';
+		for (i = 0; i < KIND_MAX; i++) {
+			if (strcmp(w, bench_kinds[i]) == 0)
+				break;
+		}
+		if (i == KIND_MAX)
+			errx(1, "mix: unknown kind %s", w);
+		weight[i] = strtonum(v, 0, 1000000, &errstr);
+		if (errstr != NULL)
+			errx(1, "mix %s weight %s: %s", w, errstr, v);
+	}
+	free(s);
+
+	for (i = 0; i < KIND_MAX; i++) {
+		sum += weight[i];
+		bench_mixsum[i] = sum;
+	}
+	if (sum == 0)
+		errx(1, "mix: all weights are 0");
+	if (weight[KIND_RELOAD] == sum)
+		errx(1, "mix: reloads need other requests too");
+}
+
+/*
+ * Print a config of the number of groups in arg.
+ */
+void
+bench_genconf(const char *arg)
+{
+	const char	*errstr;
+	uint32_t	 n;
+
+	n = strtonum(arg, 1, BENCH_MAXGROUPS, &errstr);
+	if (errstr != NULL)
+		errx(1, "groups %s: %s", errstr, arg);
+
+	gen_config(stdout, n);
+	if (fflush(stdout) == EOF)
+		err(1, "stdout");
+}
+
+struct bench_conn *
+bench_connect(const char *sockname, int subscriber)
+{
+	struct sockaddr_un	 sun;
+	struct bench_conn	*c;
+	uint32_t		 opts;
+	int			 fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		err(1, "socket");
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, sockname, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "socket name too long");
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "connect: %s", sockname);
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(1, NULL);
+	imsg_init(&c->ibuf, fd);
+	c->subscriber = subscriber;
+	event_set(&c->ev, fd, EV_READ, bench_dispatch, c);
+
+	if (subscriber) {
+		opts = CTL_SUB_RECONF;
+		imsg_compose(&c->ibuf, IMSG_CTL_SUBSCRIBE, 0, 0, -1, &opts,
+		    sizeof(opts));
+	} else if (bench_packed) {
+		opts = CTL_OPT_PACKED;
+		imsg_compose(&c->ibuf, IMSG_CTL_SET_OPTS, 0, 0, -1, &opts,
+		    sizeof(opts));
+	}
+	bench_event_add(c);
+
+	return (c);
+}
+
+void
+bench_event_add(struct bench_conn *c)
+{
+	c->events = EV_READ;
+	if (c->ibuf.w.queued)
+		c->events |= EV_WRITE;
+
+	event_del(&c->ev);
+	event_set(&c->ev, c->ibuf.fd, c->events, bench_dispatch, c);
+	event_add(&c->ev, NULL);
+}
+
+void
+bench_dispatch(int fd, short event, void *arg)
+{
+	struct bench_conn	*c = arg;
+	struct bench_req	*r;
+	struct imsg		 imsg;
+	struct ctl_notify	 cn;
+	ssize_t			 n;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(&c->ibuf)) == -1 && errno != EAGAIN)
+			err(1, "imsg_read");
+		if (n == 0)
+			errx(1, "connection closed by newd");
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&c->ibuf.w)) == -1 && errno != EAGAIN)
+			err(1, "msgbuf_write");
+		if (n == 0)
+			errx(1, "connection closed by newd");
+	}
+
+	for (;;) {
+		if ((n = imsg_get(&c->ibuf, &imsg)) == -1)
+			err(1, "imsg_get");
+		if (n == 0)
+			break;
+
+		if (c->subscriber) {
+			if (imsg.hdr.type == IMSG_CTL_NOTIFY &&
+			    imsg.hdr.len == IMSG_HEADER_SIZE + sizeof(cn)) {
+				memcpy(&cn, imsg.data, sizeof(cn));
+				if (cn.generation > bench_generation &&
+				    bench_reload.conn != NULL)
+					bench_done(&bench_reload);
+				bench_generation = cn.generation;
+			}
+			imsg_free(&imsg);
+			continue;
+		}
+
+		r = &bench_reqs[imsg.hdr.peerid & (BENCH_INFLIGHT - 1)];
+		if (r->conn != c) {
+			/* Not ours, the SET_OPTS reply for one. */
+			imsg_free(&imsg);
+			continue;
+		}
+		bench_stats[r->kind].bytes += imsg.hdr.len;
+		if (imsg.hdr.type == IMSG_CTL_END)
+			bench_done(r);
+		imsg_free(&imsg);
+	}
+
+	bench_event_add(c);
+}
+
+/*
+ * Send the next request of the mix on c. An open loop passes when the
+ * request was due.
+ */
+void
+bench_send(struct bench_conn *c, struct timespec *due)
+{
+	struct bench_req	*r;
+	char			 filter[NEWD_MAXGROUPNAME];
+	int			 kind, w;
+
+	w = arc4random_uniform(bench_mixsum[KIND_MAX - 1]);
+	for (kind = 0; w >= bench_mixsum[kind]; kind++)
+		;
+	/* One reload at a time, until it is known to be done. */
+	if (kind == KIND_RELOAD && bench_reload.conn != NULL) {
+		bench_skipped++;
+		do {
+			w = arc4random_uniform(bench_mixsum[KIND_MAX - 1]);
+			for (kind = 0; w >= bench_mixsum[kind]; kind++)
+				;
+		} while (kind == KIND_RELOAD);
+	}
+
+	if (kind == KIND_RELOAD) {
+		r = &bench_reload;
+	} else {
+		do {
+			bench_peerid++;
+		} while (bench_peerid == 0);
+		r = &bench_reqs[bench_peerid & (BENCH_INFLIGHT - 1)];
+		if (r->conn != NULL) {
+			/* Too far behind to keep track. */
+			bench_errors++;
+			return;
+		}
+	}
+	r->conn = c;
+	r->kind = kind;
+	if (due != NULL)
+		r->start = *due;
+	else
+		clock_gettime(CLOCK_MONOTONIC, &r->start);
+
+	memset(filter, 0, sizeof(filter));
+	switch (kind) {
+	case KIND_ENGINE:
+		snprintf(filter, sizeof(filter), "g%u",
+		    arc4random_uniform(bench_groups));
+		/* FALLTHROUGH */
+	case KIND_DUMP:
+		imsg_compose(&c->ibuf, IMSG_CTL_SHOW_ENGINE_INFO,
+		    bench_peerid, 0, -1, filter, sizeof(filter));
+		break;
+	case KIND_FRONTEND:
+		imsg_compose(&c->ibuf, IMSG_CTL_SHOW_FRONTEND_INFO,
+		    bench_peerid, 0, -1, NULL, 0);
+		break;
+	case KIND_MAIN:
+		imsg_compose(&c->ibuf, IMSG_CTL_SHOW_MAIN_INFO,
+		    bench_peerid, 0, -1, NULL, 0);
+		break;
+	case KIND_RELOAD:
+		imsg_compose(&c->ibuf, IMSG_CTL_RELOAD, 0, 0, -1, NULL, 0);
+		break;
+	}
+	bench_sent++;
+	bench_event_add(c);
+
+	/* The closed loop sends once the reply is in, there is none. */
+	if (kind == KIND_RELOAD && bench_rate == 0)
+		bench_send(c, NULL);
+	else if (kind != KIND_RELOAD)
+		c->inflight++;
+}
+
+void
+bench_done(struct bench_req *r)
+{
+	struct bench_conn	*c = r->conn;
+
+	bench_record(&bench_stats[r->kind], bench_usec(&r->start));
+	r->conn = NULL;
+	if (r != &bench_reload) {
+		c->inflight--;
+		if (bench_running && bench_rate == 0)
+			bench_send(c, NULL);
+	}
+
+	/* Done once all replies are in. */
+	if (bench_running || bench_reload.conn != NULL)
+		return;
+	for (r = bench_reqs; r < bench_reqs + BENCH_INFLIGHT; r++)
+		if (r->conn != NULL)
+			return;
+	event_loopexit(NULL);
+}
+
+/*
+ * Send whatever became due since the last tick of the open loop.
+ */
+void
+bench_tick(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+	struct timespec	 now, due;
+	uint64_t	 nsec, target;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &bench_t0, &due);
+	target = (due.tv_sec * 1000000000ULL + due.tv_nsec) * bench_rate /
+	    1000000000ULL;
+
+	while (bench_running && bench_sent + bench_errors < target) {
+		nsec = (bench_sent + bench_errors) * 1000000000ULL /
+		    bench_rate;
+		due.tv_sec = bench_t0.tv_sec + nsec / 1000000000ULL;
+		due.tv_nsec = bench_t0.tv_nsec + nsec % 1000000000ULL;
+		if (due.tv_nsec >= 1000000000L) {
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000L;
+		}
+		bench_record(&bench_lag, bench_usec(&due));
+		bench_send(bench_conns[bench_next], &due);
+		bench_next = (bench_next + 1) % bench_nconns;
+	}
+
+	timerclear(&tv);
+	tv.tv_usec = BENCH_TICK_MSEC * 1000;
+	if (bench_running)
+		evtimer_add(&bench_tick_ev, &tv);
+}
+
+/*
+ * Stop sending and give the replies still to come some time.
+ */
+void
+bench_stop(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+
+	if (!bench_running) {
+		event_loopexit(NULL);
+		return;
+	}
+	bench_running = 0;
+	clock_gettime(CLOCK_MONOTONIC, &bench_t1);
+	if (bench_rate != 0)
+		evtimer_del(&bench_tick_ev);
+
+	timerclear(&tv);
+	tv.tv_sec = BENCH_DRAIN_SEC;
+	evtimer_add(&bench_stop_ev, &tv);
+}
+
+void
+bench_record(struct bench_stats *st, uint32_t usec)
+{
+	uint32_t	*p;
+	size_t		 size;
+
+	if (st->count == st->size) {
+		size = st->size == 0 ? 1024 : st->size * 2;
+		if ((p = reallocarray(st->usec, size, sizeof(*p))) == NULL)
+			err(1, NULL);
+		st->usec = p;
+		st->size = size;
+	}
+	st->usec[st->count++] = usec;
+}
+
+int
+bench_cmp(const void *a, const void *b)
+{
+	uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+#define PCT(st, p)	((st)->usec[(size_t)(((st)->count - 1) * (p))] / 1e3)
+
+void
+bench_report(double seconds)
+{
+	struct bench_stats	*st, all;
+	struct bench_req	*r;
+	size_t			 lost = 0;
+	int			 i;
+
+	for (r = bench_reqs; r < bench_reqs + BENCH_INFLIGHT; r++)
+		if (r->conn != NULL)
+			lost++;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < KIND_MAX; i++)
+		all.size += bench_stats[i].count;
+	if (all.size > 0 &&
+	    (all.usec = reallocarray(NULL, all.size, sizeof(uint32_t))) ==
+	    NULL)
+		err(1, NULL);
+	for (i = 0; i < KIND_MAX; i++) {
+		st = &bench_stats[i];
+		memcpy(all.usec + all.count, st->usec,
+		    st->count * sizeof(st->usec[0]));
+		all.count += st->count;
+		all.bytes += st->bytes;
+	}
+
+	printf("%-9s %9s %10s %9s %9s %9s %9s %9s\n", "kind", "count",
+	    "per sec", "MB", "p50 ms", "p99 ms", "p999 ms", "max ms");
+	for (i = 0; i <= KIND_MAX; i++) {
+		st = i < KIND_MAX ? &bench_stats[i] : &all;
+		if (st->count == 0)
+			continue;
+		qsort(st->usec, st->count, sizeof(st->usec[0]), bench_cmp);
+		printf("%-9s %9zu %10.1f %9.1f %9.3f %9.3f %9.3f %9.3f\n",
+		    i < KIND_MAX ? bench_kinds[i] : "total", st->count,
+		    st->count / seconds, st->bytes / 1e6, PCT(st, 0.5),
+		    PCT(st, 0.99), PCT(st, 0.999), PCT(st, 1.0));
+	}
+	if (bench_lag.count > 0) {
+		st = &bench_lag;
+		qsort(st->usec, st->count, sizeof(st->usec[0]), bench_cmp);
+		printf("%-9s %9zu %10s %9s %9.3f %9.3f %9.3f %9.3f\n",
+		    "send lag", st->count, "", "", PCT(st, 0.5),
+		    PCT(st, 0.99), PCT(st, 0.999), PCT(st, 1.0));
+	}
+	printf("%d connections, %.1f seconds, %llu sent, %zu unanswered, "
+	    "%llu not sent, %llu reloads skipped\n", bench_nconns, seconds,
+	    (unsigned long long)bench_sent, lost,
+	    (unsigned long long)bench_errors,
+	    (unsigned long long)bench_skipped);
+}
+
+uint32_t
+bench_usec(struct timespec *start)
+{
+	struct timespec	now;
+	uint64_t	usec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, start, &now);
+	usec = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+
+	return (usec > UINT32_MAX ? UINT32_MAX : usec);
+}
@@ -21,6 +21,7 @@
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/syslog.h>
+#include <sys/time.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
 
@@ -29,12 +30,16 @@
 #include <err.h>
 #include <errno.h>
 #include <event.h>
+#include <fcntl.h>
 #include <imsg.h>
+#include <paths.h>
 #include <pwd.h>
+#include <siphash.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -48,28 +53,99 @@ __dead void	main_shutdown(void);
 
 void	main_sig_handler(int, short, void *);
 
-static pid_t	start_child(int, char *, int, int, int, char *);
+static pid_t	start_child(int, char *, int, int, int, int);
+static int	main_start_engine(int, char *, int);
+static void	main_engine_imsgev(int, int);
+static int	main_start_frontend(int, char *, int);
+static void	main_frontend_imsgev(int, int);
+static void	main_link_children(void);
+static const char *main_child_name(pid_t);
+static int	main_daemonize(void);
+static void	main_startup_child(struct imsgev *);
+static uint64_t	main_startup_since(void);
+static void	main_reload_request(void);
 
 void	main_dispatch_frontend(int, short, void *);
 void	main_dispatch_engine(int, short, void *);
 
-static int	main_imsg_send_ipc_sockets(struct imsgbuf *, struct imsgbuf *);
-static int	main_imsg_send_config(struct newd_conf *);
+static int	main_imsg_send_ipc_sockets(int, int);
+static int	main_imsg_send_config(struct newd_conf *, struct imsgev *);
+static int	main_imsg_send_imsgs(struct newd_conf *, struct imsgev *);
+static int	main_imsg_send_groups(struct newd_conf *, struct imsgev *);
+static int	main_imsg_send_snapshot(struct newd_conf *, struct imsgev *);
+static void	main_snapshot_failed(struct imsgev *);
+static int	main_imsg_send_delta(struct newd_conf *, struct newd_conf *);
+static void	main_shard_config(struct newd_conf *);
 
-int	main_reload(void);
-int	main_sendboth(enum imsg_type, void *, uint16_t);
-void	main_showinfo_ctl(struct imsg *);
+static void	main_showstats_ctl(struct imsgev *, struct imsg *);
+static void	main_showlatency_ctl(struct imsgev *, struct imsg *);
+
+static void	group_hash_grow(struct newd_conf *);
+
+static void	imsg_flush_later(struct imsgev *);
+static void	imsg_flush_run(int, short, void *);
+
+int	main_sendall(enum imsg_type, void *, uint16_t);
+static int	main_sendto(struct imsgev *, enum imsg_type, void *, uint16_t);
+static int	main_send_fd(struct imsgev *, enum imsg_type, int);
+static int	main_sendgroup(struct imsgev *, enum imsg_type, struct group *,
+		    void *, uint16_t);
+void	main_showinfo_ctl(struct imsgev *, struct imsg *);
 
 struct newd_conf	*main_conf;
-struct imsgev		*iev_frontend;
-struct imsgev		*iev_engine;
+struct imsgev		*iev_frontends[NEWD_MAXFRONTENDS];
+struct imsgev		*iev_engines[NEWD_MAXENGINES];
+int			 main_nfrontends;	/* fixed at startup */
+int			 main_nengines;		/* fixed at startup */
 char			*conffile;
+char			*cachefile;	/* compiled config, or NULL */
 char			*csock;
 
-pid_t	 frontend_pid;
-pid_t	 engine_pid;
+pid_t	 frontend_pids[NEWD_MAXFRONTENDS];
+pid_t	 engine_pids[NEWD_MAXENGINES];
 
 uint32_t cmd_opts;
+int	 newd_instance;
+
+struct {
+	uint64_t	reloads;
+	uint64_t	reload_failures;
+	uint64_t	reload_usec_last;
+	uint64_t	reload_usec_total;
+} main_stats;
+
+/*
+ * Startup phases, in microseconds since main() was entered. The children
+ * are started before the config is parsed, and each gets the config as
+ * soon as it reports IMSG_STARTUP.
+ */
+struct {
+	struct timespec	start;
+	uint64_t	children_usec;	/* first engine and frontend forked */
+	uint64_t	parse_usec;	/* config loaded */
+	uint64_t	engine_usec;	/* last engine ready, config sent */
+	uint64_t	frontend_usec;	/* last frontend ready, config sent */
+	uint64_t	ready_usec;	/* all children configured */
+	int		pending;	/* children not yet configured */
+	int		reload;		/* reload requested meanwhile */
+	int		ready_fd;	/* to the foreground process, or -1 */
+} main_startup = { .ready_fd = -1 };
+
+/* imsgevs with imsgs queued since the last flush. */
+TAILQ_HEAD(, imsgev)	 imsg_flushq = TAILQ_HEAD_INITIALIZER(imsg_flushq);
+struct event		 imsg_flush_ev;
+int			 imsg_flush_set;
+
+static SIPHASH_KEY	group_hashkey;
+static int		group_hashkey_set;
+
+#define MAXIMUM(a, b)	(((a) > (b)) ? (a) : (b))
+
+#define GROUP_HASH_MIN	64
+#define GROUP_SLAB_MIN	64
+#define GROUP_HASH(c, n)	\
+	(&(c)->group_hash[SipHash24(&group_hashkey, (n), strlen(n)) & \
+	    (c)->group_hashmask])
 
 void
 main_sig_handler(int sig, short event, void *arg)
@@ -84,10 +160,7 @@ main_sig_handler(int sig, short event, void *arg)
 	case SIGINT:
 		main_shutdown();
 	case SIGHUP:
-		if (main_reload() == -1)
-			log_warnx("configuration reload failed");
-		else
-			log_debug("configuration reloaded");
+		main_reload_request();
 		break;
 	default:
 		fatalx("unexpected signal");
@@ -99,8 +172,8 @@ usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-dnv] [-f file] [-s socket]\n",
-	    __progname);
+	fprintf(stderr, "usage: %s [-dnSv] [-C cache] [-f file] [-P cache] "
+	    "[-s socket]\n", __progname);
 	exit(1);
 }
 
@@ -110,9 +183,11 @@ main(int argc, char *argv[])
 	struct event	 ev_sigint, ev_sigterm, ev_sighup;
 	int		 ch;
 	int		 debug = 0, engine_flag = 0, frontend_flag = 0;
-	char		*saved_argv0;
-	int		 pipe_main2frontend[2];
-	int		 pipe_main2engine[2];
+	int		 fresh;
+	char		*saved_argv0, *printcache = NULL;
+	int		 engine_fd, frontend_fd, i;
+
+	clock_gettime(CLOCK_MONOTONIC, &main_startup.start);
 
 	conffile = CONF_FILE;
 	csock = NEWD_SOCKET;
@@ -124,8 +199,11 @@ main(int argc, char *argv[])
 	if (saved_argv0 == NULL)
 		saved_argv0 = "newd";
 
-	while ((ch = getopt(argc, argv, "dEFf:ns:v")) != -1) {
+	while ((ch = getopt(argc, argv, "C:dEFf:nP:Ss:v")) != -1) {
 		switch (ch) {
+		case 'C':
+			cachefile = optarg;
+			break;
 		case 'd':
 			debug = 1;
 			break;
@@ -141,6 +219,12 @@ main(int argc, char *argv[])
 		case 'n':
 			cmd_opts |= OPT_NOACTION;
 			break;
+		case 'P':
+			printcache = optarg;
+			break;
+		case 'S':
+			cmd_opts |= OPT_SHMCONF;
+			break;
 		case 's':
 			csock = optarg;
 			break;
@@ -162,14 +246,34 @@ main(int argc, char *argv[])
 	if (engine_flag)
 		engine(debug, cmd_opts & OPT_VERBOSE);
 	else if (frontend_flag)
-		frontend(debug, cmd_opts & OPT_VERBOSE, csock);
-
-	/* parse config file */
-	if ((main_conf = parse_config(conffile)) == NULL) {
-		exit(1);
+		frontend(debug, cmd_opts & OPT_VERBOSE);
+
+	/* Show a compiled config as it is, without parsing anything. */
+	if (printcache != NULL) {
+		if ((main_conf = config_cache_read(printcache, conffile,
+		    &fresh)) == NULL)
+			errx(1, "%s: no valid compiled config", printcache);
+		print_config(main_conf);
+		if (!fresh)
+			warnx("%s: not up to date with %s", printcache,
+			    conffile);
+		exit(0);
 	}
 
 	if (cmd_opts & OPT_NOACTION) {
+		if ((main_conf = parse_config(conffile)) == NULL)
+			exit(1);
+		if (cachefile != NULL) {
+			if (config_cache_write(main_conf, &parse_sources,
+			    cachefile) == -1)
+				exit(1);
+			/* Show what the daemon will load. */
+			config_clear(main_conf);
+			if ((main_conf = config_cache_load(cachefile,
+			    conffile)) == NULL)
+				errx(1, "%s: cannot load compiled config",
+				    cachefile);
+		}
 		if (cmd_opts & OPT_VERBOSE)
 			print_config(main_conf);
 		else
@@ -185,31 +289,27 @@ main(int argc, char *argv[])
 	if (getpwnam(NEWD_USER) == NULL)
 		errx(1, "unknown user %s", NEWD_USER);
 
-	log_init(debug, LOG_DAEMON);
-	log_setverbose(cmd_opts & OPT_VERBOSE);
-
+	/*
+	 * Keep logging to stderr until the config is parsed, so that the
+	 * foreground process can still be told why startup failed.
+	 */
 	if (!debug)
-		daemon(1, 0);
-
-	log_info("startup");
-
-	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
-	    PF_UNSPEC, pipe_main2frontend) == -1)
-		fatal("main2frontend socketpair");
-	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
-	    PF_UNSPEC, pipe_main2engine) == -1)
-		fatal("main2engine socketpair");
+		main_startup.ready_fd = main_daemonize();
 
-	/* Start children. */
-	engine_pid = start_child(PROC_ENGINE, saved_argv0, pipe_main2engine[1],
-	    debug, cmd_opts & OPT_VERBOSE, NULL);
-	frontend_pid = start_child(PROC_FRONTEND, saved_argv0,
-	    pipe_main2frontend[1], debug, cmd_opts & OPT_VERBOSE, csock);
+	/* Every frontend accepts on the same control socket. */
+	if (control_init(csock) == -1)
+		fatalx("control socket setup failed");
 
-	newd_process = PROC_MAIN;
-	setproctitle("%s", log_procnames[newd_process]);
-	log_procinit(log_procnames[newd_process]);
+	/*
+	 * Start children, they exec and drop privileges while we parse. Any
+	 * further engines and frontends are started once the config says
+	 * how many.
+	 */
+	engine_fd = main_start_engine(0, saved_argv0, debug);
+	frontend_fd = main_start_frontend(0, saved_argv0, debug);
+	main_startup.children_usec = main_startup_since();
 
+	/* Signals that arrive while parsing are handled once we are ready. */
 	event_init();
 
 	/* Setup signal handler. */
@@ -221,32 +321,55 @@ main(int argc, char *argv[])
 	signal_add(&ev_sighup, NULL);
 	signal(SIGPIPE, SIG_IGN);
 
+	if ((main_conf = main_load_config()) == NULL)
+		exit(1);
+	latency_set_threshold(main_conf->latency_threshold);
+	main_nengines = MAXIMUM(main_conf->engines, 1);
+	main_nfrontends = MAXIMUM(main_conf->frontends, 1);
+	main_shard_config(main_conf);
+	main_conf->generation = 1;
+	main_startup.parse_usec = main_startup_since();
+
+	log_init(debug, LOG_DAEMON);
+	log_setverbose(cmd_opts & OPT_VERBOSE);
+
+	/* Standard input is already /dev/null. */
+	if (!debug && dup2(STDIN_FILENO, STDERR_FILENO) == -1)
+		fatal("dup2");
+
+	log_info("startup");
+
+	newd_process = PROC_MAIN;
+	setproctitle("%s", log_procnames[newd_process]);
+	log_procinit(log_procnames[newd_process]);
+
+	latency_init();
+	log_async();
+
 	/* Setup pipes to children. */
+	main_frontend_imsgev(0, frontend_fd);
+	for (i = 1; i < main_nfrontends; i++)
+		main_frontend_imsgev(i,
+		    main_start_frontend(i, saved_argv0, debug));
+	main_engine_imsgev(0, engine_fd);
+	for (i = 1; i < main_nengines; i++)
+		main_engine_imsgev(i, main_start_engine(i, saved_argv0, debug));
+	main_link_children();
+
+	/* All frontends have their copy of the control socket. */
+	close(control_state.fd);
+	control_state.fd = -1;
+
+	/* The config goes out as each child reports IMSG_STARTUP. */
+	main_startup.pending = main_nfrontends + main_nengines;
 
-	if ((iev_frontend = malloc(sizeof(struct imsgev))) == NULL ||
-	    (iev_engine = malloc(sizeof(struct imsgev))) == NULL)
-		fatal(NULL);
-	imsg_init(&iev_frontend->ibuf, pipe_main2frontend[0]);
-	iev_frontend->handler = main_dispatch_frontend;
-	imsg_init(&iev_engine->ibuf, pipe_main2engine[0]);
-	iev_engine->handler = main_dispatch_engine;
-
-	/* Setup event handlers for pipes to engine & frontend. */
-	iev_frontend->events = EV_READ;
-	event_set(&iev_frontend->ev, iev_frontend->ibuf.fd,
-	    iev_frontend->events, iev_frontend->handler, iev_frontend);
-	event_add(&iev_frontend->ev, NULL);
-
-	iev_engine->events = EV_READ;
-	event_set(&iev_engine->ev, iev_engine->ibuf.fd, iev_engine->events,
-	    iev_engine->handler, iev_engine);
-	event_add(&iev_engine->ev, NULL);
-
-	if (main_imsg_send_ipc_sockets(&iev_frontend->ibuf, &iev_engine->ibuf))
-		fatal("could not establish imsg links");
-	main_imsg_send_config(main_conf);
-
-	if (pledge("rpath stdio cpath sendfd", NULL) == -1)
+	/*
+	 * Shared memory snapshots are created in /tmp. Reloads fork a helper
+	 * to parse the config.
+	 */
+	if (pledge((cmd_opts & OPT_SHMCONF) ?
+	    "rpath wpath stdio cpath sendfd proc" :
+	    "rpath stdio cpath sendfd proc", NULL) == -1)
 		fatal("pledge");
 
 	event_dispatch();
@@ -255,17 +378,129 @@ main(int argc, char *argv[])
 	return (0);
 }
 
+/*
+ * Fork into the background like daemon(3), but keep the foreground process
+ * until the daemon is ready, so that its exit status tells whether startup
+ * succeeded. Only standard input and output are detached here. Returns the
+ * descriptor that main_startup_child() reports readiness on.
+ */
+static int
+main_daemonize(void)
+{
+	int	 fds[2], fd;
+	ssize_t	 n;
+	char	 c;
+
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		fatal("pipe2");
+
+	switch (fork()) {
+	case -1:
+		fatal("cannot fork");
+	case 0:
+		break;
+	default:
+		close(fds[1]);
+		while ((n = read(fds[0], &c, 1)) == -1 && errno == EINTR)
+			;
+		_exit(n == 1 ? 0 : 1);
+	}
+
+	close(fds[0]);
+	if (setsid() == -1)
+		fatal("setsid");
+	if ((fd = open(_PATH_DEVNULL, O_RDWR)) == -1)
+		fatal("%s", _PATH_DEVNULL);
+	if (dup2(fd, STDIN_FILENO) == -1 || dup2(fd, STDOUT_FILENO) == -1)
+		fatal("dup2");
+	if (fd > STDERR_FILENO)
+		close(fd);
+
+	return (fds[1]);
+}
+
+/*
+ * A child has exec'd, dropped privileges and set up its event loop. Send it
+ * the config; once all have it, the daemon is ready.
+ */
+static void
+main_startup_child(struct imsgev *iev)
+{
+	if (main_startup.pending == 0) {
+		log_warnx("%s: unexpected IMSG_STARTUP", __func__);
+		return;
+	}
+
+	if (main_imsg_send_config(main_conf, iev) == -1)
+		fatalx("%s: cannot send config", __func__);
+	if (iev->peer == PROC_FRONTEND)
+		main_startup.frontend_usec = main_startup_since();
+	else
+		main_startup.engine_usec = main_startup_since();
+
+	if (--main_startup.pending > 0)
+		return;
+
+	main_startup.ready_usec = main_startup_since();
+	log_info("ready after %llu.%03llu ms (parse %llu.%03llu ms)",
+	    (unsigned long long)main_startup.ready_usec / 1000,
+	    (unsigned long long)main_startup.ready_usec % 1000,
+	    (unsigned long long)main_startup.parse_usec / 1000,
+	    (unsigned long long)main_startup.parse_usec % 1000);
+	if (main_startup.ready_fd != -1) {
+		if (write(main_startup.ready_fd, "", 1) == -1)
+			log_warn("%s: write", __func__);
+		close(main_startup.ready_fd);
+		main_startup.ready_fd = -1;
+	}
+	if (main_startup.reload)
+		reload_request();
+}
+
+static uint64_t
+main_startup_since(void)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &main_startup.start, &now);
+
+	return (now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+}
+
+/*
+ * A reload must not overtake the first config, which goes out to each
+ * child separately.
+ */
+static void
+main_reload_request(void)
+{
+	if (main_startup.pending > 0) {
+		log_debug("%s: reload deferred until startup completes",
+		    __func__);
+		main_startup.reload = 1;
+		return;
+	}
+	reload_request();
+}
+
 __dead void
 main_shutdown(void)
 {
 	pid_t	 pid;
-	int	 status;
+	int	 status, i;
+
+	reload_abort();
 
 	/* Close pipes. */
-	msgbuf_clear(&iev_frontend->ibuf.w);
-	close(iev_frontend->ibuf.fd);
-	msgbuf_clear(&iev_engine->ibuf.w);
-	close(iev_engine->ibuf.fd);
+	for (i = 0; i < main_nfrontends; i++) {
+		msgbuf_clear(&iev_frontends[i]->ibuf.w);
+		close(iev_frontends[i]->ibuf.fd);
+	}
+	for (i = 0; i < main_nengines; i++) {
+		msgbuf_clear(&iev_engines[i]->ibuf.w);
+		close(iev_engines[i]->ibuf.fd);
+	}
 
 	config_clear(main_conf);
 
@@ -277,12 +512,13 @@ main_shutdown(void)
 				fatal("wait");
 		} else if (WIFSIGNALED(status))
 			log_warnx("%s terminated; signal %d",
-			    (pid == engine_pid) ? "engine" :
-			    "frontend", WTERMSIG(status));
+			    main_child_name(pid), WTERMSIG(status));
 	} while (pid != -1 || (pid == -1 && errno == EINTR));
 
-	free(iev_frontend);
-	free(iev_engine);
+	for (i = 0; i < main_nfrontends; i++)
+		free(iev_frontends[i]);
+	for (i = 0; i < main_nengines; i++)
+		free(iev_engines[i]);
 
 	control_cleanup(csock);
 
@@ -290,10 +526,128 @@ main_shutdown(void)
 	exit(0);
 }
 
+/*
+ * Start the engine owning shard and return the main end of its pipe.
+ */
+static int
+main_start_engine(int shard, char *argv0, int debug)
+{
+	int	pipe_main2engine[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	    PF_UNSPEC, pipe_main2engine) == -1)
+		fatal("main2engine socketpair");
+	engine_pids[shard] = start_child(PROC_ENGINE, argv0,
+	    pipe_main2engine[1], debug, cmd_opts & OPT_VERBOSE, -1);
+
+	return (pipe_main2engine[0]);
+}
+
+/*
+ * Set up the pipe to the engine owning shard.
+ */
+static void
+main_engine_imsgev(int shard, int fd)
+{
+	struct imsgev	*iev;
+
+	if ((iev = calloc(1, sizeof(*iev))) == NULL)
+		fatal(NULL);
+	imsg_init(&iev->ibuf, fd);
+	iev->handler = main_dispatch_engine;
+	iev->peer = PROC_ENGINE;
+	iev->peer_instance = shard;
+	iev->events = EV_READ;
+	event_set(&iev->ev, iev->ibuf.fd, iev->events, iev->handler, iev);
+	event_add(&iev->ev, NULL);
+	iev_engines[shard] = iev;
+}
+
+/*
+ * Start frontend n on the control socket and return the main end of its
+ * pipe.
+ */
+static int
+main_start_frontend(int n, char *argv0, int debug)
+{
+	int	pipe_main2frontend[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	    PF_UNSPEC, pipe_main2frontend) == -1)
+		fatal("main2frontend socketpair");
+	frontend_pids[n] = start_child(PROC_FRONTEND, argv0,
+	    pipe_main2frontend[1], debug, cmd_opts & OPT_VERBOSE,
+	    control_state.fd);
+
+	return (pipe_main2frontend[0]);
+}
+
+static void
+main_frontend_imsgev(int n, int fd)
+{
+	struct imsgev	*iev;
+
+	if ((iev = calloc(1, sizeof(*iev))) == NULL)
+		fatal(NULL);
+	imsg_init(&iev->ibuf, fd);
+	iev->handler = main_dispatch_frontend;
+	iev->peer = PROC_FRONTEND;
+	iev->peer_instance = n;
+	iev->events = EV_READ;
+	event_set(&iev->ev, iev->ibuf.fd, iev->events, iev->handler, iev);
+	event_add(&iev->ev, NULL);
+	iev_frontends[n] = iev;
+}
+
+/*
+ * Give every frontend a pipe to every engine, in shard order.
+ */
+static void
+main_link_children(void)
+{
+	int	f, e;
+
+	for (f = 0; f < main_nfrontends; f++) {
+		for (e = 0; e < main_nengines; e++) {
+			if (main_imsg_send_ipc_sockets(f, e) == -1)
+				fatal("could not establish imsg links");
+		}
+	}
+}
+
+/*
+ * Name the child pid the way it names itself, with its instance.
+ */
+static const char *
+main_child_name(pid_t pid)
+{
+	static char	name[32];
+	int		i;
+
+	for (i = 0; i < main_nfrontends; i++) {
+		if (frontend_pids[i] == pid) {
+			instance_name("frontend", i, name, sizeof(name));
+			return (name);
+		}
+	}
+	for (i = 0; i < main_nengines; i++) {
+		if (engine_pids[i] == pid) {
+			instance_name("engine", i, name, sizeof(name));
+			return (name);
+		}
+	}
+	snprintf(name, sizeof(name), "child %ld", (long)pid);
+	return (name);
+}
+
+/*
+ * Exec a child on fd, which becomes descriptor 3. A frontend also gets the
+ * listening control socket ctlfd as CONTROL_FD.
+ */
 static pid_t
-start_child(int p, char *argv0, int fd, int debug, int verbose, char *sockname)
+start_child(int p, char *argv0, int fd, int debug, int verbose, int ctlfd)
 {
-	char	*argv[7];
+	char	*argv[5];
 	int	 argc = 0;
 	pid_t	 pid;
 
@@ -307,8 +661,20 @@ start_child(int p, char *argv0, int fd, int debug, int verbose, char *sockname)
 		return (pid);
 	}
 
+	/* Keep ctlfd clear of fd 3, F_DUPFD also drops close-on-exec. */
+	if (ctlfd != -1 &&
+	    (ctlfd = fcntl(ctlfd, F_DUPFD, CONTROL_FD + 1)) == -1)
+		fatal("cannot setup control fd");
 	if (dup2(fd, 3) == -1)
 		fatal("cannot setup imsg fd");
+	if (ctlfd != -1) {
+		if (dup2(ctlfd, CONTROL_FD) == -1)
+			fatal("cannot setup control fd");
+		close(ctlfd);
+	}
+	/* Standard input is already /dev/null. */
+	if (!debug && dup2(STDIN_FILENO, STDERR_FILENO) == -1)
+		fatal("cannot detach stderr");
 
 	argv[argc++] = argv0;
 	switch (p) {
@@ -325,10 +691,6 @@ start_child(int p, char *argv0, int fd, int debug, int verbose, char *sockname)
 		argv[argc++] = "-d";
 	if (verbose)
 		argv[argc++] = "-v";
-	if (sockname) {
-		argv[argc++] = "-s";
-		argv[argc++] = sockname;
-	}
 	argv[argc++] = NULL;
 
 	execvp(argv0, argv);
@@ -342,7 +704,7 @@ main_dispatch_frontend(int fd, short event, void *bula)
 	struct imsgbuf		*ibuf;
 	struct imsg		 imsg;
 	ssize_t			 n;
-	int			 shut = 0, verbose;
+	int			 shut = 0, verbose, i;
 
 	ibuf = &iev->ibuf;
 
@@ -360,25 +722,46 @@ main_dispatch_frontend(int fd, short event, void *bula)
 	}
 
 	for (;;) {
-		if ((n = imsg_get(ibuf, &imsg)) == -1)
+		if ((n = imsg_get_event(iev, &imsg)) == -1)
 			fatal("imsg_get");
 		if (n == 0)	/* No more messages. */
 			break;
 
 		switch (imsg.hdr.type) {
+		case IMSG_STARTUP:
+			main_startup_child(iev);
+			break;
 		case IMSG_CTL_RELOAD:
-			if (main_reload() == -1)
-				log_warnx("configuration reload failed");
-			else
-				log_warnx("configuration reloaded");
+			main_reload_request();
+			break;
+		case IMSG_RECONF_SNAPSHOT:
+			main_snapshot_failed(iev);
 			break;
 		case IMSG_CTL_LOG_VERBOSE:
 			/* Already checked by frontend. */
 			memcpy(&verbose, imsg.data, sizeof(verbose));
 			log_setverbose(verbose);
+			/* The other frontends follow suit. */
+			for (i = 0; i < main_nfrontends; i++) {
+				if (iev_frontends[i] != iev)
+					imsg_compose_event(iev_frontends[i],
+					    IMSG_CTL_LOG_VERBOSE, 0, 0, -1,
+					    &verbose, sizeof(verbose));
+			}
 			break;
 		case IMSG_CTL_SHOW_MAIN_INFO:
-			main_showinfo_ctl(&imsg);
+			main_showinfo_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_SHOW_STATS:
+			main_showstats_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_SHOW_LATENCY:
+			main_showlatency_ctl(iev, &imsg);
+			break;
+		case IMSG_CTL_SHOW_TRACE:
+			trace_compose(iev, imsg.hdr.peerid, imsg.hdr.pid);
+			imsg_compose_event(iev, IMSG_CTL_END, imsg.hdr.peerid,
+			    imsg.hdr.pid, -1, NULL, 0);
 			break;
 		default:
 			log_debug("%s: error handling imsg %d", __func__,
@@ -391,7 +774,7 @@ main_dispatch_frontend(int fd, short event, void *bula)
 		imsg_event_add(iev);
 	else {
 		/* This pipe is dead. Remove its event handler */
-		event_del(&iev->ev);
+		imsg_event_del(iev);
 		event_loopexit(NULL);
 	}
 }
@@ -421,12 +804,18 @@ main_dispatch_engine(int fd, short event, void *bula)
 	}
 
 	for (;;) {
-		if ((n = imsg_get(ibuf, &imsg)) == -1)
+		if ((n = imsg_get_event(iev, &imsg)) == -1)
 			fatal("imsg_get");
 		if (n == 0)	/* No more messages. */
 			break;
 
 		switch (imsg.hdr.type) {
+		case IMSG_STARTUP:
+			main_startup_child(iev);
+			break;
+		case IMSG_RECONF_SNAPSHOT:
+			main_snapshot_failed(iev);
+			break;
 		default:
 			log_debug("%s: error handling imsg %d", __func__,
 			    imsg.hdr.type);
@@ -438,39 +827,117 @@ main_dispatch_engine(int fd, short event, void *bula)
 		imsg_event_add(iev);
 	else {
 		/* This pipe is dead. Remove its event handler. */
-		event_del(&iev->ev);
+		imsg_event_del(iev);
 		event_loopexit(NULL);
 	}
 }
 
 void
-main_imsg_compose_frontend(int type, pid_t pid, void *data, uint16_t datalen)
+main_imsg_compose_frontend(int type, uint32_t peerid, pid_t pid, void *data,
+    uint16_t datalen)
 {
-	if (iev_frontend)
-		imsg_compose_event(iev_frontend, type, 0, pid, -1, data,
-		    datalen);
+	int	i;
+
+	for (i = 0; i < main_nfrontends; i++)
+		imsg_compose_event(iev_frontends[i], type, peerid, pid, -1,
+		    data, datalen);
 }
 
 void
-main_imsg_compose_engine(int type, pid_t pid, void *data, uint16_t datalen)
+main_imsg_compose_engine(int type, uint32_t peerid, pid_t pid, void *data,
+    uint16_t datalen)
 {
-	if (iev_engine)
-		imsg_compose_event(iev_engine, type, 0, pid, -1, data,
-		    datalen);
+	int	i;
+
+	for (i = 0; i < main_nengines; i++)
+		imsg_compose_event(iev_engines[i], type, peerid, pid, -1,
+		    data, datalen);
 }
 
+/*
+ * Arm the event of iev for what it waits on. The event is made persistent
+ * here, so it only needs to be changed, at the cost of a system call, when
+ * EV_WRITE comes or goes.
+ */
 void
 imsg_event_add(struct imsgev *iev)
 {
-	iev->events = EV_READ;
+	short	events = EV_READ | EV_PERSIST;
+
 	if (iev->ibuf.w.queued)
-		iev->events |= EV_WRITE;
+		events |= EV_WRITE;
+	if (events == iev->events &&
+	    event_pending(&iev->ev, EV_READ | EV_WRITE, NULL))
+		return;
 
+	iev->events = events;
+	iev->rearms++;
 	event_del(&iev->ev);
 	event_set(&iev->ev, iev->ibuf.fd, iev->events, iev->handler, iev);
 	event_add(&iev->ev, NULL);
 }
 
+/*
+ * Stop all events of iev, before it is closed.
+ */
+void
+imsg_event_del(struct imsgev *iev)
+{
+	if (iev->flush_queued) {
+		TAILQ_REMOVE(&imsg_flushq, iev, flush_entry);
+		iev->flush_queued = 0;
+	}
+	event_del(&iev->ev);
+}
+
+/*
+ * imsg_compose_event() only queues its imsg and marks iev for flushing,
+ * so a burst of imsgs costs one flush.
+ */
+static void
+imsg_flush_later(struct imsgev *iev)
+{
+	static struct timeval	tv;	/* next pass of the event loop */
+
+	if (iev->flush_queued)
+		return;
+	iev->flush_queued = 1;
+	TAILQ_INSERT_TAIL(&imsg_flushq, iev, flush_entry);
+
+	if (!imsg_flush_set) {
+		evtimer_set(&imsg_flush_ev, imsg_flush_run, NULL);
+		imsg_flush_set = 1;
+	}
+	if (!evtimer_pending(&imsg_flush_ev, NULL))
+		evtimer_add(&imsg_flush_ev, &tv);
+}
+
+/*
+ * Try to write out what each marked iev has queued, and make those that
+ * could not write all of it wait for EV_WRITE. Errors are left for the
+ * handler to run into on EV_WRITE. After a write the written callback
+ * gets to queue more, there may be no EV_WRITE to do it from. Only the
+ * ievs marked so far are flushed, what the callbacks queue waits for the
+ * next pass of the event loop.
+ */
+static void
+imsg_flush_run(int fd, short event, void *bula)
+{
+	struct imsgev	*iev;
+	int		 n = 0;
+
+	TAILQ_FOREACH(iev, &imsg_flushq, flush_entry)
+		n++;
+	while (n-- > 0 && (iev = TAILQ_FIRST(&imsg_flushq)) != NULL) {
+		TAILQ_REMOVE(&imsg_flushq, iev, flush_entry);
+		iev->flush_queued = 0;
+		if (iev->ibuf.w.queued &&
+		    msgbuf_write(&iev->ibuf.w) > 0 && iev->written != NULL)
+			iev->written(iev);
+		imsg_event_add(iev);
+	}
+}
+
 int
 imsg_compose_event(struct imsgev *iev, uint16_t type, uint32_t peerid,
     pid_t pid, int fd, void *data, uint16_t datalen)
@@ -478,82 +945,450 @@ imsg_compose_event(struct imsgev *iev, uint16_t type, uint32_t peerid,
 	int	ret;
 
 	if ((ret = imsg_compose(&iev->ibuf, type, peerid, pid, fd, data,
-	    datalen)) != -1)
-		imsg_event_add(iev);
+	    datalen)) != -1) {
+		iev->imsgs_out++;
+		iev->bytes_out += IMSG_HEADER_SIZE + datalen;
+		if (iev->ibuf.w.queued > iev->queued_max)
+			iev->queued_max = iev->ibuf.w.queued;
+		trace_imsg(iev, TRACE_OUT, type, datalen, peerid);
+		imsg_flush_later(iev);
+	}
 
 	return (ret);
 }
 
+ssize_t
+imsg_get_event(struct imsgev *iev, struct imsg *imsg)
+{
+	ssize_t	n;
+
+	latency_end(iev);
+	if ((n = imsg_get(&iev->ibuf, imsg)) > 0) {
+		iev->imsgs_in++;
+		iev->bytes_in += imsg->hdr.len;
+		trace_imsg(iev, TRACE_IN, imsg->hdr.type,
+		    imsg->hdr.len - IMSG_HEADER_SIZE, imsg->hdr.peerid);
+		latency_begin(iev, imsg);
+	}
+
+	return (n);
+}
+
+/*
+ * Add the counter prefix.name to st. Counters beyond what fits into one
+ * IMSG_CTL_SHOW_STATS are dropped.
+ */
+void
+ctl_stats_add(struct ctl_stats *st, const char *prefix, const char *name,
+    uint64_t value)
+{
+	struct ctl_stat	*cs;
+
+	if (st->count >= CTL_STATS_MAX)
+		return;
+
+	cs = &st->stat[st->count++];
+	memset(cs->name, 0, sizeof(cs->name));
+	snprintf(cs->name, sizeof(cs->name), "%s.%s", prefix, name);
+	cs->value = value;
+}
+
+/*
+ * Add the counters of the pipe iev, named prefix.*, to st.
+ */
+void
+ctl_stats_imsgev(struct ctl_stats *st, const char *prefix,
+    struct imsgev *iev)
+{
+	if (iev == NULL)
+		return;
+
+	ctl_stats_add(st, prefix, "imsgs_in", iev->imsgs_in);
+	ctl_stats_add(st, prefix, "bytes_in", iev->bytes_in);
+	ctl_stats_add(st, prefix, "imsgs_out", iev->imsgs_out);
+	ctl_stats_add(st, prefix, "bytes_out", iev->bytes_out);
+	ctl_stats_add(st, prefix, "queued", iev->ibuf.w.queued);
+	ctl_stats_add(st, prefix, "queued_max", iev->queued_max);
+	ctl_stats_add(st, prefix, "rearms", iev->rearms);
+}
+
+/*
+ * Add the log counters of the calling process, named prefix.*, to st.
+ */
+void
+ctl_stats_log(struct ctl_stats *st, const char *prefix)
+{
+	uint64_t	dropped, suppressed;
+
+	log_getstats(&dropped, &suppressed);
+	ctl_stats_add(st, prefix, "log_dropped", dropped);
+	ctl_stats_add(st, prefix, "log_suppressed", suppressed);
+}
+
 static int
-main_imsg_send_ipc_sockets(struct imsgbuf *frontend_buf,
-    struct imsgbuf *engine_buf)
+main_imsg_send_ipc_sockets(int frontend, int engine)
 {
-	int pipe_frontend2engine[2];
+	struct ipc_link	 link;
+	int		 pipe_frontend2engine[2];
 
 	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
 	    PF_UNSPEC, pipe_frontend2engine) == -1)
 		return (-1);
 
-	if (imsg_compose(frontend_buf, IMSG_SOCKET_IPC, 0, 0,
-	    pipe_frontend2engine[0], NULL, 0) == -1)
+	/* Both ends learn who is on either side. */
+	link.frontend = frontend;
+	link.engine = engine;
+	if (imsg_compose(&iev_frontends[frontend]->ibuf, IMSG_SOCKET_IPC, 0, 0,
+	    pipe_frontend2engine[0], &link, sizeof(link)) == -1)
 		return (-1);
-	if (imsg_compose(engine_buf, IMSG_SOCKET_IPC, 0, 0,
-	    pipe_frontend2engine[1], NULL, 0) == -1)
+	if (imsg_compose(&iev_engines[engine]->ibuf, IMSG_SOCKET_IPC, 0, 0,
+	    pipe_frontend2engine[1], &link, sizeof(link)) == -1)
 		return (-1);
 
 	return (0);
 }
 
-int
-main_reload(void)
+/*
+ * Use the compiled config if there is one that is up to date. Otherwise
+ * parse only the files that changed since main_conf was parsed if that is
+ * possible, and the whole config file if not.
+ */
+struct newd_conf *
+main_load_config(void)
 {
-	struct newd_conf *xconf;
+	struct newd_conf	*xconf;
 
-	if ((xconf = parse_config(conffile)) == NULL)
-		return (-1);
+	if (cachefile != NULL &&
+	    (xconf = config_cache_load(cachefile, conffile)) != NULL) {
+		log_debug("loaded compiled config %s", cachefile);
+		/* Nothing is known about the files it came from. */
+		parse_sources_clear();
+		return (xconf);
+	}
+	if ((xconf = parse_config_update(main_conf)) != NULL)
+		return (xconf);
+	return (parse_config(conffile));
+}
 
-	if (main_imsg_send_config(xconf) == -1)
-		return (-1);
+/*
+ * Apply xconf, loaded from sources by a reload that took usec, or count a
+ * failed reload if it is NULL.
+ */
+void
+main_reload_done(struct newd_conf *xconf, struct conf_sources *sources,
+    uint64_t usec)
+{
+	int	rv = -1;
+
+	if (xconf != NULL) {
+		/* The children are only started once. */
+		if (MAXIMUM(xconf->engines, 1) != main_nengines)
+			log_warnx("engines %d takes effect after a restart",
+			    MAXIMUM(xconf->engines, 1));
+		if (MAXIMUM(xconf->frontends, 1) != main_nfrontends)
+			log_warnx("frontends %d takes effect after a restart",
+			    MAXIMUM(xconf->frontends, 1));
+		xconf->engines = main_conf->engines;
+		xconf->frontends = main_conf->frontends;
+		xconf->generation = main_conf->generation + 1;
+		main_shard_config(xconf);
+
+		parse_sources_set(sources);
+		if (main_imsg_send_delta(main_conf, xconf) == -1) {
+			/* The sources no longer describe main_conf. */
+			parse_sources_clear();
+			config_clear(xconf);
+		} else {
+			merge_config(main_conf, xconf);
+			latency_set_threshold(main_conf->latency_threshold);
+			rv = 0;
+		}
+	}
 
-	merge_config(main_conf, xconf);
+	main_stats.reloads++;
+	if (rv == -1)
+		main_stats.reload_failures++;
+	main_stats.reload_usec_last = usec;
+	main_stats.reload_usec_total += usec;
 
-	return (0);
+	if (rv == -1)
+		log_warnx("configuration reload failed");
+	else
+		log_info("configuration reloaded");
 }
 
+/*
+ * Send all of xconf to the child behind iev, or to all if iev is NULL.
+ */
 int
-main_imsg_send_config(struct newd_conf *xconf)
+main_imsg_send_config(struct newd_conf *xconf, struct imsgev *iev)
+{
+	/*
+	 * Hand the whole config over in one shared memory object. An image
+	 * holds all groups, so this is only done for a single engine.
+	 */
+	if ((cmd_opts & OPT_SHMCONF) && main_nengines == 1)
+		return (main_imsg_send_snapshot(xconf, iev));
+
+	return (main_imsg_send_imsgs(xconf, iev));
+}
+
+/*
+ * Send all of xconf to the child behind iev, or to all if iev is NULL, as
+ * a series of imsgs.
+ */
+static int
+main_imsg_send_imsgs(struct newd_conf *xconf, struct imsgev *iev)
 {
 	struct group	 *g;
 
 	/* Send fixed part of config to children. */
-	if (main_sendboth(IMSG_RECONF_CONF, xconf, sizeof(*xconf)) == -1)
+	if (main_sendto(iev, IMSG_RECONF_CONF, xconf, sizeof(*xconf)) == -1)
 		return (-1);
 
-	/* Send the group list to children. */
-	LIST_FOREACH(g, &xconf->group_list, entry) {
-		if (main_sendboth(IMSG_RECONF_GROUP, g, sizeof(*g)) == -1)
+	/*
+	 * Send the group list to children. Large lists are packed into as
+	 * few imsgs as possible.
+	 */
+	if (xconf->group_count >= RECONF_GROUPS_MAX) {
+		if (main_imsg_send_groups(xconf, iev) == -1)
 			return (-1);
+	} else {
+		LIST_FOREACH(g, &xconf->group_list, entry) {
+			if (main_sendgroup(iev, IMSG_RECONF_GROUP, g, g,
+			    sizeof(*g)) == -1)
+				return (-1);
+		}
 	}
 
 	/* Tell children the revised config is now complete. */
-	if (main_sendboth(IMSG_RECONF_END, NULL, 0) == -1)
+	if (main_sendto(iev, IMSG_RECONF_END, NULL, 0) == -1)
 		return (-1);
 
 	return (0);
 }
 
-int
-main_sendboth(enum imsg_type type, void *buf, uint16_t len)
+static int
+main_imsg_send_groups(struct newd_conf *xconf, struct imsgev *iev)
 {
-	if (imsg_compose_event(iev_frontend, type, 0, 0, -1, buf, len) == -1)
+	static struct group	 groups[RECONF_GROUPS_MAX];
+	struct group		*g;
+	size_t			 n = 0;
+	int			 i;
+
+	/* Each child gets its own packed imsgs. */
+	if (iev == NULL) {
+		for (i = 0; i < main_nfrontends; i++) {
+			if (main_imsg_send_groups(xconf, iev_frontends[i]) ==
+			    -1)
+				return (-1);
+		}
+		for (i = 0; i < main_nengines; i++) {
+			if (main_imsg_send_groups(xconf, iev_engines[i]) == -1)
+				return (-1);
+		}
+		return (0);
+	}
+
+	LIST_FOREACH(g, &xconf->group_list, entry) {
+		if (iev->peer == PROC_ENGINE && iev != iev_engines[g->shard])
+			continue;
+		memcpy(&groups[n++], g, sizeof(*g));
+		if (n < RECONF_GROUPS_MAX)
+			continue;
+		if (main_sendto(iev, IMSG_RECONF_GROUPS, groups,
+		    n * sizeof(*g)) == -1)
+			return (-1);
+		n = 0;
+	}
+	if (n > 0 && main_sendto(iev, IMSG_RECONF_GROUPS, groups,
+	    n * sizeof(*g)) == -1)
 		return (-1);
-	if (imsg_compose_event(iev_engine, type, 0, 0, -1, buf, len) == -1)
+
+	return (0);
+}
+
+/*
+ * Send the children only the differences between the running config and
+ * xconf. Falls back to sending all of xconf if most groups changed.
+ */
+static int
+main_imsg_send_delta(struct newd_conf *conf, struct newd_conf *xconf)
+{
+	struct group	*g, *xg;
+	uint32_t	 changes = 0;
+
+	LIST_FOREACH(xg, &xconf->group_list, entry) {
+		if ((g = group_find(conf, xg->name)) == NULL ||
+		    group_cmp(g, xg) != 0)
+			changes++;
+	}
+	LIST_FOREACH(g, &conf->group_list, entry) {
+		if (group_find(xconf, g->name) == NULL)
+			changes++;
+	}
+	if (changes > xconf->group_count / 2)
+		return (main_imsg_send_config(xconf, NULL));
+
+	if (main_sendall(IMSG_RECONF_DELTA, xconf, sizeof(*xconf)) == -1)
 		return (-1);
+
+	LIST_FOREACH(g, &conf->group_list, entry) {
+		if (group_find(xconf, g->name) == NULL &&
+		    main_sendgroup(NULL, IMSG_RECONF_GROUP_DEL, g, g->name,
+		    sizeof(g->name)) == -1)
+			return (-1);
+	}
+	LIST_FOREACH(xg, &xconf->group_list, entry) {
+		if ((g = group_find(conf, xg->name)) == NULL) {
+			if (main_sendgroup(NULL, IMSG_RECONF_GROUP_ADD, xg, xg,
+			    sizeof(*xg)) == -1)
+				return (-1);
+		} else if (group_cmp(g, xg) != 0) {
+			if (main_sendgroup(NULL, IMSG_RECONF_GROUP_MOD, xg, xg,
+			    sizeof(*xg)) == -1)
+				return (-1);
+		}
+	}
+
+	if (main_sendall(IMSG_RECONF_END, NULL, 0) == -1)
+		return (-1);
+
+	log_debug("%s: %u of %u groups changed", __func__, changes,
+	    xconf->group_count);
+
 	return (0);
 }
 
+/*
+ * Send xconf as a snapshot to the child behind iev, or to all if iev is
+ * NULL. A child the snapshot can't be sent to gets the imsgs instead.
+ */
+static int
+main_imsg_send_snapshot(struct newd_conf *xconf, struct imsgev *iev)
+{
+	struct imsgev	*xiev;
+	int		 fd, i, rv = 0;
+
+	if ((fd = config_image_shm(xconf)) == -1)
+		return (main_imsg_send_imsgs(xconf, iev));
+
+	/* Each child gets a copy of fd, the only engine included. */
+	for (i = 0; i <= main_nfrontends; i++) {
+		if (iev != NULL)
+			xiev = iev;
+		else if (i < main_nfrontends)
+			xiev = iev_frontends[i];
+		else
+			xiev = iev_engines[0];
+		if (main_send_fd(xiev, IMSG_RECONF_SNAPSHOT, fd) == -1 &&
+		    main_imsg_send_imsgs(xconf, xiev) == -1)
+			rv = -1;
+		if (iev != NULL)
+			break;
+	}
+	close(fd);
+
+	return (rv);
+}
+
+/*
+ * The child behind iev could not use the snapshot it was sent and still
+ * has its old config. Send it the current one as imsgs.
+ */
+static void
+main_snapshot_failed(struct imsgev *iev)
+{
+	char	name[16];
+
+	instance_name(log_procnames[iev->peer], iev->peer_instance, name,
+	    sizeof(name));
+	log_warnx("%s could not use its config snapshot", name);
+	if (main_imsg_send_imsgs(main_conf, iev) == -1)
+		log_warnx("%s: cannot send the config to %s", __func__, name);
+}
+
+/*
+ * Send a copy of fd to iev. The imsg framework closes it once it is sent.
+ */
+static int
+main_send_fd(struct imsgev *iev, enum imsg_type type, int fd)
+{
+	int	xfd;
+
+	if ((xfd = dup(fd)) == -1) {
+		log_warn("%s: dup", __func__);
+		return (-1);
+	}
+	if (imsg_compose_event(iev, type, 0, 0, xfd, NULL, 0) == -1) {
+		close(xfd);
+		return (-1);
+	}
+	return (0);
+}
+
+int
+main_sendall(enum imsg_type type, void *buf, uint16_t len)
+{
+	int	i;
+
+	for (i = 0; i < main_nfrontends; i++) {
+		if (imsg_compose_event(iev_frontends[i], type, 0, 0, -1, buf,
+		    len) == -1)
+			return (-1);
+	}
+	for (i = 0; i < main_nengines; i++) {
+		if (imsg_compose_event(iev_engines[i], type, 0, 0, -1, buf,
+		    len) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+main_sendto(struct imsgev *iev, enum imsg_type type, void *buf, uint16_t len)
+{
+	if (iev == NULL)
+		return (main_sendall(type, buf, len));
+	return (imsg_compose_event(iev, type, 0, 0, -1, buf, len));
+}
+
+/*
+ * Send an imsg about g to iev, or to the frontends and the engine owning g
+ * if iev is NULL. Engines that do not own g never hear of it.
+ */
+static int
+main_sendgroup(struct imsgev *iev, enum imsg_type type, struct group *g,
+    void *buf, uint16_t len)
+{
+	int	i;
+
+	if (iev == NULL) {
+		for (i = 0; i < main_nfrontends; i++) {
+			if (imsg_compose_event(iev_frontends[i], type, 0, 0,
+			    -1, buf, len) == -1)
+				return (-1);
+		}
+		iev = iev_engines[g->shard];
+	} else if (iev->peer == PROC_ENGINE && iev != iev_engines[g->shard])
+		return (0);
+	return (imsg_compose_event(iev, type, 0, 0, -1, buf, len));
+}
+
+/*
+ * Record in each group of conf which engine owns it.
+ */
+static void
+main_shard_config(struct newd_conf *conf)
+{
+	struct group	*g;
+
+	LIST_FOREACH(g, &conf->group_list, entry)
+		g->shard = group_shard(g->name, main_nengines);
+}
+
 void
-main_showinfo_ctl(struct imsg *imsg)
+main_showinfo_ctl(struct imsgev *iev, struct imsg *imsg)
 {
 	struct ctl_main_info cmi;
 	size_t n;
@@ -565,17 +1400,17 @@ main_showinfo_ctl(struct imsg *imsg)
 		    sizeof(cmi.text));
 		if (n >= sizeof(cmi.text))
 			log_debug("%s: I was cut off!", __func__);
-		main_imsg_compose_frontend(IMSG_CTL_SHOW_MAIN_INFO,
-		    imsg->hdr.pid, &cmi, sizeof(cmi));
+		imsg_compose_event(iev, IMSG_CTL_SHOW_MAIN_INFO,
+		    imsg->hdr.peerid, imsg->hdr.pid, -1, &cmi, sizeof(cmi));
 		memset(cmi.text, 0, sizeof(cmi.text));
 		n = strlcpy(cmi.text, "Full of sencha.",
 		    sizeof(cmi.text));
 		if (n >= sizeof(cmi.text))
 			log_debug("%s: I was cut off!", __func__);
-		main_imsg_compose_frontend(IMSG_CTL_SHOW_MAIN_INFO,
-		    imsg->hdr.pid, &cmi, sizeof(cmi));
-		main_imsg_compose_frontend(IMSG_CTL_END, imsg->hdr.pid, NULL,
-		    0);
+		imsg_compose_event(iev, IMSG_CTL_SHOW_MAIN_INFO,
+		    imsg->hdr.peerid, imsg->hdr.pid, -1, &cmi, sizeof(cmi));
+		imsg_compose_event(iev, IMSG_CTL_END, imsg->hdr.peerid,
+		    imsg->hdr.pid, -1, NULL, 0);
 		break;
 	default:
 		log_debug("%s: error handling imsg", __func__);
@@ -583,31 +1418,118 @@ main_showinfo_ctl(struct imsg *imsg)
 	}
 }
 
+static void
+main_showstats_ctl(struct imsgev *iev, struct imsg *imsg)
+{
+	static struct ctl_stats	 st;
+	char			 name[16], prefix[32];
+	int			 i;
+
+	st.count = 0;
+	ctl_stats_add(&st, "main", "reloads", main_stats.reloads);
+	ctl_stats_add(&st, "main", "reload_failures",
+	    main_stats.reload_failures);
+	ctl_stats_add(&st, "main", "reload_usec_last",
+	    main_stats.reload_usec_last);
+	ctl_stats_add(&st, "main", "reload_usec_total",
+	    main_stats.reload_usec_total);
+	ctl_stats_add(&st, "main", "groups", main_conf->group_count);
+	ctl_stats_add(&st, "main", "generation", main_conf->generation);
+	ctl_stats_add(&st, "main", "engines", main_nengines);
+	ctl_stats_add(&st, "main", "frontends", main_nfrontends);
+	ctl_stats_add(&st, "main", "startup_children_usec",
+	    main_startup.children_usec);
+	ctl_stats_add(&st, "main", "startup_parse_usec",
+	    main_startup.parse_usec);
+	ctl_stats_add(&st, "main", "startup_engine_usec",
+	    main_startup.engine_usec);
+	ctl_stats_add(&st, "main", "startup_frontend_usec",
+	    main_startup.frontend_usec);
+	ctl_stats_add(&st, "main", "startup_ready_usec",
+	    main_startup.ready_usec);
+	reload_stats(&st);
+	ctl_stats_log(&st, "main");
+	for (i = 0; i < main_nfrontends; i++) {
+		instance_name("frontend", i, name, sizeof(name));
+		snprintf(prefix, sizeof(prefix), "main.%s", name);
+		ctl_stats_imsgev(&st, prefix, iev_frontends[i]);
+	}
+	for (i = 0; i < main_nengines; i++) {
+		instance_name("engine", i, name, sizeof(name));
+		snprintf(prefix, sizeof(prefix), "main.%s", name);
+		ctl_stats_imsgev(&st, prefix, iev_engines[i]);
+	}
+
+	imsg_compose_event(iev, IMSG_CTL_SHOW_STATS, imsg->hdr.peerid,
+	    imsg->hdr.pid, -1, st.stat, st.count * sizeof(st.stat[0]));
+	imsg_compose_event(iev, IMSG_CTL_END, imsg->hdr.peerid,
+	    imsg->hdr.pid, -1, NULL, 0);
+}
+
+static void
+main_showlatency_ctl(struct imsgev *iev, struct imsg *imsg)
+{
+	static struct ctl_latency	 cl[CTL_LATENCY_MAX];
+	size_t				 n;
+
+	n = latency_fill(log_procnames[newd_process], cl, CTL_LATENCY_MAX);
+	imsg_compose_event(iev, IMSG_CTL_SHOW_LATENCY, imsg->hdr.peerid,
+	    imsg->hdr.pid, -1, cl, n * sizeof(cl[0]));
+	imsg_compose_event(iev, IMSG_CTL_END, imsg->hdr.peerid,
+	    imsg->hdr.pid, -1, NULL, 0);
+}
+
+/*
+ * Make conf match xconf, which is consumed. conf takes over the groups of
+ * xconf with their slabs and index, and its old generation of groups goes
+ * away in one sweep. Anything still pointing at the old groups has to be
+ * dropped first.
+ */
 void
 merge_config(struct newd_conf *conf, struct newd_conf *xconf)
 {
-	struct group	*g;
+	struct group	*g, *pg = NULL;
 
-	conf->yesno = xconf->yesno;
-	conf->integer = xconf->integer;
-	memcpy(conf->global_text, xconf->global_text,
-	    sizeof(conf->global_text));
+	config_copy_global(conf, xconf);
+	config_free_groups(conf);
 
-	/* Remove & discard existing groups. */
-	while ((g = LIST_FIRST(&conf->group_list)) != NULL) {
+	/* Keep the order of the groups. */
+	while ((g = LIST_FIRST(&xconf->group_list)) != NULL) {
 		LIST_REMOVE(g, entry);
-		free(g);
+		if (pg == NULL)
+			LIST_INSERT_HEAD(&conf->group_list, g, entry);
+		else
+			LIST_INSERT_AFTER(pg, g, entry);
+		pg = g;
 	}
-
-	/* Add new groups. */
-	while ((g = LIST_FIRST(&xconf->group_list)) != NULL) {
+	while ((g = LIST_FIRST(&xconf->group_freelist)) != NULL) {
 		LIST_REMOVE(g, entry);
-		LIST_INSERT_HEAD(&conf->group_list, g, entry);
+		LIST_INSERT_HEAD(&conf->group_freelist, g, entry);
 	}
-
+	conf->group_slabs = xconf->group_slabs;
+	conf->group_capacity = xconf->group_capacity;
+	conf->group_hash = xconf->group_hash;
+	conf->group_hashmask = xconf->group_hashmask;
+	conf->group_count = xconf->group_count;
 	free(xconf);
 }
 
+void
+config_copy_global(struct newd_conf *conf, struct newd_conf *xconf)
+{
+	conf->yesno = xconf->yesno;
+	conf->integer = xconf->integer;
+	memcpy(conf->global_text, xconf->global_text,
+	    sizeof(conf->global_text));
+	conf->latency_threshold = xconf->latency_threshold;
+	conf->engines = xconf->engines;
+	conf->frontends = xconf->frontends;
+	conf->control_backlog = xconf->control_backlog;
+	conf->control_queue = xconf->control_queue;
+	conf->control_timeout = xconf->control_timeout;
+	conf->generation = xconf->generation;
+}
+
 struct newd_conf *
 config_new_empty(void)
 {
@@ -617,19 +1539,257 @@ config_new_empty(void)
 	if (xconf == NULL)
 		fatal(NULL);
 
-	LIST_INIT(&xconf->group_list);
+	config_init_groups(xconf);
 
 	return (xconf);
 }
 
+void
+config_init_groups(struct newd_conf *xconf)
+{
+	LIST_INIT(&xconf->group_list);
+	xconf->group_hash = NULL;
+	xconf->group_hashmask = 0;
+	xconf->group_count = 0;
+	SLIST_INIT(&xconf->group_slabs);
+	LIST_INIT(&xconf->group_freelist);
+	xconf->group_capacity = 0;
+}
+
 void
 config_clear(struct newd_conf *conf)
 {
-	struct newd_conf	*xconf;
+	config_free_groups(conf);
+	free(conf);
+}
 
-	/* Merge current config with an empty config. */
-	xconf = config_new_empty();
-	merge_config(conf, xconf);
+/*
+ * Release all groups of conf at once.
+ */
+void
+config_free_groups(struct newd_conf *conf)
+{
+	struct group_slab	*s;
 
-	free(conf);
+	while ((s = SLIST_FIRST(&conf->group_slabs)) != NULL) {
+		SLIST_REMOVE_HEAD(&conf->group_slabs, entry);
+		free(s);
+	}
+	free(conf->group_hash);
+
+	config_init_groups(conf);
+}
+
+/*
+ * Make sure the next n groups allocated for conf come from one slab. Each
+ * new slab is at least as large as all previous ones together, so a config
+ * of n groups uses O(log n) slabs.
+ */
+void
+config_reserve_groups(struct newd_conf *conf, size_t n)
+{
+	struct group_slab	*s;
+	size_t			 size;
+
+	s = SLIST_FIRST(&conf->group_slabs);
+	if (s != NULL && s->size - s->used >= n)
+		return;
+
+	size = MAXIMUM(n, conf->group_capacity);
+	size = MAXIMUM(size, GROUP_SLAB_MIN);
+	if (size > (SIZE_MAX - sizeof(*s)) / sizeof(struct group))
+		fatalx("%s: too many groups", __func__);
+	if ((s = malloc(sizeof(*s) + size * sizeof(struct group))) == NULL)
+		fatal(NULL);
+	s->size = size;
+	s->used = 0;
+	SLIST_INSERT_HEAD(&conf->group_slabs, s, entry);
+	conf->group_capacity += size;
+}
+
+/*
+ * Add the groups packed into an IMSG_RECONF_GROUPS message to conf.
+ */
+int
+config_add_groups(struct newd_conf *conf, void *data, size_t len)
+{
+	struct group	*g, *groups = data;
+	size_t		 i, n;
+
+	if (len % sizeof(*g) != 0)
+		return (-1);
+
+	n = len / sizeof(*g);
+	for (i = 0; i < n; i++) {
+		g = group_alloc(conf);
+		memcpy(g, &groups[i], sizeof(*g));
+		group_insert(conf, g);
+	}
+
+	return (0);
+}
+
+/*
+ * Return a zeroed group carved from the slabs of conf. It is not linked
+ * into conf yet.
+ */
+struct group *
+group_alloc(struct newd_conf *conf)
+{
+	struct group_slab	*s;
+	struct group		*g;
+
+	if ((g = LIST_FIRST(&conf->group_freelist)) != NULL)
+		LIST_REMOVE(g, entry);
+	else {
+		config_reserve_groups(conf, 1);
+		s = SLIST_FIRST(&conf->group_slabs);
+		g = &s->groups[s->used++];
+	}
+	memset(g, 0, sizeof(*g));
+
+	return (g);
+}
+
+/*
+ * Return a group that is no longer linked into conf to its slabs.
+ */
+void
+group_free(struct newd_conf *conf, struct group *g)
+{
+	LIST_INSERT_HEAD(&conf->group_freelist, g, entry);
+}
+
+struct group *
+group_find(struct newd_conf *conf, const char *name)
+{
+	struct group	*g;
+
+	if (conf->group_hash == NULL)
+		return (NULL);
+
+	LIST_FOREACH(g, GROUP_HASH(conf, name), hash) {
+		if (strcmp(name, g->name) == 0)
+			return (g);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Compare the settings of two groups, ignoring their linkage.
+ */
+int
+group_cmp(struct group *a, struct group *b)
+{
+	return (strcmp(a->name, b->name) != 0 ||
+	    a->yesno != b->yesno ||
+	    a->integer != b->integer ||
+	    a->group_v4_bits != b->group_v4_bits ||
+	    a->group_v6_bits != b->group_v6_bits ||
+	    memcmp(&a->group_v4address, &b->group_v4address,
+	    sizeof(a->group_v4address)) != 0 ||
+	    memcmp(&a->group_v6address, &b->group_v6address,
+	    sizeof(a->group_v6address)) != 0);
+}
+
+/*
+ * Copy the settings of src to dst, leaving the linkage of dst alone.
+ */
+void
+group_copy(struct group *dst, struct group *src)
+{
+	memcpy(dst->name, src->name, sizeof(dst->name));
+	dst->yesno = src->yesno;
+	dst->integer = src->integer;
+	dst->shard = src->shard;
+	dst->group_v4_bits = src->group_v4_bits;
+	dst->group_v6_bits = src->group_v6_bits;
+	memcpy(&dst->group_v4address, &src->group_v4address,
+	    sizeof(dst->group_v4address));
+	memcpy(&dst->group_v6address, &src->group_v6address,
+	    sizeof(dst->group_v6address));
+}
+
+/*
+ * The engine owning the group called name, out of shards engines. main and
+ * the frontend must agree on it, so the key is fixed.
+ */
+int
+group_shard(const char *name, int shards)
+{
+	static const SIPHASH_KEY	key;
+
+	if (shards <= 1)
+		return (0);
+	return (SipHash24(&key, name, strlen(name)) % shards);
+}
+
+/*
+ * Name instance n of a process or its part, such as the engine owning
+ * shard n. The first is plain base, like a single instance always was.
+ */
+void
+instance_name(const char *base, int n, char *buf, size_t len)
+{
+	if (n == 0)
+		strlcpy(buf, base, len);
+	else
+		snprintf(buf, len, "%s%d", base, n);
+}
+
+void
+group_insert(struct newd_conf *conf, struct group *g)
+{
+	if (conf->group_hash == NULL ||
+	    conf->group_count > conf->group_hashmask)
+		group_hash_grow(conf);
+
+	LIST_INSERT_HEAD(&conf->group_list, g, entry);
+	LIST_INSERT_HEAD(GROUP_HASH(conf, g->name), g, hash);
+	conf->group_count++;
+}
+
+void
+group_remove(struct newd_conf *conf, struct group *g)
+{
+	LIST_REMOVE(g, entry);
+	LIST_REMOVE(g, hash);
+	conf->group_count--;
+}
+
+/*
+ * Double the number of hash buckets (keeping the load factor at or below
+ * one) and rehash all groups of conf.
+ */
+static void
+group_hash_grow(struct newd_conf *conf)
+{
+	struct group_head	*old;
+	struct group		*g;
+	uint32_t		 i, oldsize, size;
+
+	if (!group_hashkey_set) {
+		arc4random_buf(&group_hashkey, sizeof(group_hashkey));
+		group_hashkey_set = 1;
+	}
+
+	old = conf->group_hash;
+	oldsize = old == NULL ? 0 : conf->group_hashmask + 1;
+	size = old == NULL ? GROUP_HASH_MIN : oldsize * 2;
+
+	if ((conf->group_hash = calloc(size, sizeof(*conf->group_hash))) ==
+	    NULL)
+		fatal(NULL);
+	for (i = 0; i < size; i++)
+		LIST_INIT(&conf->group_hash[i]);
+	conf->group_hashmask = size - 1;
+
+	for (i = 0; i < oldsize; i++) {
+		while ((g = LIST_FIRST(&old[i])) != NULL) {
+			LIST_REMOVE(g, hash);
+			LIST_INSERT_HEAD(GROUP_HASH(conf, g->name), g, hash);
+		}
+	}
+	free(old);
 }
@@ -24,29 +24,60 @@
 #define OPT_VERBOSE	0x00000001
 #define OPT_VERBOSE2	0x00000002
 #define OPT_NOACTION	0x00000004
+#define OPT_SHMCONF	0x00000008
+
+/* Options a control client can turn on with IMSG_CTL_SET_OPTS. */
+#define CTL_OPT_PACKED	0x00000001	/* takes IMSG_CTL_SHOW_ENGINE_INFOS */
+#define CTL_OPT_GENERATION 0x00000002	/* takes IMSG_CTL_GENERATION */
+#define CTL_OPTS_ALL	(CTL_OPT_PACKED | CTL_OPT_GENERATION)
+
+/* What a control client can be told about with IMSG_CTL_SUBSCRIBE. */
+#define CTL_SUB_RECONF	0x00000001	/* takes IMSG_CTL_NOTIFY on reloads */
+#define CTL_SUB_GROUPS	0x00000002	/* and IMSG_CTL_NOTIFY_GROUPS */
+#define CTL_SUBS_ALL	(CTL_SUB_RECONF | CTL_SUB_GROUPS)
 
 #define NEWD_MAXTEXT		256
 #define NEWD_MAXGROUPNAME	16
+#define NEWD_MAXENGINES		64
+#define NEWD_MAXFRONTENDS	64
 
 enum {
 	PROC_MAIN,
 	PROC_ENGINE,
-	PROC_FRONTEND
+	PROC_FRONTEND,
+	PROC_CONTROL,		/* a control client, only ever a peer */
+	PROC_RELOAD		/* the reload helper of main */
 } newd_process;
 
 static const char * const log_procnames[] = {
 	"main",
 	"engine",
-	"frontend"
+	"frontend",
+	"control",
+	"reload"
 };
 
 struct imsgev {
 	struct imsgbuf	 ibuf;
 	void		(*handler)(int, short, void *);
+	void		(*written)(struct imsgev *); /* after a flush */
 	struct event	 ev;
 	short		 events;
+	TAILQ_ENTRY(imsgev) flush_entry;
+	int		 flush_queued;	/* on imsg_flushq */
+	uint64_t	 rearms;	/* event changes made */
+	uint64_t	 imsgs_in;
+	uint64_t	 bytes_in;
+	uint64_t	 imsgs_out;
+	uint64_t	 bytes_out;
+	uint32_t	 queued_max;
+	int		 lat_type;	/* imsg being handled or IMSG_NONE */
+	struct timespec	 lat_start;
+	int		 peer;		/* PROC_* */
+	int		 peer_instance;	/* engine shard or frontend */
 };
 
+/* Control clients see these numbers, new types go at the end. */
 enum imsg_type {
 	IMSG_NONE,
 	IMSG_CTL_LOG_VERBOSE,
@@ -58,12 +89,50 @@ enum imsg_type {
 	IMSG_RECONF_CONF,
 	IMSG_RECONF_GROUP,
 	IMSG_RECONF_END,
-	IMSG_SOCKET_IPC
+	IMSG_SOCKET_IPC,
+	IMSG_CTL_LOOKUP_ADDR,
+	IMSG_RECONF_GROUPS,
+	IMSG_RECONF_SNAPSHOT,
+	IMSG_RECONF_DELTA,
+	IMSG_RECONF_GROUP_ADD,
+	IMSG_RECONF_GROUP_MOD,
+	IMSG_RECONF_GROUP_DEL,
+	IMSG_CTL_SET_OPTS,
+	IMSG_CTL_SHOW_ENGINE_INFOS,
+	IMSG_CTL_SHOW_STATS,
+	IMSG_CTL_SHOW_LATENCY,
+	IMSG_CTL_SHOW_TRACE,
+	IMSG_RELOAD_SOURCE,
+	IMSG_RELOAD_GROUPS,
+	IMSG_RELOAD_MACRO,
+	IMSG_RELOAD_IMAGE,
+	IMSG_RELOAD_END,
+	IMSG_STARTUP,
+	IMSG_CTL_NOT_MODIFIED,
+	IMSG_CTL_SUBSCRIBE,
+	IMSG_CTL_NOTIFY,
+	IMSG_CTL_NOTIFY_GROUPS,
+	IMSG_CTL_DUMP_PAUSE,
+	IMSG_CTL_DUMP_RESUME,
+	IMSG_CTL_DUMP_CANCEL,
+	IMSG_CTL_LOOKUP_ADDRS,
+	IMSG_CTL_LOOKUP_GROUPS,
+	IMSG_CTL_DUMP_ABORTED,
+	IMSG_CTL_GENERATION,
+	IMSG_MAX
+};
+
+/* IMSG_SOCKET_IPC hands out one end of the pipe between these two. */
+struct ipc_link {
+	int	frontend;
+	int	engine;		/* the shard it owns */
 };
 
 struct group {
 	LIST_ENTRY(group)	 entry;
+	LIST_ENTRY(group)	 hash;
 	char		name[NEWD_MAXGROUPNAME];
+	int		shard;		/* owning engine, set by main */
 	int		yesno;
 	int		integer;
 	int		group_v4_bits;
@@ -72,13 +141,83 @@ struct group {
 	struct in6_addr	group_v6address;
 };
 
+LIST_HEAD(group_head, group);
+
+/*
+ * The groups of a config are carved out of slabs owned by that config, so
+ * they sit next to each other in memory and go away in one sweep.
+ */
+struct group_slab {
+	SLIST_ENTRY(group_slab)	 entry;
+	size_t			 size;
+	size_t			 used;
+	struct group		 groups[];
+};
+
+/* Number of struct group records that fit into one IMSG_RECONF_GROUPS. */
+#define RECONF_GROUPS_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(struct group))
+
 struct newd_conf {
 	int		yesno;
 	int		integer;
 	char		global_text[NEWD_MAXTEXT];
+	int		latency_threshold;	/* milliseconds, 0 is off */
+	int		engines;		/* 0 is one */
+	int		frontends;		/* 0 is one */
+	int		control_backlog;	/* 0 is the default */
+	int		control_queue;		/* kilobytes, 0 is default */
+	int		control_timeout;	/* seconds, 0 is default */
+	uint64_t	generation;		/* bumped by every reload */
 	LIST_HEAD(, group)	group_list;
+	struct group_head	*group_hash;
+	uint32_t		 group_hashmask;
+	uint32_t		 group_count;
+	SLIST_HEAD(, group_slab)	 group_slabs;
+	struct group_head	 group_freelist;
+	size_t			 group_capacity;
+};
+
+/*
+ * A file a config was parsed from, as it was when it was read, and what it
+ * contributed to the config. A file with none of the CONF_SRC_* flags only
+ * adds groups of its own and can be reparsed on its own.
+ */
+#define CONF_SRC_GLOBALS	0x01	/* sets global options */
+#define CONF_SRC_MACROS		0x02	/* defines macros */
+#define CONF_SRC_INCLUDES	0x04	/* includes other files */
+#define CONF_SRC_REOPENS	0x08	/* adds to a group defined earlier */
+
+struct conf_macro {
+	TAILQ_ENTRY(conf_macro)		 entry;
+	char				*nam;
+	char				*val;
+};
+
+struct conf_source {
+	TAILQ_ENTRY(conf_source)	 entry;
+	char				*path;
+	struct timespec			 mtime;
+	off_t				 size;
+	uint64_t			 hash;		/* of the contents */
+	int				 flags;
+	int				 yesno;		/* defaults for */
+	int				 integer;	/* its groups */
+	char			       (*groups)[NEWD_MAXGROUPNAME];
+	size_t				 ngroups;
+	size_t				 groupsmax;
+	TAILQ_HEAD(, conf_macro)	 macros;	/* expanded here */
 };
 
+TAILQ_HEAD(conf_sources, conf_source);
+
+/*
+ * With CTL_OPT_GENERATION a reply ends with an IMSG_CTL_GENERATION before
+ * its IMSG_CTL_END. It carries a uint64_t, the oldest generation of the
+ * configs of main, the engines and the frontend. A show request may
+ * append the generation a client last saw, and gets only an
+ * IMSG_CTL_NOT_MODIFIED with the current one if there is nothing newer.
+ */
 struct ctl_frontend_info {
 	int		yesno;
 	int		integer;
@@ -95,26 +234,204 @@ struct ctl_engine_info {
 	struct in6_addr	group_v6address;
 };
 
+/* Number of ctl_engine_info records in one IMSG_CTL_SHOW_ENGINE_INFOS. */
+#define CTL_ENGINE_INFO_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(struct ctl_engine_info))
+
+/*
+ * Pushed to subscribers once the frontend and all engines have a new
+ * config, tagged with the peerid of their IMSG_CTL_SUBSCRIBE. Unless
+ * CTL_NOTIFY_FULL is set, ngroups ctl_notify_group records follow in
+ * IMSG_CTL_NOTIFY_GROUPS for those that asked. IMSG_CTL_END ends each.
+ */
+#define CTL_NOTIFY_FULL		0x00000001	/* changes are not known */
+
+struct ctl_notify {
+	uint64_t	generation;
+	uint32_t	flags;
+	uint32_t	ngroups;	/* changed since the last one */
+};
+
+#define CTL_NOTIFY_ADD		1
+#define CTL_NOTIFY_MOD		2
+#define CTL_NOTIFY_DEL		3
+
+struct ctl_notify_group {
+	char		name[NEWD_MAXGROUPNAME];
+	int		change;		/* CTL_NOTIFY_* */
+};
+
+/* Number of ctl_notify_group records in one IMSG_CTL_NOTIFY_GROUPS. */
+#define CTL_NOTIFY_GROUPS_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(struct ctl_notify_group))
+
+#define CTL_STAT_NAMELEN	32
+
+struct ctl_stat {
+	char		name[CTL_STAT_NAMELEN];
+	uint64_t	value;
+};
+
+/* The statistics of one process, sent in a single IMSG_CTL_SHOW_STATS. */
+#define CTL_STATS_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(struct ctl_stat))
+
+struct ctl_stats {
+	struct ctl_stat	stat[CTL_STATS_MAX];
+	size_t		count;
+};
+
+/*
+ * Bucket 0 counts latencies below 1 microsecond, bucket n > 0 those from
+ * 2^(n-1) up to 2^n microseconds. The last bucket takes everything above.
+ */
+#define LATENCY_BUCKETS	24
+
+struct latency_hist {
+	uint64_t	count;
+	uint64_t	max;		/* microseconds */
+	uint64_t	bucket[LATENCY_BUCKETS];
+};
+
+struct ctl_latency {
+	char			name[CTL_STAT_NAMELEN];
+	struct latency_hist	hist;
+};
+
+#define CTL_LATENCY_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(struct ctl_latency))
+
+#define TRACE_IN		0	/* read by imsg_get_event() */
+#define TRACE_OUT		1	/* queued by imsg_compose_event() */
+
+/*
+ * One imsg seen by proc. queued is the number of buffers waiting to be
+ * written after a TRACE_OUT and the bytes left to be read after a TRACE_IN.
+ * proc and peer are PROC_*, each with the engine shard or frontend it is.
+ */
+struct trace_event {
+	uint64_t	usec;		/* CLOCK_MONOTONIC */
+	uint32_t	peerid;
+	uint32_t	queued;
+	uint16_t	type;
+	uint16_t	len;		/* payload only */
+	uint8_t		proc;
+	uint8_t		instance;
+	uint8_t		peer;
+	uint8_t		peer_instance;
+	uint8_t		dir;
+	uint8_t		pad[3];
+};
+
+#define CTL_TRACE_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(struct trace_event))
+
+struct ctl_addr {
+	int		af;
+	union {
+		struct in_addr	v4;
+		struct in6_addr	v6;
+	}		addr;
+};
+
+/*
+ * An IMSG_CTL_LOOKUP_ADDRS carries up to CTL_LOOKUP_ADDRS_MAX addresses.
+ * The answer is an IMSG_CTL_LOOKUP_GROUPS with the names of the groups
+ * that matched, then an IMSG_CTL_LOOKUP_ADDRS with a uint32_t for each
+ * address: the index of its longest match among those names, or
+ * CTL_LOOKUP_NONE.
+ */
+#define CTL_LOOKUP_ADDRS_MAX	\
+	((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / sizeof(struct ctl_addr))
+#define CTL_LOOKUP_NONE		0xffffffff
+
+/* The match of an engine for one address, bits is -1 without any. */
+struct ctl_lookup_match {
+	char		name[NEWD_MAXGROUPNAME];
+	int		bits;
+};
+
 struct ctl_main_info {
 	char		text[NEWD_MAXTEXT];
 };
 
 extern uint32_t	 cmd_opts;
+extern int	 newd_instance;	/* engine shard or frontend, 0 in main */
 
 /* newd.c */
-void	main_imsg_compose_frontend(int, pid_t, void *, uint16_t);
-void	main_imsg_compose_engine(int, pid_t, void *, uint16_t);
+void	main_imsg_compose_frontend(int, uint32_t, pid_t, void *, uint16_t);
+void	main_imsg_compose_engine(int, uint32_t, pid_t, void *, uint16_t);
 void	merge_config(struct newd_conf *, struct newd_conf *);
+struct newd_conf *main_load_config(void);
+void	main_reload_done(struct newd_conf *, struct conf_sources *, uint64_t);
 void	imsg_event_add(struct imsgev *);
+void	imsg_event_del(struct imsgev *);
 int	imsg_compose_event(struct imsgev *, uint16_t, uint32_t, pid_t,
 	    int, void *, uint16_t);
+ssize_t	imsg_get_event(struct imsgev *, struct imsg *);
+void	ctl_stats_add(struct ctl_stats *, const char *, const char *,
+	    uint64_t);
+void	ctl_stats_imsgev(struct ctl_stats *, const char *, struct imsgev *);
+void	ctl_stats_log(struct ctl_stats *, const char *);
 
 struct newd_conf       *config_new_empty(void);
+void			config_init_groups(struct newd_conf *);
 void			config_clear(struct newd_conf *);
+void			config_free_groups(struct newd_conf *);
+void			config_reserve_groups(struct newd_conf *, size_t);
+int			config_add_groups(struct newd_conf *, void *, size_t);
+void			config_copy_global(struct newd_conf *,
+			    struct newd_conf *);
+struct group	       *group_alloc(struct newd_conf *);
+void			group_free(struct newd_conf *, struct group *);
+struct group	       *group_find(struct newd_conf *, const char *);
+int			group_cmp(struct group *, struct group *);
+void			group_copy(struct group *, struct group *);
+void			group_insert(struct newd_conf *, struct group *);
+void			group_remove(struct newd_conf *, struct group *);
+int			group_shard(const char *, int);
+void			instance_name(const char *, int, char *, size_t);
+
+/* confimg.c */
+size_t			 config_image_size(struct newd_conf *,
+			    struct conf_sources *);
+void			 config_image_write(struct newd_conf *,
+			    struct conf_sources *, void *);
+struct newd_conf	*config_image_read(const void *, size_t);
+struct newd_conf	*config_image_map(int);
+int			 config_image_shm(struct newd_conf *);
+struct newd_conf	*config_cache_load(const char *, const char *);
+struct newd_conf	*config_cache_read(const char *, const char *, int *);
+int			 config_cache_write(struct newd_conf *,
+			    struct conf_sources *, const char *);
+
+/* latency.c */
+void	latency_init(void);
+void	latency_set_threshold(int);
+void	latency_begin(struct imsgev *, struct imsg *);
+void	latency_end(struct imsgev *);
+size_t	latency_fill(const char *, struct ctl_latency *, size_t);
+
+/* reload.c */
+void	reload_request(void);
+void	reload_abort(void);
+void	reload_stats(struct ctl_stats *);
+
+/* trace.c */
+void	trace_imsg(struct imsgev *, int, uint16_t, uint16_t, uint32_t);
+void	trace_compose(struct imsgev *, uint32_t, pid_t);
 
 /* printconf.c */
 void	print_config(struct newd_conf *);
 
 /* parse.y */
+extern struct conf_sources	parse_sources;
+
 struct newd_conf	*parse_config(char *);
+struct newd_conf	*parse_config_update(struct newd_conf *);
+long			 lex_config(char *);
+void			 parse_sources_clear(void);
+void			 parse_sources_set(struct conf_sources *);
+void			 sources_clear(struct conf_sources *);
+int			 check_file_secrecy(int, const char *);
 int			 cmdline_symset(char *);
@@ -24,6 +24,7 @@
 %{
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
@@ -35,11 +36,15 @@
 #include <err.h>
 #include <errno.h>
 #include <event.h>
+#include <fcntl.h>
 #include <ifaddrs.h>
 #include <imsg.h>
 #include <limits.h>
+#include <siphash.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -51,7 +56,10 @@
 TAILQ_HEAD(files, file)		 files = TAILQ_HEAD_INITIALIZER(files);
 static struct file {
 	TAILQ_ENTRY(file)	 entry;
-	FILE			*stream;
+	u_char			*map;		/* contents of the file */
+	size_t			 size;
+	size_t			 pos;		/* next byte to read */
+	int			 mapped;	/* map is mmap(2)ed */
 	char			*name;
 	size_t	 		 ungetpos;
 	size_t			 ungetsize;
@@ -59,10 +67,18 @@ static struct file {
 	int			 eof_reached;
 	int			 lineno;
 	int			 errors;
+	struct conf_source	*src;
 } *file, *topfile;
 struct file	*pushfile(const char *, int);
 int		 popfile(void);
-int		 check_file_secrecy(int, const char *);
+int		 file_load(struct file *, int);
+void		 file_unload(struct file *);
+int		 source_add(struct file *, int);
+void		 source_add_group(const char *);
+void		 source_add_macro(const char *, const char *);
+void		 source_free(struct conf_source *);
+int		 source_changed(struct conf_source *);
+struct conf_source *source_reparse(struct conf_source *, struct newd_conf *);
 int		 yyparse(void);
 int		 yylex(void);
 int		 yyerror(const char *, ...)
@@ -73,19 +89,47 @@ int		 lookup(char *);
 int		 igetc(void);
 int		 lgetc(int);
 void		 lungetc(int);
+size_t		 lexfast(unsigned char *, size_t, int);
 int		 findeol(void);
 
+/*
+ * Every file read by the last successful parse_config(), the main file
+ * first. Files being read are added to sources_target.
+ */
+struct conf_sources	 parse_sources = TAILQ_HEAD_INITIALIZER(parse_sources);
+static struct conf_sources	*sources_target = &parse_sources;
+static const SIPHASH_KEY	 source_hashkey;
+static int			 quiet;	/* count errors without logging */
+
+/*
+ * Macros are kept on symhead in the order they were defined and hashed by
+ * name into symhash, which grows to keep at most one macro per bucket.
+ */
 TAILQ_HEAD(symhead, sym)	 symhead = TAILQ_HEAD_INITIALIZER(symhead);
 struct sym {
 	TAILQ_ENTRY(sym)	 entry;
+	LIST_ENTRY(sym)		 hash;
+	struct conf_source	*recorded;	/* last file it was noted in */
 	int			 used;
 	int			 persist;
 	char			*nam;
 	char			*val;
 };
 
-int	 symset(const char *, const char *, int);
-char	*symget(const char *);
+#define SYM_HASH_MIN	64
+#define SYM_HASH(n)	\
+	(&symhash[SipHash24(&sym_hashkey, (n), strlen(n)) & symhashmask])
+
+static LIST_HEAD(, sym)	*symhash;
+static uint32_t		 symhashmask;
+static uint32_t		 symcount;
+static SIPHASH_KEY	 sym_hashkey;
+
+int		 symset(const char *, const char *, int);
+char		*symget(const char *);
+struct sym	*symfind(const char *);
+void		 symremove(struct sym *);
+int		 symhash_grow(void);
 
 void	 clear_config(struct newd_conf *xconf);
 
@@ -109,6 +153,8 @@ typedef struct {
 
 %token	GROUP YES NO INCLUDE ERROR
 %token	YESNO INTEGER
+%token	LATENCY_THRESHOLD ENGINES FRONTENDS
+%token	CONTROL_BACKLOG CONTROL_QUEUE CONTROL_TIMEOUT
 %token	GLOBAL_TEXT
 %token	GROUP_V4ADDRESS GROUP_V6ADDRESS
 
@@ -131,6 +177,7 @@ grammar		: /* empty */
 include		: INCLUDE STRING		{
 			struct file	*nfile;
 
+			file->src->flags |= CONF_SRC_INCLUDES;
 			if ((nfile = pushfile($2, 1)) == NULL) {
 				yyerror("failed to include file %s", $2);
 				free($2);
@@ -175,6 +222,7 @@ varset		: STRING '=' string		{
 			}
 			if (symset($1, $3, 0) == -1)
 				fatal("cannot store variable");
+			file->src->flags |= CONF_SRC_MACROS;
 			free($1);
 			free($3);
 		}
@@ -182,19 +230,76 @@ varset		: STRING '=' string		{
 
 conf_main	: YESNO yesno {
 			conf->yesno = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
 		}
 		| INTEGER NUMBER {
 			conf->integer = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
+		}
+		| LATENCY_THRESHOLD NUMBER {
+			if ($2 < 0 || $2 > INT_MAX / 1000) {
+				yyerror("invalid latency-threshold: %lld",
+				    (long long)$2);
+				YYERROR;
+			}
+			conf->latency_threshold = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
+		}
+		| ENGINES NUMBER {
+			if ($2 < 1 || $2 > NEWD_MAXENGINES) {
+				yyerror("invalid engines: %lld",
+				    (long long)$2);
+				YYERROR;
+			}
+			conf->engines = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
+		}
+		| FRONTENDS NUMBER {
+			if ($2 < 1 || $2 > NEWD_MAXFRONTENDS) {
+				yyerror("invalid frontends: %lld",
+				    (long long)$2);
+				YYERROR;
+			}
+			conf->frontends = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
+		}
+		| CONTROL_BACKLOG NUMBER {
+			if ($2 < 1 || $2 > 65535) {
+				yyerror("invalid control-backlog: %lld",
+				    (long long)$2);
+				YYERROR;
+			}
+			conf->control_backlog = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
+		}
+		| CONTROL_QUEUE NUMBER {
+			if ($2 < 1 || $2 > 1024 * 1024) {
+				yyerror("invalid control-queue: %lld",
+				    (long long)$2);
+				YYERROR;
+			}
+			conf->control_queue = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
+		}
+		| CONTROL_TIMEOUT NUMBER {
+			if ($2 < 1 || $2 > 86400) {
+				yyerror("invalid control-timeout: %lld",
+				    (long long)$2);
+				YYERROR;
+			}
+			conf->control_timeout = $2;
+			file->src->flags |= CONF_SRC_GLOBALS;
 		}
 		| GLOBAL_TEXT STRING {
 			size_t n;
+			file->src->flags |= CONF_SRC_GLOBALS;
 			memset(conf->global_text, 0,
 			    sizeof(conf->global_text));
 			n = strlcpy(conf->global_text, $2,
 			    sizeof(conf->global_text));
+			free($2);
 			if (n >= sizeof(conf->global_text)) {
 				yyerror("error parsing global_text: too long");
-				free($2);
 				YYERROR;
 			}
 		}
@@ -208,6 +313,7 @@ nl		: '\n' optnl		/* one or more newlines */
 
 group		: GROUP STRING {
 			group = conf_get_group($2);
+			free($2);
 		} '{' optnl groupopts_l '}' {
 			group = NULL;
 		}
@@ -223,9 +329,9 @@ groupoptsl	: GROUP_V4ADDRESS STRING {
 			group->group_v4_bits = inet_net_pton(AF_INET, $2,
 			    &group->group_v4address,
 			    sizeof(group->group_v4address));
+			free($2);
 			if (group->group_v4_bits == -1) {
 				yyerror("error parsing group_v4address");
-				free($2);
 				YYERROR;
 			}
 		}
@@ -235,9 +341,9 @@ groupoptsl	: GROUP_V4ADDRESS STRING {
 			group->group_v6_bits = inet_net_pton(AF_INET6, $2,
 			    &group->group_v6address,
 			    sizeof(group->group_v6address));
+			free($2);
 			if (group->group_v6_bits == -1) {
 				yyerror("error parsing group_v6address");
-				free($2);
 				YYERROR;
 			}
 		}
@@ -263,6 +369,8 @@ yyerror(const char *fmt, ...)
 	char		*msg;
 
 	file->errors++;
+	if (quiet)
+		return (0);
 	va_start(ap, fmt);
 	if (vasprintf(&msg, fmt, ap) == -1)
 		fatalx("yyerror vasprintf");
@@ -283,12 +391,18 @@ lookup(char *s)
 {
 	/* This has to be sorted always. */
 	static const struct keywords keywords[] = {
+		{"control-backlog",	CONTROL_BACKLOG},
+		{"control-queue",	CONTROL_QUEUE},
+		{"control-timeout",	CONTROL_TIMEOUT},
+		{"engines",		ENGINES},
+		{"frontends",		FRONTENDS},
 		{"global-text",		GLOBAL_TEXT},
 		{"group",		GROUP},
 		{"group-v4address",	GROUP_V4ADDRESS},
 		{"group-v6address",	GROUP_V6ADDRESS},
 		{"include",		INCLUDE},
 		{"integer",		INTEGER},
+		{"latency-threshold",	LATENCY_THRESHOLD},
 		{"no",			NO},
 		{"yes",			YES},
 		{"yesno",		YESNO}
@@ -317,8 +431,10 @@ igetc(void)
 	while (1) {
 		if (file->ungetpos > 0)
 			c = file->ungetbuf[--file->ungetpos];
+		else if (file->pos < file->size)
+			c = file->map[file->pos++];
 		else
-			c = getc(file->stream);
+			c = EOF;
 
 		if (c == START_EXPAND)
 			expanding = 1;
@@ -507,6 +623,7 @@ top:
 				yyerror("string too long");
 				return (findeol());
 			}
+			p += lexfast(p, buf + sizeof(buf) - 1 - p, 1);
 		} while ((c = lgetc(0)) != EOF && isdigit(c));
 		lungetc(c);
 		if (p == buf + 1 && buf[0] == '-')
@@ -546,6 +663,7 @@ nodigits:
 				yyerror("string too long");
 				return (findeol());
 			}
+			p += lexfast(p, buf + sizeof(buf) - 1 - p, 0);
 		} while ((c = lgetc(0)) != EOF && (allowed_in_string(c)));
 		lungetc(c);
 		*p = '\0';
@@ -563,6 +681,37 @@ nodigits:
 	return (c);
 }
 
+/*
+ * Copy the rest of an unquoted string, or of a number if digits is set,
+ * of at most room bytes straight from the current file to p and return
+ * its length. Only input lgetc() would pass through unchanged is taken:
+ * nothing is copied while there is pushed back input, and a backslash
+ * ends the run.
+ */
+size_t
+lexfast(unsigned char *p, size_t room, int digits)
+{
+	const u_char	*s, *e, *q;
+	size_t		 n;
+
+	if (file->ungetpos > 0)
+		return (0);
+
+	s = file->map + file->pos;
+	n = file->size - file->pos;
+	e = s + (n < room ? n : room);
+	for (q = s; q < e; q++) {
+		if (digits ? !isdigit(*q) :
+		    *q == '\\' || !allowed_in_string(*q))
+			break;
+	}
+
+	n = q - s;
+	memcpy(p, s, n);
+	file->pos += n;
+	return (n);
+}
+
 int
 check_file_secrecy(int fd, const char *fname)
 {
@@ -583,10 +732,181 @@ check_file_secrecy(int fd, const char *fname)
 	return (0);
 }
 
+/*
+ * Make the contents of fd available as f->map. Regular files are mapped,
+ * anything else is read into memory.
+ */
+int
+file_load(struct file *f, int fd)
+{
+	struct stat	 st;
+	u_char		*p;
+	size_t		 len = 0, size = 0;
+	ssize_t		 n;
+
+	if (fstat(fd, &st) == -1) {
+		log_warn("cannot stat %s", f->name);
+		return (-1);
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		if ((uintmax_t)st.st_size > SIZE_MAX) {
+			log_warnx("%s: file too large", f->name);
+			return (-1);
+		}
+		f->size = st.st_size;
+		f->map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (f->map == MAP_FAILED) {
+			log_warn("%s: mmap", f->name);
+			f->map = NULL;
+			return (-1);
+		}
+		(void)madvise(f->map, f->size, MADV_SEQUENTIAL);
+		f->mapped = 1;
+		return (0);
+	}
+
+	for (;;) {
+		if (len == size) {
+			size = size ? size * 2 : 65536;
+			if ((p = realloc(f->map, size)) == NULL) {
+				log_warn("%s", __func__);
+				return (-1);
+			}
+			f->map = p;
+		}
+		if ((n = read(fd, f->map + len, size - len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_warn("%s: read", f->name);
+			return (-1);
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	f->size = len;
+	return (0);
+}
+
+void
+file_unload(struct file *f)
+{
+	if (f->mapped)
+		munmap(f->map, f->size);
+	else
+		free(f->map);
+	f->map = NULL;
+}
+
+int
+source_add(struct file *f, int fd)
+{
+	struct conf_source	*src;
+	struct stat		 st;
+
+	if (fstat(fd, &st) == -1) {
+		log_warn("cannot stat %s", f->name);
+		return (-1);
+	}
+	if ((src = calloc(1, sizeof(*src))) == NULL ||
+	    (src->path = strdup(f->name)) == NULL) {
+		log_warn("%s", __func__);
+		free(src);
+		return (-1);
+	}
+	src->mtime = st.st_mtim;
+	src->size = st.st_size;
+	src->hash = SipHash24(&source_hashkey, f->map, f->size);
+	src->yesno = conf->yesno;
+	src->integer = conf->integer;
+	TAILQ_INIT(&src->macros);
+	TAILQ_INSERT_TAIL(sources_target, src, entry);
+	f->src = src;
+	return (0);
+}
+
+/*
+ * Note that the group name was created by the current file.
+ */
+void
+source_add_group(const char *name)
+{
+	struct conf_source	*src = file->src;
+	void			*p;
+
+	if (src->ngroups == src->groupsmax) {
+		if ((p = reallocarray(src->groups, src->groupsmax ?
+		    src->groupsmax * 2 : 16, sizeof(*src->groups))) == NULL)
+			fatal(NULL);
+		src->groups = p;
+		src->groupsmax = src->groupsmax ? src->groupsmax * 2 : 16;
+	}
+	strlcpy(src->groups[src->ngroups++], name, sizeof(*src->groups));
+}
+
+/*
+ * Note that the current file expanded macro nam to val.
+ */
+void
+source_add_macro(const char *nam, const char *val)
+{
+	struct conf_macro	*m;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL ||
+	    (m->nam = strdup(nam)) == NULL ||
+	    (m->val = strdup(val)) == NULL)
+		fatal(NULL);
+	TAILQ_INSERT_TAIL(&file->src->macros, m, entry);
+}
+
+void
+source_free(struct conf_source *src)
+{
+	struct conf_macro	*m;
+
+	while ((m = TAILQ_FIRST(&src->macros)) != NULL) {
+		TAILQ_REMOVE(&src->macros, m, entry);
+		free(m->nam);
+		free(m->val);
+		free(m);
+	}
+	free(src->groups);
+	free(src->path);
+	free(src);
+}
+
+void
+sources_clear(struct conf_sources *sources)
+{
+	struct conf_source	*src;
+
+	while ((src = TAILQ_FIRST(sources)) != NULL) {
+		TAILQ_REMOVE(sources, src, entry);
+		source_free(src);
+	}
+}
+
+void
+parse_sources_clear(void)
+{
+	sources_clear(&parse_sources);
+}
+
+/*
+ * Replace parse_sources with the contents of sources, which is left empty.
+ */
+void
+parse_sources_set(struct conf_sources *sources)
+{
+	sources_clear(&parse_sources);
+	TAILQ_CONCAT(&parse_sources, sources, entry);
+}
+
 struct file *
 pushfile(const char *name, int secret)
 {
 	struct file	*nfile;
+	int		 fd;
 
 	if ((nfile = calloc(1, sizeof(struct file))) == NULL) {
 		log_warn("%s", __func__);
@@ -597,24 +917,26 @@ pushfile(const char *name, int secret)
 		free(nfile);
 		return (NULL);
 	}
-	if ((nfile->stream = fopen(nfile->name, "r")) == NULL) {
+	if ((fd = open(nfile->name, O_RDONLY)) == -1) {
 		log_warn("%s: %s", __func__, nfile->name);
 		free(nfile->name);
 		free(nfile);
 		return (NULL);
-	} else if (secret &&
-	    check_file_secrecy(fileno(nfile->stream), nfile->name)) {
-		fclose(nfile->stream);
+	} else if ((secret && check_file_secrecy(fd, nfile->name)) ||
+	    file_load(nfile, fd) == -1 || source_add(nfile, fd) == -1) {
+		close(fd);
+		file_unload(nfile);
 		free(nfile->name);
 		free(nfile);
 		return (NULL);
 	}
+	close(fd);
 	nfile->lineno = TAILQ_EMPTY(&files) ? 1 : 0;
 	nfile->ungetsize = 16;
 	nfile->ungetbuf = malloc(nfile->ungetsize);
 	if (nfile->ungetbuf == NULL) {
 		log_warn("%s", __func__);
-		fclose(nfile->stream);
+		file_unload(nfile);
 		free(nfile->name);
 		free(nfile);
 		return (NULL);
@@ -632,7 +954,7 @@ popfile(void)
 		prev->errors += file->errors;
 
 	TAILQ_REMOVE(&files, file, entry);
-	fclose(file->stream);
+	file_unload(file);
 	free(file->name);
 	free(file->ungetbuf);
 	free(file);
@@ -643,12 +965,15 @@ popfile(void)
 struct newd_conf *
 parse_config(char *filename)
 {
-	struct sym	*sym, *next;
+	struct conf_sources	 sources = TAILQ_HEAD_INITIALIZER(sources);
+	struct sym		*sym, *next;
 
 	conf = config_new_empty();
+	sources_target = &sources;
 
 	file = pushfile(filename, !(cmd_opts & OPT_NOACTION));
 	if (file == NULL) {
+		sources_target = &parse_sources;
 		free(conf);
 		return (NULL);
 	}
@@ -657,48 +982,255 @@ parse_config(char *filename)
 	yyparse();
 	errors = file->errors;
 	popfile();
+	sources_target = &parse_sources;
 
 	/* Free macros and check which have not been used. */
 	TAILQ_FOREACH_SAFE(sym, &symhead, entry, next) {
 		if ((cmd_opts & OPT_VERBOSE2) && !sym->used)
 			fprintf(stderr, "warning: macro '%s' not used\n",
 			    sym->nam);
-		if (!sym->persist) {
-			free(sym->nam);
-			free(sym->val);
-			TAILQ_REMOVE(&symhead, sym, entry);
-			free(sym);
-		}
+		if (!sym->persist)
+			symremove(sym);
 	}
 
 	if (errors) {
+		sources_clear(&sources);
 		clear_config(conf);
 		return (NULL);
 	}
 
+	sources_clear(&parse_sources);
+	TAILQ_CONCAT(&parse_sources, &sources, entry);
 	return (conf);
 }
 
+/*
+ * Run only the lexer over filename, as parse_config() would read it, and
+ * return the number of tokens or -1. Included files are not followed.
+ */
+long
+lex_config(char *filename)
+{
+	struct conf_sources	 sources = TAILQ_HEAD_INITIALIZER(sources);
+	long			 n = 0;
+	int			 token;
+
+	/* The file is recorded with the defaults of conf. */
+	conf = config_new_empty();
+	sources_target = &sources;
+
+	file = pushfile(filename, !(cmd_opts & OPT_NOACTION));
+	if (file == NULL) {
+		sources_target = &parse_sources;
+		clear_config(conf);
+		return (-1);
+	}
+	topfile = file;
+
+	while ((token = yylex()) != 0) {
+		if (token == STRING)
+			free(yylval.v.string);
+		n++;
+	}
+	errors = file->errors;
+	popfile();
+	sources_target = &parse_sources;
+	sources_clear(&sources);
+	clear_config(conf);
+
+	return (errors ? -1 : n);
+}
+
+/*
+ * Return 1 if src has been modified since it was read, 0 if not and -1 if
+ * it cannot be read anymore. Files that were only touched are updated.
+ */
 int
-symset(const char *nam, const char *val, int persist)
+source_changed(struct conf_source *src)
 {
-	struct sym	*sym;
+	struct file	 f;
+	struct stat	 st;
+	uint64_t	 hash;
+	int		 fd;
 
-	TAILQ_FOREACH(sym, &symhead, entry) {
-		if (strcmp(nam, sym->nam) == 0)
-			break;
+	if (stat(src->path, &st) == -1)
+		return (-1);
+	if (st.st_mtim.tv_sec == src->mtime.tv_sec &&
+	    st.st_mtim.tv_nsec == src->mtime.tv_nsec &&
+	    st.st_size == src->size)
+		return (0);
+
+	if ((fd = open(src->path, O_RDONLY)) == -1)
+		return (-1);
+	memset(&f, 0, sizeof(f));
+	f.name = src->path;
+	if (fstat(fd, &st) == -1 || file_load(&f, fd) == -1) {
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+	hash = SipHash24(&source_hashkey, f.map, f.size);
+	file_unload(&f);
+
+	if (hash != src->hash)
+		return (1);
+	src->mtime = st.st_mtim;
+	src->size = st.st_size;
+	return (0);
+}
+
+/*
+ * Parse src again on its own, adding its groups to xconf, and return its
+ * new source record or NULL if it now does more than define groups of its
+ * own or fails to parse. src is read with the defaults and macros it saw
+ * when it was included the last time.
+ */
+struct conf_source *
+source_reparse(struct conf_source *src, struct newd_conf *xconf)
+{
+	struct conf_sources	 sources = TAILQ_HEAD_INITIALIZER(sources);
+	struct conf_source	*nsrc;
+	struct conf_macro	*m;
+	struct sym		*sym, *next;
+	int			 rv = -1;
+
+	TAILQ_FOREACH(m, &src->macros, entry)
+		if (symset(m->nam, m->val, 0) == -1)
+			fatal("cannot store variable");
+
+	conf = xconf;
+	conf->yesno = src->yesno;
+	conf->integer = src->integer;
+	sources_target = &sources;
+	quiet = 1;
+
+	if ((file = pushfile(src->path, 1)) != NULL) {
+		topfile = file;
+		yyparse();
+		errors = file->errors;
+		popfile();
+
+		nsrc = TAILQ_FIRST(&sources);
+		if (errors == 0 && nsrc->flags == 0 &&
+		    TAILQ_NEXT(nsrc, entry) == NULL)
+			rv = 0;
+	}
+
+	quiet = 0;
+	sources_target = &parse_sources;
+	TAILQ_FOREACH_SAFE(sym, &symhead, entry, next)
+		if (!sym->persist)
+			symremove(sym);
+
+	if (rv == -1) {
+		sources_clear(&sources);
+		return (NULL);
+	}
+	TAILQ_REMOVE(&sources, nsrc, entry);
+	return (nsrc);
+}
+
+/*
+ * Build the config that parse_config() would return now from cur, which
+ * must be the result of the last successful parse, by parsing again only
+ * the files that have changed since. Returns NULL if that is not possible
+ * and the whole config has to be parsed.
+ */
+struct newd_conf *
+parse_config_update(struct newd_conf *cur)
+{
+	struct conf_source	*src, **changed, **fresh;
+	struct newd_conf	*xconf = NULL;
+	struct group		*g, *xg;
+	size_t			 i, j, n = 0, nsources = 0;
+	int			 rv;
+
+	if (cur == NULL || TAILQ_EMPTY(&parse_sources))
+		return (NULL);
+
+	TAILQ_FOREACH(src, &parse_sources, entry) {
+		if (src->flags & CONF_SRC_REOPENS)
+			return (NULL);
+		nsources++;
+	}
+	if ((changed = calloc(nsources, sizeof(*changed))) == NULL ||
+	    (fresh = calloc(nsources, sizeof(*fresh))) == NULL)
+		fatal(NULL);
+
+	TAILQ_FOREACH(src, &parse_sources, entry) {
+		if ((rv = source_changed(src)) == -1)
+			goto fail;
+		if (rv == 0)
+			continue;
+		/* Only files adding groups of their own can be replaced. */
+		if (src == TAILQ_FIRST(&parse_sources) || src->flags != 0)
+			goto fail;
+		changed[n++] = src;
+	}
+
+	/* Start from cur without the groups of the changed files. */
+	xconf = config_new_empty();
+	config_reserve_groups(xconf, cur->group_count);
+	LIST_FOREACH(g, &cur->group_list, entry) {
+		xg = group_alloc(xconf);
+		group_copy(xg, g);
+		group_insert(xconf, xg);
+	}
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < changed[i]->ngroups; j++) {
+			if ((g = group_find(xconf, changed[i]->groups[j])) ==
+			    NULL)
+				continue;
+			group_remove(xconf, g);
+			group_free(xconf, g);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((fresh[i] = source_reparse(changed[i], xconf)) == NULL) {
+			log_debug("%s: %s cannot be reparsed on its own",
+			    __func__, changed[i]->path);
+			goto fail;
+		}
+	}
+	config_copy_global(xconf, cur);
+
+	for (i = 0; i < n; i++) {
+		TAILQ_INSERT_BEFORE(changed[i], fresh[i], entry);
+		TAILQ_REMOVE(&parse_sources, changed[i], entry);
+		source_free(changed[i]);
 	}
+	free(changed);
+	free(fresh);
+
+	log_debug("%s: reparsed %zu of %zu files", __func__, n, nsources);
+	return (xconf);
+
+fail:
+	for (i = 0; i < n; i++)
+		if (fresh[i] != NULL)
+			source_free(fresh[i]);
+	if (xconf != NULL)
+		clear_config(xconf);
+	free(changed);
+	free(fresh);
+	return (NULL);
+}
+
+int
+symset(const char *nam, const char *val, int persist)
+{
+	struct sym	*sym;
 
-	if (sym != NULL) {
+	if ((sym = symfind(nam)) != NULL) {
 		if (sym->persist == 1)
 			return (0);
-		else {
-			free(sym->nam);
-			free(sym->val);
-			TAILQ_REMOVE(&symhead, sym, entry);
-			free(sym);
-		}
+		else
+			symremove(sym);
 	}
+	if (symcount >= (symhash == NULL ? 0 : symhashmask + 1) &&
+	    symhash_grow() == -1)
+		return (-1);
 	if ((sym = calloc(1, sizeof(*sym))) == NULL)
 		return (-1);
 
@@ -716,6 +1248,8 @@ symset(const char *nam, const char *val, int persist)
 	sym->used = 0;
 	sym->persist = persist;
 	TAILQ_INSERT_TAIL(&symhead, sym, entry);
+	LIST_INSERT_HEAD(SYM_HASH(sym->nam), sym, hash);
+	symcount++;
 	return (0);
 }
 
@@ -746,38 +1280,93 @@ symget(const char *nam)
 {
 	struct sym	*sym;
 
-	TAILQ_FOREACH(sym, &symhead, entry) {
-		if (strcmp(nam, sym->nam) == 0) {
-			sym->used = 1;
-			return (sym->val);
-		}
+	if ((sym = symfind(nam)) == NULL)
+		return (NULL);
+	sym->used = 1;
+	if (sym->recorded != file->src) {
+		source_add_macro(sym->nam, sym->val);
+		sym->recorded = file->src;
+	}
+	return (sym->val);
+}
+
+struct sym *
+symfind(const char *nam)
+{
+	struct sym	*sym;
+
+	if (symhash == NULL)
+		return (NULL);
+
+	LIST_FOREACH(sym, SYM_HASH(nam), hash) {
+		if (strcmp(nam, sym->nam) == 0)
+			return (sym);
 	}
 	return (NULL);
 }
 
+void
+symremove(struct sym *sym)
+{
+	TAILQ_REMOVE(&symhead, sym, entry);
+	LIST_REMOVE(sym, hash);
+	symcount--;
+	free(sym->nam);
+	free(sym->val);
+	free(sym);
+}
+
+/*
+ * Double the number of buckets of symhash and rehash all macros.
+ */
+int
+symhash_grow(void)
+{
+	struct sym	*sym;
+	uint32_t	 i, size;
+	void		*p;
+
+	if (symhash == NULL) {
+		arc4random_buf(&sym_hashkey, sizeof(sym_hashkey));
+		size = SYM_HASH_MIN;
+	} else
+		size = (symhashmask + 1) * 2;
+
+	if ((p = reallocarray(NULL, size, sizeof(*symhash))) == NULL)
+		return (-1);
+	free(symhash);
+	symhash = p;
+	symhashmask = size - 1;
+	for (i = 0; i < size; i++)
+		LIST_INIT(&symhash[i]);
+
+	TAILQ_FOREACH(sym, &symhead, entry)
+		LIST_INSERT_HEAD(SYM_HASH(sym->nam), sym, hash);
+	return (0);
+}
+
 struct group *
 conf_get_group(char *name)
 {
 	struct group	*g;
 	size_t		n;
 
-	LIST_FOREACH(g, &conf->group_list, entry) {
-		if (strcmp(name, g->name) == 0)
-			return (g);
+	if ((g = group_find(conf, name)) != NULL) {
+		file->src->flags |= CONF_SRC_REOPENS;
+		return (g);
 	}
 
-	g = calloc(1, sizeof(*g));
-	if (g == NULL)
-		errx(1, "get_group: calloc");
+	g = group_alloc(conf);
 	n = strlcpy(g->name, name, sizeof(g->name));
 	if (n >= sizeof(g->name))
 		errx(1, "get_group: name too long");
+	source_add_group(g->name);
 
 	/* Inherit attributes set in global section. */
 	g->yesno = conf->yesno;
 	g->integer = conf->integer;
 
-	LIST_INSERT_HEAD(&conf->group_list, g, entry);
+	group_insert(conf, g);
 
 	return (g);
 }
@@ -785,12 +1374,6 @@ conf_get_group(char *name)
 void
 clear_config(struct newd_conf *xconf)
 {
-	struct group	*g;
-
-	while ((g = LIST_FIRST(&xconf->group_list)) != NULL) {
-		LIST_REMOVE(g, entry);
-		free(g);
-	}
-
+	config_free_groups(xconf);
 	free(xconf);
 }
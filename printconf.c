@@ -38,6 +38,18 @@ print_config(struct newd_conf *conf)
 
 	printf("yesno %s\n", conf->yesno ? "yes" : "no");
 	printf("integer %d\n", conf->integer);
+	if (conf->latency_threshold != 0)
+		printf("latency-threshold %d\n", conf->latency_threshold);
+	if (conf->engines != 0)
+		printf("engines %d\n", conf->engines);
+	if (conf->frontends != 0)
+		printf("frontends %d\n", conf->frontends);
+	if (conf->control_backlog != 0)
+		printf("control-backlog %d\n", conf->control_backlog);
+	if (conf->control_queue != 0)
+		printf("control-queue %d\n", conf->control_queue);
+	if (conf->control_timeout != 0)
+		printf("control-timeout %d\n", conf->control_timeout);
 	printf("\n");
 
 	printf("global_text \"%s\"\n", conf->global_text);
@@ -0,0 +1,436 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reloads load the new config in a forked helper, so main keeps serving
+ * the engine and frontend meanwhile. The helper sends back the sources
+ * the config was parsed from, then the config as a config image, and
+ * exits. A reload requested while a helper is running is folded into one
+ * more reload, started as soon as the running one is done.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "newd.h"
+
+#define RELOAD_CHUNK	(MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+
+/* Fixed part of a struct conf_source, sent as IMSG_RELOAD_SOURCE. */
+struct reload_source {
+	char		path[PATH_MAX];
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	int64_t		size;
+	uint64_t	hash;
+	int32_t		flags;
+	int32_t		yesno;
+	int32_t		integer;
+};
+
+__dead void	reload_helper(int);
+void		reload_start(void);
+void		reload_dispatch(int, short, void *);
+void		reload_finish(void);
+void		reload_add_source(struct imsg *);
+void		reload_add_groups(struct imsg *);
+void		reload_add_macro(struct imsg *);
+void		reload_add_image(struct imsg *);
+
+struct imsgev		*iev_reload;
+pid_t			 reload_pid = -1;
+int			 reload_pending;	/* another reload is due */
+int			 reload_complete;	/* IMSG_RELOAD_END seen */
+struct timespec		 reload_started;
+struct conf_sources	 reload_sources =
+			    TAILQ_HEAD_INITIALIZER(reload_sources);
+u_char			*reload_image;
+size_t			 reload_imagelen, reload_imagesize;
+
+struct {
+	uint64_t	helpers;
+	uint64_t	coalesced;
+} reload_stats_counters;
+
+/*
+ * Reload the config, or note that it has to be reloaded once more if a
+ * reload is already under way.
+ */
+void
+reload_request(void)
+{
+	if (reload_pid != -1) {
+		if (!reload_pending)
+			log_debug("%s: reload already running", __func__);
+		reload_pending = 1;
+		reload_stats_counters.coalesced++;
+		return;
+	}
+	reload_start();
+}
+
+void
+reload_start(void)
+{
+	int	fds[2];
+
+	clock_gettime(CLOCK_MONOTONIC, &reload_started);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, PF_UNSPEC,
+	    fds) == -1) {
+		log_warn("%s: socketpair", __func__);
+		main_reload_done(NULL, &reload_sources, 0);
+		return;
+	}
+
+	switch (reload_pid = fork()) {
+	case -1:
+		log_warn("%s: fork", __func__);
+		close(fds[0]);
+		close(fds[1]);
+		main_reload_done(NULL, &reload_sources, 0);
+		return;
+	case 0:
+		close(fds[0]);
+		reload_helper(fds[1]);
+		/* NOTREACHED */
+	}
+	close(fds[1]);
+	reload_stats_counters.helpers++;
+
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1)
+		fatal("%s: fcntl", __func__);
+	if ((iev_reload = calloc(1, sizeof(struct imsgev))) == NULL)
+		fatal(NULL);
+	imsg_init(&iev_reload->ibuf, fds[0]);
+	iev_reload->handler = reload_dispatch;
+	iev_reload->peer = PROC_RELOAD;
+	iev_reload->events = EV_READ;
+	event_set(&iev_reload->ev, iev_reload->ibuf.fd, iev_reload->events,
+	    iev_reload->handler, iev_reload);
+	event_add(&iev_reload->ev, NULL);
+}
+
+/*
+ * Stop a running helper. Called when main shuts down.
+ */
+void
+reload_abort(void)
+{
+	if (reload_pid == -1)
+		return;
+
+	kill(reload_pid, SIGTERM);
+	while (waitpid(reload_pid, NULL, 0) == -1 && errno == EINTR)
+		;
+	reload_pid = -1;
+}
+
+void
+reload_stats(struct ctl_stats *st)
+{
+	ctl_stats_add(st, "main", "reload_helpers",
+	    reload_stats_counters.helpers);
+	ctl_stats_add(st, "main", "reloads_coalesced",
+	    reload_stats_counters.coalesced);
+}
+
+/*
+ * Body of the helper. Everything is written with blocking writes, the
+ * exit status does not matter: main only takes a config followed by
+ * IMSG_RELOAD_END.
+ */
+__dead void
+reload_helper(int fd)
+{
+	struct imsgbuf		 ibuf;
+	struct reload_source	 rs;
+	struct conf_source	*src;
+	struct conf_macro	*m;
+	struct newd_conf	*xconf;
+	char			 buf[RELOAD_CHUNK];
+	u_char			*image;
+	size_t			 len, off, n, nam, val;
+
+	/*
+	 * The inherited libevent handlers would forward signals to main
+	 * through its signal socket.
+	 */
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	log_fork();
+	newd_process = PROC_RELOAD;
+	setproctitle("%s", log_procnames[newd_process]);
+	if (pledge("stdio rpath", NULL) == -1)
+		fatal("pledge");
+	imsg_init(&ibuf, fd);
+
+	if ((xconf = main_load_config()) == NULL)
+		_exit(1);
+
+	TAILQ_FOREACH(src, &parse_sources, entry) {
+		memset(&rs, 0, sizeof(rs));
+		strlcpy(rs.path, src->path, sizeof(rs.path));
+		rs.mtime_sec = src->mtime.tv_sec;
+		rs.mtime_nsec = src->mtime.tv_nsec;
+		rs.size = src->size;
+		rs.hash = src->hash;
+		rs.flags = src->flags;
+		rs.yesno = src->yesno;
+		rs.integer = src->integer;
+		if (imsg_compose(&ibuf, IMSG_RELOAD_SOURCE, 0, 0, -1, &rs,
+		    sizeof(rs)) == -1 || imsg_flush(&ibuf) == -1)
+			_exit(1);
+
+		for (off = 0; off < src->ngroups; off += n) {
+			n = src->ngroups - off;
+			if (n > RELOAD_CHUNK / sizeof(*src->groups))
+				n = RELOAD_CHUNK / sizeof(*src->groups);
+			if (imsg_compose(&ibuf, IMSG_RELOAD_GROUPS, 0, 0, -1,
+			    src->groups[off], n * sizeof(*src->groups)) == -1 ||
+			    imsg_flush(&ibuf) == -1)
+				_exit(1);
+		}
+
+		TAILQ_FOREACH(m, &src->macros, entry) {
+			nam = strlen(m->nam) + 1;
+			val = strlen(m->val) + 1;
+			if (nam + val > sizeof(buf))
+				_exit(1);
+			memcpy(buf, m->nam, nam);
+			memcpy(buf + nam, m->val, val);
+			if (imsg_compose(&ibuf, IMSG_RELOAD_MACRO, 0, 0, -1,
+			    buf, nam + val) == -1 || imsg_flush(&ibuf) == -1)
+				_exit(1);
+		}
+	}
+
+	len = config_image_size(xconf, NULL);
+	if ((image = malloc(len)) == NULL)
+		_exit(1);
+	config_image_write(xconf, NULL, image);
+	for (off = 0; off < len; off += n) {
+		n = len - off < RELOAD_CHUNK ? len - off : RELOAD_CHUNK;
+		if (imsg_compose(&ibuf, IMSG_RELOAD_IMAGE, 0, 0, -1,
+		    image + off, n) == -1 || imsg_flush(&ibuf) == -1)
+			_exit(1);
+	}
+
+	if (imsg_compose(&ibuf, IMSG_RELOAD_END, 0, 0, -1, NULL, 0) == -1 ||
+	    imsg_flush(&ibuf) == -1)
+		_exit(1);
+	_exit(0);
+}
+
+void
+reload_dispatch(int fd, short event, void *bula)
+{
+	struct imsgev		*iev = bula;
+	struct imsgbuf		*ibuf = &iev->ibuf;
+	struct imsg		 imsg;
+	ssize_t			 n;
+	int			 shut = 0;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read error");
+		if (n == 0)	/* Connection closed. */
+			shut = 1;
+	}
+
+	for (;;) {
+		if ((n = imsg_get_event(iev, &imsg)) == -1)
+			fatal("%s: imsg_get error", __func__);
+		if (n == 0)	/* No more messages. */
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_RELOAD_SOURCE:
+			reload_add_source(&imsg);
+			break;
+		case IMSG_RELOAD_GROUPS:
+			reload_add_groups(&imsg);
+			break;
+		case IMSG_RELOAD_MACRO:
+			reload_add_macro(&imsg);
+			break;
+		case IMSG_RELOAD_IMAGE:
+			reload_add_image(&imsg);
+			break;
+		case IMSG_RELOAD_END:
+			reload_complete = 1;
+			break;
+		default:
+			log_debug("%s: error handling imsg %d", __func__,
+			    imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	if (!shut)
+		imsg_event_add(iev);
+	else
+		reload_finish();
+}
+
+/*
+ * The helper is gone. Hand its config to main if it got to send all of
+ * it, and start the next reload if one is due.
+ */
+void
+reload_finish(void)
+{
+	struct newd_conf	*xconf = NULL;
+	struct timespec		 now;
+
+	imsg_event_del(iev_reload);
+	imsg_clear(&iev_reload->ibuf);
+	close(iev_reload->ibuf.fd);
+	free(iev_reload);
+	iev_reload = NULL;
+
+	while (waitpid(reload_pid, NULL, 0) == -1 && errno == EINTR)
+		;
+	reload_pid = -1;
+
+	if (reload_complete)
+		xconf = config_image_read(reload_image, reload_imagelen);
+	free(reload_image);
+	reload_image = NULL;
+	reload_imagelen = reload_imagesize = 0;
+	reload_complete = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &reload_started, &now);
+	main_reload_done(xconf, &reload_sources,
+	    now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+	sources_clear(&reload_sources);
+
+	if (reload_pending) {
+		reload_pending = 0;
+		reload_start();
+	}
+}
+
+void
+reload_add_source(struct imsg *imsg)
+{
+	struct reload_source	 rs;
+	struct conf_source	*src;
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(rs))
+		fatalx("%s: invalid IMSG_RELOAD_SOURCE", __func__);
+	memcpy(&rs, imsg->data, sizeof(rs));
+	rs.path[sizeof(rs.path) - 1] = '\0';
+
+	if ((src = calloc(1, sizeof(*src))) == NULL ||
+	    (src->path = strdup(rs.path)) == NULL)
+		fatal(NULL);
+	src->mtime.tv_sec = rs.mtime_sec;
+	src->mtime.tv_nsec = rs.mtime_nsec;
+	src->size = rs.size;
+	src->hash = rs.hash;
+	src->flags = rs.flags;
+	src->yesno = rs.yesno;
+	src->integer = rs.integer;
+	TAILQ_INIT(&src->macros);
+	TAILQ_INSERT_TAIL(&reload_sources, src, entry);
+}
+
+void
+reload_add_groups(struct imsg *imsg)
+{
+	struct conf_source	*src;
+	size_t			 len, n;
+	void			*p;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if ((src = TAILQ_LAST(&reload_sources, conf_sources)) == NULL ||
+	    len % sizeof(*src->groups) != 0)
+		fatalx("%s: invalid IMSG_RELOAD_GROUPS", __func__);
+	n = len / sizeof(*src->groups);
+
+	if ((p = reallocarray(src->groups, src->ngroups + n,
+	    sizeof(*src->groups))) == NULL)
+		fatal(NULL);
+	src->groups = p;
+	memcpy(src->groups[src->ngroups], imsg->data, len);
+	src->ngroups += n;
+	src->groupsmax = src->ngroups;
+}
+
+void
+reload_add_macro(struct imsg *imsg)
+{
+	struct conf_source	*src;
+	struct conf_macro	*m;
+	const char		*nam, *val, *end;
+
+	nam = imsg->data;
+	end = nam + (imsg->hdr.len - IMSG_HEADER_SIZE);
+	if ((src = TAILQ_LAST(&reload_sources, conf_sources)) == NULL ||
+	    (val = memchr(nam, '\0', end - nam)) == NULL || ++val == end ||
+	    memchr(val, '\0', end - val) != end - 1)
+		fatalx("%s: invalid IMSG_RELOAD_MACRO", __func__);
+
+	if ((m = calloc(1, sizeof(*m))) == NULL ||
+	    (m->nam = strdup(nam)) == NULL ||
+	    (m->val = strdup(val)) == NULL)
+		fatal(NULL);
+	TAILQ_INSERT_TAIL(&src->macros, m, entry);
+}
+
+void
+reload_add_image(struct imsg *imsg)
+{
+	size_t	 len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	void	*p;
+
+	if (reload_imagesize - reload_imagelen < len) {
+		reload_imagesize = reload_imagesize ? reload_imagesize * 2 :
+		    1024 * 1024;
+		if (reload_imagesize < reload_imagelen + len)
+			reload_imagesize = reload_imagelen + len;
+		if ((p = realloc(reload_image, reload_imagesize)) == NULL)
+			fatal(NULL);
+		reload_image = p;
+	}
+	memcpy(reload_image + reload_imagelen, imsg->data, len);
+	reload_imagelen += len;
+}
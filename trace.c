@@ -0,0 +1,91 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2026 The newd developers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Flight recorder of the imsgs passing through the calling process.
+ *
+ * imsg_compose_event() and imsg_get_event() append a struct trace_event to
+ * a ring of the last TRACE_RING_SIZE events, overwriting the oldest. Each
+ * process is single threaded and owns its ring, so no locking is needed.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <string.h>
+#include <time.h>
+
+#include "newd.h"
+
+#define TRACE_RING_SIZE	2048
+
+struct trace_event	 trace_ring[TRACE_RING_SIZE];
+uint32_t		 trace_next;	/* free running */
+
+void
+trace_imsg(struct imsgev *iev, int dir, uint16_t type, uint16_t len,
+    uint32_t peerid)
+{
+	struct trace_event	*te;
+	struct timespec		 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	te = &trace_ring[trace_next++ % TRACE_RING_SIZE];
+	te->usec = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	te->peerid = peerid;
+	te->queued = dir == TRACE_OUT ? iev->ibuf.w.queued : iev->ibuf.r.wpos;
+	te->type = type;
+	te->len = len;
+	te->proc = newd_process;
+	te->instance = newd_instance;
+	te->peer = iev->peer;
+	te->peer_instance = iev->peer_instance;
+	te->dir = dir;
+	memset(te->pad, 0, sizeof(te->pad));
+}
+
+/*
+ * Send the ring, oldest event first, as IMSG_CTL_SHOW_TRACE to iev. The
+ * ring is copied before anything is sent, so the reply does not trace
+ * itself.
+ */
+void
+trace_compose(struct imsgev *iev, uint32_t peerid, pid_t pid)
+{
+	static struct trace_event	 snap[TRACE_RING_SIZE];
+	uint32_t			 n, first, i;
+	size_t				 chunk;
+
+	n = trace_next < TRACE_RING_SIZE ? trace_next : TRACE_RING_SIZE;
+	first = trace_next - n;
+	for (i = 0; i < n; i++)
+		snap[i] = trace_ring[(first + i) % TRACE_RING_SIZE];
+
+	for (i = 0; i < n; i += chunk) {
+		chunk = n - i < CTL_TRACE_MAX ? n - i : CTL_TRACE_MAX;
+		imsg_compose_event(iev, IMSG_CTL_SHOW_TRACE, peerid, pid, -1,
+		    &snap[i], chunk * sizeof(snap[0]));
+	}
+}